@@ -839,6 +839,9 @@ _ib_node_rotate_left(struct ib_node *node, struct ib_root *root)
 	right->parent = parent;
 	_ib_child_replace(node, right, parent, root);
 	node->parent = right;
+#ifdef IB_TREE_STATS
+	root->rotations++;
+#endif
 	return right;
 }
 
@@ -855,6 +858,9 @@ _ib_node_rotate_right(struct ib_node *node, struct ib_root *root)
 	left->parent = parent;
 	_ib_child_replace(node, left, parent, root);
 	node->parent = left;
+#ifdef IB_TREE_STATS
+	root->rotations++;
+#endif
 	return left;
 }
 
@@ -893,8 +899,17 @@ _ib_node_height_update(struct ib_node *node)
 	node->height = IB_MAX(h0, h1) + 1;
 }
 
+static inline void
+_ib_node_augment(struct ib_node *node, const struct ib_augment *aug)
+{
+	if (aug) {
+		aug->update(node);
+	}
+}
+
 static inline struct ib_node *
-_ib_node_fix_l(struct ib_node *node, struct ib_root *root)
+_ib_node_fix_l(struct ib_node *node, struct ib_root *root,
+		const struct ib_augment *aug)
 {
 	struct ib_node *right = node->right;
 	int rh0, rh1;
@@ -905,16 +920,21 @@ _ib_node_fix_l(struct ib_node *node, struct ib_root *root)
 		right = _ib_node_rotate_right(right, root);
 		_ib_node_height_update(right->right);
 		_ib_node_height_update(right);
+		_ib_node_augment(right->right, aug);
+		_ib_node_augment(right, aug);
 		/* _ib_node_height_update(node); */
 	}
 	node = _ib_node_rotate_left(node, root);
 	_ib_node_height_update(node->left);
 	_ib_node_height_update(node);
+	_ib_node_augment(node->left, aug);
+	_ib_node_augment(node, aug);
 	return node;
 }
 
 static inline struct ib_node *
-_ib_node_fix_r(struct ib_node *node, struct ib_root *root)
+_ib_node_fix_r(struct ib_node *node, struct ib_root *root,
+		const struct ib_augment *aug)
 {
 	struct ib_node *left = node->left;
 	int rh0, rh1;
@@ -925,16 +945,21 @@ _ib_node_fix_r(struct ib_node *node, struct ib_root *root)
 		left = _ib_node_rotate_left(left, root);
 		_ib_node_height_update(left->left);
 		_ib_node_height_update(left);
+		_ib_node_augment(left->left, aug);
+		_ib_node_augment(left, aug);
 		/* _ib_node_height_update(node); */
 	}
 	node = _ib_node_rotate_right(node, root);
 	_ib_node_height_update(node->right);
 	_ib_node_height_update(node);
+	_ib_node_augment(node->right, aug);
+	_ib_node_augment(node, aug);
 	return node;
 }
 
 static inline void 
-_ib_node_rebalance(struct ib_node *node, struct ib_root *root)
+_ib_node_rebalance(struct ib_node *node, struct ib_root *root,
+		const struct ib_augment *aug)
 {
 	while (node) {
 		int h0 = (int)IB_LEFT_HEIGHT(node);
@@ -948,19 +973,27 @@ _ib_node_rebalance(struct ib_node *node, struct ib_root *root)
 			break;
 		}
 		if (diff <= -2) {
-			node = _ib_node_fix_l(node, root);
+			node = _ib_node_fix_l(node, root, aug);
 		}
 		else if (diff >= 2) {
-			node = _ib_node_fix_r(node, root);
+			node = _ib_node_fix_r(node, root, aug);
 		}
 		node = node->parent;
 	}
 }
 
-void ib_node_post_insert(struct ib_node *node, struct ib_root *root)
+/* augmented data must be propagated before rebalancing, so every 
+ * rotation works on a consistent tree and keeps it consistent */
+static inline void
+_ib_node_post_insert(struct ib_node *node, struct ib_root *root,
+		const struct ib_augment *aug)
 {
 	node->height = 1;
 
+	if (aug) {
+		ib_node_augment_propagate(node, aug);
+	}
+
 	for (node = node->parent; node; node = node->parent) {
 		int h0 = (int)IB_LEFT_HEIGHT(node);
 		int h1 = (int)IB_RIGHT_HEIGHT(node);
@@ -969,15 +1002,17 @@ void ib_node_post_insert(struct ib_node *node, struct ib_root *root)
 		if (node->height == height) break;
 		node->height = height;
 		if (diff <= -2) {
-			node = _ib_node_fix_l(node, root);
+			node = _ib_node_fix_l(node, root, aug);
 		}
 		else if (diff >= 2) {
-			node = _ib_node_fix_r(node, root);
+			node = _ib_node_fix_r(node, root, aug);
 		}
 	}
 }
 
-void ib_node_erase(struct ib_node *node, struct ib_root *root)
+static inline void
+_ib_node_erase(struct ib_node *node, struct ib_root *root,
+		const struct ib_augment *aug)
 {
 	struct ib_node *child, *parent;
 	ASSERTION(node);
@@ -1018,10 +1053,23 @@ void ib_node_erase(struct ib_node *node, struct ib_root *root)
 		}
 	}
 	if (parent) {
-		_ib_node_rebalance(parent, root);
+		if (aug) {
+			ib_node_augment_propagate(parent, aug);
+		}
+		_ib_node_rebalance(parent, root, aug);
 	}
 }
 
+void ib_node_post_insert(struct ib_node *node, struct ib_root *root)
+{
+	_ib_node_post_insert(node, root, NULL);
+}
+
+void ib_node_erase(struct ib_node *node, struct ib_root *root)
+{
+	_ib_node_erase(node, root, NULL);
+}
+
 
 /* avl nodes destroy: fast tear down the whole tree */
 struct ib_node* ib_node_tear(struct ib_root *root, struct ib_node **next)
@@ -1057,10 +1105,251 @@ struct ib_node* ib_node_tear(struct ib_root *root, struct ib_node **next)
 }
 
 
+/*--------------------------------------------------------------------*/
+/* avl - augmented tree                                               */
+/*--------------------------------------------------------------------*/
+
+void ib_node_post_insert_augmented(struct ib_node *node,
+		struct ib_root *root, const struct ib_augment *aug)
+{
+	_ib_node_post_insert(node, root, aug);
+}
+
+void ib_node_erase_augmented(struct ib_node *node, struct ib_root *root,
+		const struct ib_augment *aug)
+{
+	_ib_node_erase(node, root, aug);
+}
+
+/* update augmented data from node up to the root */
+void ib_node_augment_propagate(struct ib_node *node,
+		const struct ib_augment *aug)
+{
+	for (; node; node = node->parent) {
+		aug->update(node);
+	}
+}
+
+
+/*--------------------------------------------------------------------*/
+/* avl - order statistic (augmented with subtree size)                */
+/*--------------------------------------------------------------------*/
+
+static void ib_snode_update(struct ib_node *node)
+{
+	IB_SNODE(node)->size = 1 + IB_SNODE_SIZE(node->left) + 
+		IB_SNODE_SIZE(node->right);
+}
+
+const struct ib_augment ib_snode_augment = { ib_snode_update };
+
+/* returns the k-th (starts from 0) node in order, NULL for overflow */
+struct ib_node *ib_snode_select(struct ib_root *root, size_t k)
+{
+	struct ib_node *node = root->node;
+	while (node) {
+		size_t lsize = IB_SNODE_SIZE(node->left);
+		if (k < lsize) {
+			node = node->left;
+		}
+		else if (k == lsize) {
+			return node;
+		}
+		else {
+			k -= lsize + 1;
+			node = node->right;
+		}
+	}
+	return NULL;
+}
+
+/* returns the number of nodes before the given node */
+size_t ib_snode_rank(const struct ib_node *node)
+{
+	size_t rank = IB_SNODE_SIZE(node->left);
+	for (; node->parent; node = node->parent) {
+		if (node->parent->right == node) {
+			rank += IB_SNODE_SIZE(node->parent->left) + 1;
+		}
+	}
+	return rank;
+}
+
+
+
+/*--------------------------------------------------------------------*/
+/* avl - join and split                                               */
+/*--------------------------------------------------------------------*/
+
+static inline int _ib_node_height(const struct ib_node *node)
+{
+	return (node)? node->height : 0;
+}
+
+/* join two detached trees with a pivot, keys in left < pivot < right,
+ * costs O(|height(left) - height(right)| + 1), returns the new root */
+static struct ib_node *
+_ib_node_join(struct ib_node *left, struct ib_node *pivot, 
+		struct ib_node *right, const struct ib_augment *aug)
+{
+	int hl = _ib_node_height(left);
+	int hr = _ib_node_height(right);
+	struct ib_node *parent = NULL;
+	struct ib_node *node;
+	struct ib_root root;
+	IB_ROOT_STATS_INIT(&root);
+	if (hl <= hr + 1 && hr <= hl + 1) {
+		pivot->left = left;
+		pivot->right = right;
+		pivot->parent = NULL;
+		if (left) left->parent = pivot;
+		if (right) right->parent = pivot;
+		pivot->height = IB_MAX(hl, hr) + 1;
+		_ib_node_augment(pivot, aug);
+		return pivot;
+	}
+	if (hl > hr) {
+		/* walk down the right spine of left to a subtree like right */
+		root.node = left;
+		for (node = left; node && node->height > hr + 1; ) {
+			parent = node;
+			node = node->right;
+		}
+		pivot->left = node;
+		pivot->right = right;
+		parent->right = pivot;
+	}
+	else {
+		root.node = right;
+		for (node = right; node && node->height > hl + 1; ) {
+			parent = node;
+			node = node->left;
+		}
+		pivot->left = left;
+		pivot->right = node;
+		parent->left = pivot;
+	}
+	pivot->parent = parent;
+	if (pivot->left) pivot->left->parent = pivot;
+	if (pivot->right) pivot->right->parent = pivot;
+	_ib_node_height_update(pivot);
+	if (aug) {
+		ib_node_augment_propagate(pivot, aug);
+	}
+	_ib_node_rebalance(parent, &root, aug);
+	return root.node;
+}
+
+/* split the tree before node: nodes less than node go to left, node 
+ * and greater ones go to right, costs O(log n) in total because the
+ * heights of the joined trees are telescoping along the path */
+static void
+_ib_node_split(struct ib_node *node, struct ib_node **left, 
+		struct ib_node **right, const struct ib_augment *aug)
+{
+	struct ib_node *parent = node->parent;
+	struct ib_node *child = node;
+	struct ib_node *l = node->left;
+	struct ib_node *r = node->right;
+	if (l) l->parent = NULL;
+	if (r) r->parent = NULL;
+	r = _ib_node_join(NULL, node, r, aug);
+	while (parent) {
+		struct ib_node *next = parent->parent;
+		struct ib_node *sub;
+		if (parent->left == child) {
+			sub = parent->right;
+			if (sub) sub->parent = NULL;
+			r = _ib_node_join(r, parent, sub, aug);
+		}	else {
+			sub = parent->left;
+			if (sub) sub->parent = NULL;
+			l = _ib_node_join(sub, parent, l, aug);
+		}
+		child = parent;
+		parent = next;
+	}
+	*left = l;
+	*right = r;
+}
+
+/* concatenate two detached trees, keys in left < right */
+static struct ib_node *
+_ib_node_concat(struct ib_node *left, struct ib_node *right, 
+		const struct ib_augment *aug)
+{
+	struct ib_node *pivot;
+	struct ib_root root;
+	if (left == NULL) return right;
+	if (right == NULL) return left;
+	IB_ROOT_STATS_INIT(&root);
+	root.node = right;
+	pivot = ib_node_first(&root);
+	_ib_node_erase(pivot, &root, aug);
+	return _ib_node_join(left, pivot, root.node, aug);
+}
+
+/* join two trees with a pivot, keys in left < pivot < keys in right,
+ * root can be the same as left or right, both of them will be empty */
+void ib_node_join(struct ib_root *root, struct ib_root *left,
+		struct ib_node *pivot, struct ib_root *right, 
+		const struct ib_augment *aug)
+{
+	struct ib_node *l = left->node;
+	struct ib_node *r = right->node;
+	left->node = NULL;
+	right->node = NULL;
+	root->node = _ib_node_join(l, pivot, r, aug);
+}
+
+/* concatenate two trees without pivot, keys in left < keys in right */
+void ib_node_concat(struct ib_root *root, struct ib_root *left,
+		struct ib_root *right, const struct ib_augment *aug)
+{
+	struct ib_node *l = left->node;
+	struct ib_node *r = right->node;
+	left->node = NULL;
+	right->node = NULL;
+	root->node = _ib_node_concat(l, r, aug);
+}
+
+/* split root before node: nodes less than node go to left, node itself
+ * and greater ones go to right, root will be empty unless it is the
+ * same as left or right */
+void ib_node_split(struct ib_root *root, struct ib_node *node,
+		struct ib_root *left, struct ib_root *right,
+		const struct ib_augment *aug)
+{
+	struct ib_node *l, *r;
+	if (node == NULL) {
+		r = NULL;
+		l = root->node;
+	}	else {
+		_ib_node_split(node, &l, &r, aug);
+	}
+	root->node = NULL;
+	left->node = l;
+	right->node = r;
+}
+
 
 /*--------------------------------------------------------------------*/
 /* avltree - friendly interface                                       */
 /*--------------------------------------------------------------------*/
+#ifdef IB_TREE_STATS
+static void _ib_tree_probe(struct ib_tree *tree, size_t depth)
+{
+	tree->stats.searches++;
+	tree->stats.compares += depth;
+	if (depth >= IB_TREE_STATS_DEPTH) depth = IB_TREE_STATS_DEPTH - 1;
+	tree->stats.depth[depth]++;
+}
+#define IB_TREE_PROBE(tree, depth)  _ib_tree_probe(tree, depth)
+#define IB_TREE_COUNT(tree, field, n)  ((tree)->stats.field += (n))
+#else
+#define IB_TREE_PROBE(tree, depth)  ((void)(depth))
+#define IB_TREE_COUNT(tree, field, n)  ((void)0)
+#endif
 
 void ib_tree_init(struct ib_tree *tree,
 	int (*compare)(const void*, const void*), size_t size, size_t offset)
@@ -1070,6 +1359,19 @@ void ib_tree_init(struct ib_tree *tree,
 	tree->size = size;
 	tree->count = 0;
 	tree->compare = compare;
+	tree->augment = NULL;
+	IB_ROOT_STATS_INIT(&tree->root);
+#ifdef IB_TREE_STATS
+	ib_tree_stats_reset(tree);
+#endif
+}
+
+void ib_tree_init_augment(struct ib_tree *tree,
+		int (*compare)(const void*, const void*), size_t size, size_t offset,
+		const struct ib_augment *augment)
+{
+	ib_tree_init(tree, compare, size, offset);
+	tree->augment = augment;
 }
 
 
@@ -1114,10 +1416,13 @@ void *ib_tree_find(struct ib_tree *tree, const void *data)
 	struct ib_node *n = tree->root.node;
 	int (*compare)(const void*, const void*) = tree->compare;
 	int offset = tree->offset;
+	size_t depth = 0;
 	while (n) {
 		void *nd = IB_NODE2DATA(n, offset);
 		int hr = compare(data, nd);
+		depth++;
 		if (hr == 0) {
+			IB_TREE_PROBE(tree, depth);
 			return nd;
 		}
 		else if (hr < 0) {
@@ -1127,6 +1432,7 @@ void *ib_tree_find(struct ib_tree *tree, const void *data)
 			n = n->right;
 		}
 	}
+	IB_TREE_PROBE(tree, depth);
 	return NULL;
 }
 
@@ -1136,9 +1442,11 @@ void *ib_tree_nearest(struct ib_tree *tree, const void *data)
 	struct ib_node *p = NULL;
 	int (*compare)(const void*, const void*) = tree->compare;
 	int offset = tree->offset;
+	size_t depth = 0;
 	while (n) {
 		void *nd = IB_NODE2DATA(n, offset);
 		int hr = compare(data, nd);
+		depth++;
 		p = n;
 		if (n == 0) return nd;
 		else if (hr < 0) {
@@ -1148,6 +1456,7 @@ void *ib_tree_nearest(struct ib_tree *tree, const void *data)
 			n = n->right;
 		}
 	}
+	IB_TREE_PROBE(tree, depth);
 	return (p)? IB_NODE2DATA(p, offset) : NULL;
 }
 
@@ -1160,13 +1469,16 @@ void *ib_tree_add(struct ib_tree *tree, void *data)
 	struct ib_node *node = IB_DATA2NODE(data, tree->offset);
 	int (*compare)(const void*, const void*) = tree->compare;
 	int offset = tree->offset;
+	size_t depth = 0;
 	while (link[0]) {
 		void *pd;
 		int hr;
 		parent = link[0];
 		pd = IB_NODE2DATA(parent, offset);
 		hr = compare(data, pd);
+		depth++;
 		if (hr == 0) {
+			IB_TREE_PROBE(tree, depth);
 			return pd;
 		}	
 		else if (hr < 0) {
@@ -1177,7 +1489,13 @@ void *ib_tree_add(struct ib_tree *tree, void *data)
 		}
 	}
 	ib_node_link(node, parent, link);
-	ib_node_post_insert(node, &tree->root);
+	if (tree->augment == NULL) {
+		ib_node_post_insert(node, &tree->root);
+	}	else {
+		ib_node_post_insert_augmented(node, &tree->root, tree->augment);
+	}
+	IB_TREE_PROBE(tree, depth);
+	IB_TREE_COUNT(tree, inserts, 1);
 	tree->count++;
 	return NULL;
 }
@@ -1187,8 +1505,13 @@ void ib_tree_remove(struct ib_tree *tree, void *data)
 {
 	struct ib_node *node = IB_DATA2NODE(data, tree->offset);
 	if (!ib_node_empty(node)) {
-		ib_node_erase(node, &tree->root);
+		if (tree->augment == NULL) {
+			ib_node_erase(node, &tree->root);
+		}	else {
+			ib_node_erase_augmented(node, &tree->root, tree->augment);
+		}
 		node->parent = node;
+		IB_TREE_COUNT(tree, erases, 1);
 		tree->count--;
 	}
 }
@@ -1200,996 +1523,5394 @@ void ib_tree_replace(struct ib_tree *tree, void *victim, void *newdata)
 	struct ib_node *newnode = IB_DATA2NODE(newdata, tree->offset);
 	ib_node_replace(vicnode, newnode, &tree->root);
 	vicnode->parent = vicnode;
+	if (tree->augment) {
+		/* newdata may carry a different value: fix every ancestor */
+		ib_node_augment_propagate(newnode, tree->augment);
+	}
 }
 
 
-void ib_tree_clear(struct ib_tree *tree, void (*destroy)(void *data))
+/* locate data from the finger: returns the matched data, or NULL with
+ * the empty link where data should be inserted and its parent */
+static void *_ib_tree_finger(struct ib_tree *tree, void *finger, 
+		const void *data, struct ib_node **parent, struct ib_node ***link)
 {
-	while (1) {
-		void *data;
-		if (tree->root.node == NULL) break;
-		data = IB_NODE2DATA(tree->root.node, tree->offset);
-		ib_tree_remove(tree, data);
-		if (destroy) destroy(data);
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	struct ib_node *n = tree->root.node;
+	size_t depth = 0;
+	int hr;
+	parent[0] = NULL;
+	link[0] = &tree->root.node;
+	if (finger && n) {
+		int dir;
+		n = IB_DATA2NODE(finger, offset);
+		dir = compare(data, finger);
+		depth++;
+		if (dir == 0) {
+			IB_TREE_PROBE(tree, depth);
+			return finger;
+		}
+		/* the subtree of n covers data unless the nearest ancestor on
+		 * the side of data is not beyond it, then move to that one */
+		while (1) {
+			struct ib_node *a = n, *c;
+			void *ad;
+			do {
+				c = a;
+				a = a->parent;
+			}	while (a && ((dir > 0)? a->right : a->left) == c);
+			if (a == NULL) break;
+			ad = IB_NODE2DATA(a, offset);
+			hr = compare(data, ad);
+			depth++;
+			if (hr == 0) {
+				IB_TREE_PROBE(tree, depth);
+				return ad;
+			}
+			if ((hr > 0) != (dir > 0)) break;
+			n = a;
+		}
+		/* data is on the side dir of n */
+		parent[0] = n;
+		link[0] = (dir < 0)? &(n->left) : &(n->right);
+	}
+	while (link[0][0]) {
+		void *nd;
+		n = link[0][0];
+		nd = IB_NODE2DATA(n, offset);
+		hr = compare(data, nd);
+		depth++;
+		if (hr == 0) {
+			IB_TREE_PROBE(tree, depth);
+			return nd;
+		}
+		parent[0] = n;
+		link[0] = (hr < 0)? &(n->left) : &(n->right);
 	}
+	IB_TREE_PROBE(tree, depth);
+	return NULL;
 }
 
-
-/*--------------------------------------------------------------------*/
-/* fastbin - fixed size object allocator                              */
-/*--------------------------------------------------------------------*/
-
-void ib_fastbin_init(struct ib_fastbin *fb, size_t obj_size)
+void *ib_tree_find_from(struct ib_tree *tree, void *finger, const void *data)
 {
-	const size_t align = sizeof(void*);
-	size_t need;
-	fb->start = NULL;
-	fb->endup = NULL;
-	fb->next = NULL;
-	fb->pages = NULL;
-	fb->obj_size = (obj_size + align - 1) & (~(align - 1));
-	need = fb->obj_size * 32 + sizeof(void*) + 16;	
-	fb->page_size = (align <= 2)? 8 : 32;
-	while (fb->page_size < need) {
-		fb->page_size *= 2;
-	}
-	fb->maximum = (align <= 2)? fb->page_size : 0x10000;
+	struct ib_node *parent, **link;
+	return _ib_tree_finger(tree, finger, data, &parent, &link);
 }
 
-void ib_fastbin_destroy(struct ib_fastbin *fb)
+/* returns NULL for success, otherwise returns conflict node with same key */
+void *ib_tree_add_from(struct ib_tree *tree, void *finger, void *data)
 {
-	while (fb->pages) {
-		void *page = fb->pages;
-		void *next = IB_NEXT(page);
-		fb->pages = next;
-		ikmem_free(page);
+	struct ib_node *node = IB_DATA2NODE(data, tree->offset);
+	struct ib_node *parent, **link;
+	void *conflict = _ib_tree_finger(tree, finger, data, &parent, &link);
+	if (conflict) {
+		return conflict;
 	}
-	fb->start = NULL;
-	fb->endup = NULL;
-	fb->next = NULL;
-	fb->pages = NULL;
+	ib_node_link(node, parent, link);
+	if (tree->augment == NULL) {
+		ib_node_post_insert(node, &tree->root);
+	}	else {
+		ib_node_post_insert_augmented(node, &tree->root, tree->augment);
+	}
+	IB_TREE_COUNT(tree, inserts, 1);
+	tree->count++;
+	return NULL;
 }
 
-void* ib_fastbin_new(struct ib_fastbin *fb)
+/* lanes finish at different depths, a finished lane takes the next key
+ * and restarts from the root, so every lane stays busy until the end */
+size_t ib_tree_find_batch(struct ib_tree *tree, void **datas, size_t n,
+		void **out)
 {
-	size_t obj_size = fb->obj_size;
-	void *obj;
-	obj = fb->next;
-	if (obj) {
-		fb->next = IB_NEXT(fb->next);
-		return obj;
+	struct ib_node *lane[IB_NODE_LANES];
+	size_t query[IB_NODE_LANES];
+	size_t depth[IB_NODE_LANES];
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	struct ib_node *root = tree->root.node;
+	size_t next = 0, found = 0, active = 0;
+	int i, lanes = 0;
+	if (root == NULL) {
+		for (next = 0; next < n; next++) out[next] = NULL;
+		return 0;
 	}
-	if (fb->start + obj_size > fb->endup) {
-		char *page = (char*)ikmem_malloc(fb->page_size);
-		size_t lineptr = (size_t)page;
-		ASSERTION(page);
-		IB_NEXT(page) = fb->pages;
-		fb->pages = page;
-		lineptr = (lineptr + sizeof(void*) + 15) & (~15);
-		fb->start = (char*)lineptr;
-		fb->endup = (char*)page + fb->page_size;
-		if (fb->page_size < fb->maximum) {
-			fb->page_size *= 2;
+	for (; lanes < IB_NODE_LANES && next < n; lanes++) {
+		lane[lanes] = root;
+		query[lanes] = next++;
+		depth[lanes] = 0;
+		active++;
+	}
+	while (active > 0) {
+		for (i = 0; i < lanes; i++) {
+			struct ib_node *node = lane[i];
+			void *nd;
+			int hr;
+			if (node == NULL) continue;
+			nd = IB_NODE2DATA(node, offset);
+			hr = compare(datas[query[i]], nd);
+			depth[i]++;
+			if (hr != 0) {
+				node = (hr < 0)? node->left : node->right;
+			}
+			if (hr == 0 || node == NULL) {
+				out[query[i]] = (hr == 0)? nd : NULL;
+				found += (hr == 0)? 1 : 0;
+				IB_TREE_PROBE(tree, depth[i]);
+				depth[i] = 0;
+				if (next < n) {
+					query[i] = next++;
+					node = root;
+				}	else {
+					node = NULL;
+					active--;
+				}
+			}
+			else {
+				/* both the links and the key are read next round */
+				IB_PREFETCH(node);
+				IB_PREFETCH(IB_NODE2DATA(node, offset));
+			}
+			lane[i] = node;
 		}
 	}
-	obj = fb->start;
-	fb->start += obj_size;
-	ASSERTION(fb->start <= fb->endup);
-	return obj;
+	return found;
 }
 
-void ib_fastbin_del(struct ib_fastbin *fb, void *ptr)
-{
-	IB_NEXT(ptr) = fb->next;
-	fb->next = ptr;
-}
 
 
-/*--------------------------------------------------------------------*/
-/* string                                                             */
-/*--------------------------------------------------------------------*/
+void ib_tree_clear(struct ib_tree *tree, void (*destroy)(void *data))
+{
+	while (1) {
+		void *data;
+		if (tree->root.node == NULL) break;
+		data = IB_NODE2DATA(tree->root.node, tree->offset);
+		ib_tree_remove(tree, data);
+		if (destroy) destroy(data);
+	}
+}
 
-ib_string* ib_string_new(void)
+/* iterative walk with parent pointers, no stack required */
+void ib_tree_shape(const struct ib_tree *tree, struct ib_tree_shape *shape)
 {
-	struct ib_string* str = (ib_string*)ikmem_malloc(sizeof(ib_string));
-	assert(str);
-	str->ptr = str->sso;
-	str->size = 0;
-	str->capacity = IB_STRING_SSO;
-	str->ptr[0] = 0;
-	return str;
+	struct ib_node *node = tree->root.node;
+	struct ib_node *from = NULL;
+	int depth = 1;
+	shape->count = 0;
+	shape->depth_sum = 0;
+	shape->height = 0;
+	while (node) {
+		struct ib_node *next;
+		if (from == node->parent) {
+			shape->count++;
+			shape->depth_sum += depth;
+			if (depth > shape->height) shape->height = depth;
+			next = (node->left)? node->left : node->right;
+		}
+		else if (from == node->left) {
+			next = node->right;
+		}
+		else {
+			next = NULL;
+		}
+		from = node;
+		if (next) {
+			node = next;
+			depth++;
+		}	else {
+			node = node->parent;
+			depth--;
+		}
+	}
 }
 
+#ifdef IB_TREE_STATS
+void ib_tree_stats(const struct ib_tree *tree, struct ib_tree_stats *stats)
+{
+	stats[0] = tree->stats;
+	stats->rotations = tree->root.rotations;
+}
 
-void ib_string_delete(ib_string *str)
+void ib_tree_stats_reset(struct ib_tree *tree)
 {
-	assert(str);
-	if (str) {
-		if (str->ptr && str->ptr != str->sso) 
-			ikmem_free(str->ptr);
-		str->ptr = NULL;
-		str->size = str->capacity = 0;
-	}
-	ikmem_free(str);
+	memset(&tree->stats, 0, sizeof(tree->stats));
+	tree->root.rotations = 0;
 }
+#endif
 
-ib_string* ib_string_new_size(const char *text, int size)
+
+/* order statistic, require tree to be initialized with ib_snode_augment,
+ * select returns the k-th (starts from 0) data or NULL for overflow */
+void *ib_tree_select(struct ib_tree *tree, size_t k)
 {
-	struct ib_string *str = ib_string_new();
-	size = (size > 0)? size : 0;
-	if (size > 0 && text) {
-		ib_string_resize(str, size);
-		memcpy(str->ptr, text, size);
-	}
-	return str;
+	struct ib_node *node;
+	ASSERTION(tree->augment == &ib_snode_augment);
+	node = ib_snode_select(&tree->root, k);
+	if (!node) return NULL;
+	return IB_NODE2DATA(node, tree->offset);
 }
 
-ib_string* ib_string_new_from(const char *text)
+/* returns the number of nodes before the data (must be in the tree) */
+size_t ib_tree_rank(struct ib_tree *tree, const void *data)
 {
-	return ib_string_new_size(text, (text)? ((int)strlen(text)) : 0);
+	ASSERTION(tree->augment == &ib_snode_augment);
+	return ib_snode_rank(IB_DATA2NODE(data, tree->offset));
 }
 
-static void _ib_string_set_capacity(ib_string *str, int capacity)
+/* count nodes less than (or equal to, if inclusive) the key */
+static size_t 
+_ib_tree_count_below(struct ib_tree *tree, const void *data, int inclusive)
 {
-	assert(str);
-	assert(capacity >= 0);
-	if (capacity <= IB_STRING_SSO) {
-		capacity = IB_STRING_SSO;
-		if (str->ptr != str->sso) {
-			if (str->size > 0) {
-				int csize = (str->size < capacity) ? str->size : capacity;
-				memcpy(str->sso, str->ptr, csize);
-			}
-			ikmem_free(str->ptr);
-			str->ptr = str->sso;
-			str->capacity = IB_STRING_SSO;
+	struct ib_node *n = tree->root.node;
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	size_t count = 0;
+	while (n) {
+		int hr = compare(data, IB_NODE2DATA(n, offset));
+		if (hr > 0 || (hr == 0 && inclusive)) {
+			count += IB_SNODE_SIZE(n->left) + 1;
+			n = n->right;
+		}
+		else {
+			n = n->left;
 		}
 	}
-	else {
-		char *ptr = (char*)ikmem_malloc(capacity + 2);
-		int csize = (capacity < str->size) ? capacity : str->size;
-		assert(ptr);
-		if (csize > 0) {
-			memcpy(ptr, str->ptr, csize);
+	return count;
+}
+
+/* count nodes in [lo, hi], lo and hi are temporary structures with keys */
+size_t ib_tree_count_range(struct ib_tree *tree,
+		const void *lo, const void *hi)
+{
+	size_t c1, c2;
+	ASSERTION(tree->augment == &ib_snode_augment);
+	c1 = _ib_tree_count_below(tree, lo, 0);
+	c2 = _ib_tree_count_below(tree, hi, 1);
+	return (c2 > c1)? (c2 - c1) : 0;
+}
+
+#ifndef IB_NODE_MAX_DEPTH
+#define IB_NODE_MAX_DEPTH	96
+#endif
+
+/* range aggregate: calls fold() with O(log n) disjoint pieces in order */
+void ib_tree_aggregate(struct ib_tree *tree, const void *lo, const void *hi,
+		void (*fold)(void *ctx, void *data, int whole), void *ctx)
+{
+	struct ib_node *stack[IB_NODE_MAX_DEPTH];
+	struct ib_node *split = tree->root.node;
+	struct ib_node *node;
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	int top = 0;
+	/* find the topmost node inside the range */
+	while (split) {
+		void *sd = IB_NODE2DATA(split, offset);
+		if (lo && compare(lo, sd) > 0) split = split->right;
+		else if (hi && compare(hi, sd) < 0) split = split->left;
+		else break;
+	}
+	if (split == NULL) return;
+	/* left boundary: pieces are found top-down but must fold bottom-up */
+	for (node = split->left; node; ) {
+		if (lo == NULL || compare(lo, IB_NODE2DATA(node, offset)) <= 0) {
+			ASSERTION(top < IB_NODE_MAX_DEPTH);
+			stack[top++] = node;
+			node = node->left;
+		}	else {
+			node = node->right;
+		}
+	}
+	while (top > 0) {
+		node = stack[--top];
+		fold(ctx, IB_NODE2DATA(node, offset), 0);
+		if (node->right) fold(ctx, IB_NODE2DATA(node->right, offset), 1);
+	}
+	fold(ctx, IB_NODE2DATA(split, offset), 0);
+	/* right boundary */
+	for (node = split->right; node; ) {
+		if (hi == NULL || compare(hi, IB_NODE2DATA(node, offset)) >= 0) {
+			if (node->left) fold(ctx, IB_NODE2DATA(node->left, offset), 1);
+			fold(ctx, IB_NODE2DATA(node, offset), 0);
+			node = node->right;
+		}	else {
+			node = node->left;
 		}
-		if (str->ptr != str->sso)
-			ikmem_free(str->ptr);
-		str->ptr = ptr;
-		str->capacity = capacity;
 	}
-	if (str->size > str->capacity)
-		str->size = str->capacity;
-	str->ptr[str->size] = 0;
 }
 
-ib_string* ib_string_resize(ib_string *str, int newsize)
+
+/* returns the first node >= data (or > data if upper is set) */
+static struct ib_node *
+_ib_tree_bound(struct ib_tree *tree, const void *data, int upper)
 {
-	assert(str && newsize >= 0);
-	if (newsize > str->capacity) {
-		int capacity = str->capacity * 2;
-		if (capacity < newsize) {
-			while (capacity < newsize) {
-				capacity = capacity * 2;
-			}
+	struct ib_node *n = tree->root.node;
+	struct ib_node *bound = NULL;
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	size_t depth = 0;
+	while (n) {
+		int hr = compare(data, IB_NODE2DATA(n, offset));
+		depth++;
+		if (hr < 0 || (hr == 0 && upper == 0)) {
+			bound = n;
+			n = n->left;
+		}
+		else {
+			n = n->right;
 		}
-		_ib_string_set_capacity(str, capacity);
 	}
-	str->size = newsize;
-	str->ptr[str->size] = 0;
-	return str;
+	IB_TREE_PROBE(tree, depth);
+	return bound;
 }
 
-ib_string* ib_string_reserve(ib_string *str, int newsize)
+/* returns the first data >= key, NULL for none */
+void *ib_tree_lower_bound(struct ib_tree *tree, const void *data)
 {
-	int size = (newsize >= str->size)? newsize : str->size;
-	_ib_string_set_capacity(str, size);
-	return str;
+	struct ib_node *node = _ib_tree_bound(tree, data, 0);
+	if (!node) return NULL;
+	return IB_NODE2DATA(node, tree->offset);
 }
 
-ib_string* ib_string_insert(ib_string *str, int pos, 
-		const void *data, int size)
+/* returns the first data > key, NULL for none */
+void *ib_tree_upper_bound(struct ib_tree *tree, const void *data)
 {
-	int current = str->size;
-	if (pos < 0 || pos > str->size)
+	struct ib_node *node = _ib_tree_bound(tree, data, 1);
+	if (!node) return NULL;
+	return IB_NODE2DATA(node, tree->offset);
+}
+
+/* iterate [lo, hi] (NULL for unbounded), returns the first data */
+void *ib_tree_range_first(struct ib_tree_range *range, 
+		struct ib_tree *tree, const void *lo, const void *hi)
+{
+	range->tree = tree;
+	range->node = NULL;
+	range->endup = NULL;
+	if (lo && hi && tree->compare(lo, hi) > 0) {
 		return NULL;
-	ib_string_resize(str, str->size + size);
-	if (pos < current) {
-		memmove(str->ptr + pos + size, str->ptr + pos, current - pos);
-	}
-	if (data) {
-		memcpy(str->ptr + pos, data, size);
 	}
-	return str;
+	if (lo) range->node = _ib_tree_bound(tree, lo, 0);
+	else range->node = ib_node_first(&tree->root);
+	if (hi) range->endup = _ib_tree_bound(tree, hi, 1);
+	return ib_tree_range_next(range);
 }
 
-ib_string* ib_string_insert_c(ib_string *str, int pos, char c)
+/* returns next data in range, NULL for the end */
+void *ib_tree_range_next(struct ib_tree_range *range)
 {
-	int current = str->size;
-	if (pos < 0 || pos > str->size)
+	struct ib_node *node = range->node;
+	if (node == range->endup) {
 		return NULL;
-	ib_string_resize(str, str->size + 1);
-	if (pos < current) {
-		memmove(str->ptr + pos + 1, str->ptr + pos, current - pos);
 	}
-	str->ptr[pos] = c;
-	return str;
+	range->node = ib_node_next(node);
+	return IB_NODE2DATA(node, range->tree->offset);
 }
 
-ib_string* ib_string_erase(ib_string *str, int pos, int size)
+/* remove [lo, hi] (NULL for unbounded) with split/join, costs 
+ * O(log n + k) and returns the number of removed nodes */
+size_t ib_tree_erase_range(struct ib_tree *tree, const void *lo,
+		const void *hi, void (*destroy)(void *data))
 {
-	int current = str->size;
-	if (pos >= current) return 0;
-	if (pos + size >= current) size = current - pos;
-	if (size == 0) return 0;
-	memmove(str->ptr + pos, str->ptr + pos + size, current - pos - size);
-	return ib_string_resize(str, current - size);
+	struct ib_node *first, *endup, *left, *middle, *right;
+	const struct ib_augment *aug = tree->augment;
+	struct ib_root root;
+	size_t count = 0;
+	if (lo && hi && tree->compare(lo, hi) > 0) {
+		return 0;
+	}
+	if (lo) first = _ib_tree_bound(tree, lo, 0);
+	else first = ib_node_first(&tree->root);
+	if (hi) endup = _ib_tree_bound(tree, hi, 1);
+	else endup = NULL;
+	if (first == NULL || first == endup) {
+		return 0;
+	}
+	_ib_node_split(first, &left, &middle, aug);
+	right = NULL;
+	if (endup) {
+		_ib_node_split(endup, &middle, &right, aug);
+	}
+	tree->root.node = _ib_node_concat(left, right, aug);
+	/* tear down the detached range without rebalancing */
+	IB_ROOT_STATS_INIT(&root);
+	root.node = middle;
+	endup = NULL;
+	while (root.node) {
+		struct ib_node *node = ib_node_tear(&root, &endup);
+		ib_node_init(node);
+		count++;
+		if (destroy) destroy(IB_NODE2DATA(node, tree->offset));
+	}
+	IB_TREE_COUNT(tree, erases, count);
+	tree->count -= count;
+	return count;
 }
 
-int ib_string_compare(const struct ib_string *a, const struct ib_string *b)
+static size_t _ib_node_count(const struct ib_node *node)
 {
-	int minsize = (a->size < b->size)? a->size : b->size;
-	int hr = memcmp(a->ptr, b->ptr, minsize);
-	if (hr < 0) return -1;
-	else if (hr > 0) return 1;
-	if (a->size < b->size) return -1;
-	else if (a->size > b->size) return 1;
+	size_t count = 0;
+	for (; node; node = node->right) {
+		count += _ib_node_count(node->left) + 1;
+	}
+	return count;
+}
+
+/* move nodes >= key into right, the node split is O(log n) but the 
+ * count of a plain tree must be walked, so it is O(n) unless the tree
+ * uses ib_snode_augment */
+void ib_tree_split(struct ib_tree *tree, const void *data, 
+		struct ib_tree *right)
+{
+	struct ib_node *node = _ib_tree_bound(tree, data, 0);
+	ib_tree_init_augment(right, tree->compare, tree->size, tree->offset,
+			tree->augment);
+	if (node == NULL) {
+		return;
+	}
+	ib_node_split(&tree->root, node, &tree->root, &right->root, 
+			tree->augment);
+	if (tree->augment == &ib_snode_augment) {
+		right->count = IB_SNODE_SIZE(right->root.node);
+	}
+	/* walk the side with the lower height: a side of height h has at 
+	 * most 2^h - 1 nodes, cheap when splitting near either end, but up
+	 * to about n/2 nodes for a split in the middle */
+	else if (_ib_node_height(right->root.node) <= 
+			_ib_node_height(tree->root.node)) {
+		right->count = _ib_node_count(right->root.node);
+	}
+	else {
+		right->count = tree->count - _ib_node_count(tree->root.node);
+	}
+	tree->count -= right->count;
+}
+
+/* move all nodes of right into tree in O(log n), keys in tree must be
+ * less than keys in right, returns 0 for success, -1 for overlapping */
+int ib_tree_join(struct ib_tree *tree, struct ib_tree *right)
+{
+	void *last = ib_tree_last(tree);
+	void *first = ib_tree_first(right);
+	if (last && first && tree->compare(last, first) >= 0) {
+		return -1;
+	}
+	ib_node_concat(&tree->root, &tree->root, &right->root, 
+			tree->augment);
+	tree->count += right->count;
+	right->count = 0;
 	return 0;
 }
 
 
-ib_string* ib_string_assign(ib_string *str, const char *src)
+/*--------------------------------------------------------------------*/
+/* splay tree - self-adjusting tree on the ib_node layout             */
+/*--------------------------------------------------------------------*/
+
+/* move node above its parent */
+static inline void _ib_splay_rotate(struct ib_node *node, 
+		struct ib_root *root)
 {
-	return ib_string_assign_size(str, src, (int)strlen(src));
+	struct ib_node *parent = node->parent;
+	if (parent->left == node) {
+		_ib_node_rotate_right(parent, root);
+	}	else {
+		_ib_node_rotate_left(parent, root);
+	}
 }
 
-ib_string* ib_string_assign_size(ib_string *str, const char *src, int size)
+static void _ib_splay_node(struct ib_node *node, struct ib_root *root,
+		int semi)
 {
-	assert(size >= 0);
-	ib_string_resize(str, size);
-	if (src) {
-		memcpy(str->ptr, src, size);
+	while (node->parent) {
+		struct ib_node *parent = node->parent;
+		struct ib_node *gparent = parent->parent;
+		if (gparent == NULL) {
+			_ib_splay_rotate(node, root);
+		}
+		else if ((gparent->left == parent) == (parent->left == node)) {
+			/* zig-zig: semi-splay stops at parent and goes on from it */
+			_ib_splay_rotate(parent, root);
+			if (semi) node = parent;
+			else _ib_splay_rotate(node, root);
+		}
+		else {
+			_ib_splay_rotate(node, root);
+			_ib_splay_rotate(node, root);
+		}
 	}
-	return str;
 }
 
+static inline void _ib_splay_access(struct ib_splay *tree, 
+		struct ib_node *node)
+{
+	if (tree->period > 1) {
+		if (++tree->ticks < tree->period) return;
+		tree->ticks = 0;
+	}
+	_ib_splay_node(node, &tree->root, tree->semi);
+}
 
-ib_string* ib_string_append(ib_string *str, const char *src)
+void ib_splay_init(struct ib_splay *tree,
+		int (*compare)(const void*, const void*), size_t size, size_t offset)
 {
-	return ib_string_append_size(str, src, (int)strlen(src));
+	tree->root.node = NULL;
+	IB_ROOT_STATS_INIT(&tree->root);
+	tree->offset = offset;
+	tree->size = size;
+	tree->count = 0;
+	tree->compare = compare;
+	tree->semi = 0;
+	tree->period = 1;
+	tree->ticks = 0;
 }
 
+void ib_splay_config(struct ib_splay *tree, int semi, unsigned int period)
+{
+	tree->semi = semi;
+	tree->period = (period < 1)? 1 : period;
+	tree->ticks = 0;
+}
 
-ib_string* ib_string_append_size(ib_string *str, const char *src, int size)
+void *ib_splay_first(struct ib_splay *tree)
 {
-	return ib_string_insert(str, str->size, src, size);
+	struct ib_node *node = ib_node_first(&tree->root);
+	if (!node) return NULL;
+	return IB_NODE2DATA(node, tree->offset);
 }
 
-ib_string* ib_string_append_c(ib_string *str, char c)
+void *ib_splay_last(struct ib_splay *tree)
 {
-	ib_string_resize(str, str->size + 1);
-	str->ptr[str->size - 1] = c;
-	return str;
+	struct ib_node *node = ib_node_last(&tree->root);
+	if (!node) return NULL;
+	return IB_NODE2DATA(node, tree->offset);
 }
 
-ib_string* ib_string_prepend(ib_string *str, const char *src)
+void *ib_splay_next(struct ib_splay *tree, void *data)
 {
-	return ib_string_prepend_size(str, src, (int)strlen(src));
+	struct ib_node *nn;
+	if (!data) return NULL;
+	nn = ib_node_next(IB_DATA2NODE(data, tree->offset));
+	if (!nn) return NULL;
+	return IB_NODE2DATA(nn, tree->offset);
 }
 
-ib_string* ib_string_prepend_size(ib_string *str, const char *src, int size)
+void *ib_splay_prev(struct ib_splay *tree, void *data)
 {
-	return ib_string_insert(str, 0, src, size);
+	struct ib_node *nn;
+	if (!data) return NULL;
+	nn = ib_node_prev(IB_DATA2NODE(data, tree->offset));
+	if (!nn) return NULL;
+	return IB_NODE2DATA(nn, tree->offset);
 }
 
-ib_string* ib_string_prepend_c(ib_string *str, char c)
+/* returns the matched node, or the last node visited */
+static struct ib_node *_ib_splay_search(struct ib_splay *tree, 
+		const void *data, int *hr)
 {
-	int current = str->size;
-	ib_string_resize(str, current + 1);
-	if (current > 0) {
-		memmove(str->ptr + 1, str->ptr, current);
+	struct ib_node *n = tree->root.node;
+	struct ib_node *p = NULL;
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	hr[0] = -1;
+	while (n) {
+		p = n;
+		hr[0] = compare(data, IB_NODE2DATA(n, offset));
+		if (hr[0] == 0) break;
+		n = (hr[0] < 0)? n->left : n->right;
 	}
-	str->ptr[0] = c;
-	return str;
+	return p;
 }
 
-ib_string* ib_string_rewrite(ib_string *str, int pos, const char *src)
+void *ib_splay_find(struct ib_splay *tree, const void *data)
 {
-	return ib_string_rewrite_size(str, pos, src, (int)strlen(src));
+	int hr;
+	struct ib_node *node = _ib_splay_search(tree, data, &hr);
+	if (node == NULL) return NULL;
+	/* splay the last visited node on miss too, like top-down splay */
+	_ib_splay_access(tree, node);
+	return (hr == 0)? IB_NODE2DATA(node, tree->offset) : NULL;
 }
 
-ib_string* ib_string_rewrite_size(ib_string *str, int pos, 
-		const char *src, int size)
+void *ib_splay_nearest(struct ib_splay *tree, const void *data)
 {
-	if (pos < 0) size += pos, pos = 0;
-	if (pos + size >= str->size) size = str->size - pos;
-	if (size <= 0) return str;
-	if (src) {
-		memcpy(str->ptr + pos, src, size);
+	int hr;
+	struct ib_node *node = _ib_splay_search(tree, data, &hr);
+	if (node == NULL) return NULL;
+	_ib_splay_access(tree, node);
+	return IB_NODE2DATA(node, tree->offset);
+}
+
+void *ib_splay_add(struct ib_splay *tree, void *data)
+{
+	struct ib_node *node = IB_DATA2NODE(data, tree->offset);
+	struct ib_node *parent;
+	int hr;
+	parent = _ib_splay_search(tree, data, &hr);
+	if (parent == NULL) {
+		ib_node_link(node, NULL, &tree->root.node);
 	}
-	return str;
+	else if (hr == 0) {
+		_ib_splay_access(tree, parent);
+		return IB_NODE2DATA(parent, tree->offset);
+	}
+	else {
+		ib_node_link(node, parent, (hr < 0)? 
+				&parent->left : &parent->right);
+	}
+	tree->count++;
+	_ib_splay_access(tree, node);
+	return NULL;
+}
+
+void ib_splay_remove(struct ib_splay *tree, void *data)
+{
+	struct ib_node *node = IB_DATA2NODE(data, tree->offset);
+	struct ib_node *left, *right;
+	if (ib_node_empty(node)) return;
+	/* bring it to the root then join both sides under the maximum of
+	 * the left side */
+	_ib_splay_node(node, &tree->root, 0);
+	left = node->left;
+	right = node->right;
+	if (left == NULL) {
+		tree->root.node = right;
+		if (right) right->parent = NULL;
+	}	else {
+		struct ib_node *max = left;
+		left->parent = NULL;
+		tree->root.node = left;
+		while (max->right) max = max->right;
+		_ib_splay_node(max, &tree->root, 0);
+		max->right = right;
+		if (right) right->parent = max;
+	}
+	node->parent = node;
+	tree->count--;
+}
+
+void ib_splay_replace(struct ib_splay *tree, void *victim, void *newdata)
+{
+	struct ib_node *vicnode = IB_DATA2NODE(victim, tree->offset);
+	struct ib_node *newnode = IB_DATA2NODE(newdata, tree->offset);
+	ib_node_replace(vicnode, newnode, &tree->root);
+	vicnode->parent = vicnode;
 }
 
+void ib_splay_clear(struct ib_splay *tree, void (*destroy)(void *data))
+{
+	struct ib_node *next = NULL;
+	while (1) {
+		struct ib_node *node = ib_node_tear(&tree->root, &next);
+		if (node == NULL) break;
+		ib_node_init(node);
+		if (destroy) destroy(IB_NODE2DATA(node, tree->offset));
+	}
+	tree->count = 0;
+}
 
 
 /*--------------------------------------------------------------------*/
-/* static hash table (closed hash table with avlnode)                 */
+/* frozen tree - read-only records in implicit level-order layout     */
 /*--------------------------------------------------------------------*/
 
+/* children of k are 2k and 2k+1, in-order walk without a stack */
+#define IB_FROZEN_RECORD(fz, k) ((fz)->base + ((k) - 1) * (fz)->size)
 
-void ib_hash_init(struct ib_hash_table *ht, 
-		size_t (*hash)(const void *key),
-		int (*compare)(const void *key1, const void *key2))
+/* dir = 0 for the leftmost, 1 for the rightmost */
+static inline size_t _ib_frozen_head(size_t count, int dir)
 {
-	size_t i;
-	ht->count = 0;
-	ht->index_size = IB_HASH_INIT_SIZE;
-	ht->index_mask = ht->index_size - 1;
-	ht->hash = hash;
-	ht->compare = compare;
-	ilist_init(&ht->head);
-	ht->index = ht->init;
-	for (i = 0; i < IB_HASH_INIT_SIZE; i++) {
-		ht->index[i].avlroot.node = NULL;
-		ilist_init(&(ht->index[i].node));
+	size_t k = 1;
+	if (count == 0) return 0;
+	while (k * 2 + dir <= count) k = k * 2 + dir;
+	return k;
+}
+
+/* in-order successor (dir = 1) or predecessor (dir = 0), 0 for end */
+static inline size_t _ib_frozen_step(size_t k, size_t count, int dir)
+{
+	if (k * 2 + dir <= count) {
+		k = k * 2 + dir;
+		while (k * 2 + (1 - dir) <= count) k = k * 2 + (1 - dir);
+		return k;
+	}
+	/* climb while k is the child on the same side */
+	while ((k & 1) == (size_t)dir) k >>= 1;
+	return k >> 1;
+}
+
+/* count and size must fit the 32 bit fields of the image header */
+static int _ib_frozen_alloc(struct ib_frozen *fz, size_t count, 
+		size_t size, int (*compare)(const void*, const void*))
+{
+	const size_t limit = (size_t)0xfffffffful;
+	fz->base = NULL;
+	fz->buffer = NULL;
+	fz->count = 0;
+	fz->size = size;
+	fz->compare = compare;
+	if (count > limit || size > limit || size == 0 || 
+		(count > 0 && count > ((size_t)-1) / size)) {
+		return -1;
 	}
+	fz->count = count;
+	if (count > 0) {
+		fz->buffer = ikmem_malloc(count * size);
+		if (fz->buffer == NULL) {
+			fz->count = 0;
+			return -1;
+		}
+		fz->base = (char*)fz->buffer;
+	}
+	return 0;
 }
 
-struct ib_hash_node* ib_hash_node_first(struct ib_hash_table *ht)
+int ib_frozen_freeze(struct ib_frozen *fz, struct ib_tree *tree,
+		size_t size, void (*copy)(void *record, const void *data),
+		int (*compare)(const void*, const void*))
 {
-	struct ILISTHEAD *head = ht->head.next;
-	if (head != &ht->head) {
-		struct ib_hash_index *index = 
-			ilist_entry(head, struct ib_hash_index, node);
-		struct ib_node *avlnode = ib_node_first(&index->avlroot);
-		if (avlnode == NULL) return NULL;
-		return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+	struct ib_node *node;
+	size_t k;
+	if (copy == NULL) {
+		size = tree->size;
+		compare = tree->compare;
 	}
-	return NULL;
+	if (_ib_frozen_alloc(fz, tree->count, size, compare)) {
+		return -1;
+	}
+	k = _ib_frozen_head(fz->count, 0);
+	for (node = ib_node_first(&tree->root); node; node = ib_node_next(node)) {
+		char *record = IB_FROZEN_RECORD(fz, k);
+		const void *data = IB_NODE2DATA(node, tree->offset);
+		ASSERTION(k > 0);
+		if (copy) {
+			copy(record, data);
+		}	else {
+			/* drop the node links, no heap address in the image */
+			memcpy(record, data, size);
+			memset(record + tree->offset, 0, sizeof(struct ib_node));
+		}
+		k = _ib_frozen_step(k, fz->count, 1);
+	}
+	return 0;
 }
 
-struct ib_hash_node* ib_hash_node_last(struct ib_hash_table *ht)
+int ib_frozen_build(struct ib_frozen *fz, const void *records, 
+		size_t count, size_t size, int (*compare)(const void*, const void*))
 {
-	struct ILISTHEAD *head = ht->head.prev;
-	if (head != &ht->head) {
-		struct ib_hash_index *index = 
-			ilist_entry(head, struct ib_hash_index, node);
-		struct ib_node *avlnode = ib_node_last(&index->avlroot);
-		if (avlnode == NULL) return NULL;
-		return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+	const char *src = (const char*)records;
+	size_t i, k;
+	if (_ib_frozen_alloc(fz, count, size, compare)) {
+		return -1;
 	}
-	return NULL;
+	k = _ib_frozen_head(count, 0);
+	for (i = 0; i < count; i++, src += size) {
+		memcpy(IB_FROZEN_RECORD(fz, k), src, size);
+		k = _ib_frozen_step(k, count, 1);
+	}
+	return 0;
 }
 
-struct ib_hash_node* ib_hash_node_next(struct ib_hash_table *ht, 
-		struct ib_hash_node *node)
+void ib_frozen_destroy(struct ib_frozen *fz)
 {
-	struct ib_node *avlnode;
-	struct ib_hash_index *index;
-	struct ILISTHEAD *listnode;
-	if (node == NULL) return NULL;
-	avlnode = ib_node_next(&node->avlnode);
-	if (avlnode) {
-		return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+	if (fz->buffer) {
+		ikmem_free(fz->buffer);
 	}
-	index = &(ht->index[node->hash & ht->index_mask]);
-	listnode = index->node.next;
-	if (listnode == &(ht->head)) {
-		return NULL;
+	fz->buffer = NULL;
+	fz->base = NULL;
+	fz->count = 0;
+}
+
+/* branch free descent: the path bits record every turn, the answer is
+ * the last node where we turned left */
+static size_t _ib_frozen_bound(const struct ib_frozen *fz, 
+		const void *data, int upper)
+{
+	int (*compare)(const void*, const void*) = fz->compare;
+	size_t count = fz->count;
+	size_t k = 1;
+	while (k <= count) {
+		int hr = compare(IB_FROZEN_RECORD(fz, k), data);
+		k = k * 2 + ((upper)? (hr <= 0) : (hr < 0));
 	}
-	index = ilist_entry(listnode, struct ib_hash_index, node);
-	avlnode = ib_node_first(&index->avlroot);
-	if (avlnode == NULL) return NULL;
-	return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+	while (k & 1) k >>= 1;
+	return k >> 1;
 }
 
-struct ib_hash_node* ib_hash_node_prev(struct ib_hash_table *ht, 
-		struct ib_hash_node *node)
+void *ib_frozen_find(const struct ib_frozen *fz, const void *data)
 {
-	struct ib_node *avlnode;
-	struct ib_hash_index *index;
-	struct ILISTHEAD *listnode;
-	if (node == NULL) return NULL;
-	avlnode = ib_node_prev(&node->avlnode);
-	if (avlnode) {
-		return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+	size_t k = _ib_frozen_bound(fz, data, 0);
+	char *record;
+	if (k == 0) return NULL;
+	record = IB_FROZEN_RECORD(fz, k);
+	return (fz->compare(record, data) == 0)? record : NULL;
+}
+
+void *ib_frozen_lower_bound(const struct ib_frozen *fz, const void *data)
+{
+	size_t k = _ib_frozen_bound(fz, data, 0);
+	return (k == 0)? NULL : IB_FROZEN_RECORD(fz, k);
+}
+
+void *ib_frozen_upper_bound(const struct ib_frozen *fz, const void *data)
+{
+	size_t k = _ib_frozen_bound(fz, data, 1);
+	return (k == 0)? NULL : IB_FROZEN_RECORD(fz, k);
+}
+
+void *ib_frozen_first(const struct ib_frozen *fz)
+{
+	size_t k = _ib_frozen_head(fz->count, 0);
+	return (k == 0)? NULL : IB_FROZEN_RECORD(fz, k);
+}
+
+void *ib_frozen_last(const struct ib_frozen *fz)
+{
+	size_t k = _ib_frozen_head(fz->count, 1);
+	return (k == 0)? NULL : IB_FROZEN_RECORD(fz, k);
+}
+
+void *ib_frozen_next(const struct ib_frozen *fz, const void *record)
+{
+	size_t k;
+	if (record == NULL) return NULL;
+	k = ((size_t)((const char*)record - fz->base)) / fz->size + 1;
+	k = _ib_frozen_step(k, fz->count, 1);
+	return (k == 0)? NULL : IB_FROZEN_RECORD(fz, k);
+}
+
+void *ib_frozen_prev(const struct ib_frozen *fz, const void *record)
+{
+	size_t k;
+	if (record == NULL) return NULL;
+	k = ((size_t)((const char*)record - fz->base)) / fz->size + 1;
+	k = _ib_frozen_step(k, fz->count, 0);
+	return (k == 0)? NULL : IB_FROZEN_RECORD(fz, k);
+}
+
+size_t ib_frozen_image_size(const struct ib_frozen *fz)
+{
+	return sizeof(struct ib_frozen_header) + fz->count * fz->size;
+}
+
+size_t ib_frozen_export(const struct ib_frozen *fz, void *image)
+{
+	struct ib_frozen_header header;
+	char *ptr = (char*)image;
+	memset(&header, 0, sizeof(header));
+	header.magic = IB_FROZEN_MAGIC;
+	header.version = IB_FROZEN_VERSION;
+	header.size = (IUINT32)fz->size;
+	header.count = (IUINT32)fz->count;
+	header.endian = 0x01020304;
+	memcpy(ptr, &header, sizeof(header));
+	if (fz->count > 0) {
+		memcpy(ptr + sizeof(header), fz->base, fz->count * fz->size);
 	}
-	index = &(ht->index[node->hash & ht->index_mask]);
-	listnode = index->node.prev;
-	if (listnode == &(ht->head)) {
-		return NULL;
+	return ib_frozen_image_size(fz);
+}
+
+int ib_frozen_attach(struct ib_frozen *fz, const void *image, size_t length,
+		int (*compare)(const void*, const void*))
+{
+	struct ib_frozen_header header;
+	if (length < sizeof(header)) return -1;
+	memcpy(&header, image, sizeof(header));
+	if (header.magic != IB_FROZEN_MAGIC || 
+		header.version != IB_FROZEN_VERSION ||
+		header.endian != 0x01020304 || header.size == 0) {
+		return -1;
 	}
-	index = ilist_entry(listnode, struct ib_hash_index, node);
-	avlnode = ib_node_last(&index->avlroot);
-	if (avlnode == NULL) return NULL;
-	return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+	if ((length - sizeof(header)) / header.size < header.count) {
+		return -1;
+	}
+	fz->base = (char*)image + sizeof(header);
+	fz->count = header.count;
+	fz->size = header.size;
+	fz->compare = compare;
+	fz->buffer = NULL;
+	return 0;
 }
 
-struct ib_hash_node* ib_hash_find(struct ib_hash_table *ht,
-		const struct ib_hash_node *node)
+
+/*--------------------------------------------------------------------*/
+/* compact avl - no parent pointer, balance packed in the left link   */
+/*--------------------------------------------------------------------*/
+
+/* balance code in the low bits: 0 for even, 1 for left heavy and 2 
+ * for right heavy, a zeroed node is a balanced leaf */
+static inline int _ib_cnode_balance(const struct ib_cnode *node)
 {
-	size_t hash = node->hash;
-	const void *key = node->key;
-	struct ib_hash_index *index = &(ht->index[hash & ht->index_mask]);
-	struct ib_node *avlnode = index->avlroot.node;
-	int (*compare)(const void *, const void *) = ht->compare;
-	while (avlnode) {
-		struct ib_hash_node *snode = 
-			IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
-		size_t shash = snode->hash;
-		if (hash == shash) {
-			int hc = compare(key, snode->key);
-			if (hc == 0) return snode;
-			avlnode = (hc < 0)? avlnode->left : avlnode->right;
-		}
-		else {
-			avlnode = (hash < shash)? avlnode->left : avlnode->right;
+	static const int balance[4] = { 0, -1, 1, 0 };
+	return balance[(size_t)(node->child[0]) & 3];
+}
+
+static inline void 
+_ib_cnode_set_balance(struct ib_cnode *node, int balance)
+{
+	size_t code = (balance == 0)? 0 : ((balance < 0)? 1 : 2);
+	node->child[0] = (struct ib_cnode*)
+		(((size_t)(node->child[0]) & ~((size_t)3)) | code);
+}
+
+static inline struct ib_cnode *
+_ib_cnode_child(const struct ib_cnode *node, int dir)
+{
+	return (dir)? node->child[1] : IB_CNODE_LEFT(node);
+}
+
+static inline void 
+_ib_cnode_set_child(struct ib_cnode *node, int dir, struct ib_cnode *c)
+{
+	if (dir) {
+		node->child[1] = c;
+	}	else {
+		node->child[0] = (struct ib_cnode*)
+			(((size_t)(node->child[0]) & 3) | ((size_t)c));
+	}
+}
+
+/* rebalance y whose balance would become 2 * s (s = 1 or -1) toward
+ * child dir, returns the new subtree root, *shrink is set to 1 when
+ * the subtree height is reduced compared with before the fix */
+static struct ib_cnode *
+_ib_cnode_rotate(struct ib_cnode *y, int dir, int *shrink)
+{
+	struct ib_cnode *x = _ib_cnode_child(y, dir);
+	struct ib_cnode *w;
+	int s = (dir)? 1 : -1;
+	int bx = _ib_cnode_balance(x);
+	if (bx != -s) {
+		/* single rotation */
+		_ib_cnode_set_child(y, dir, _ib_cnode_child(x, !dir));
+		_ib_cnode_set_child(x, !dir, y);
+		if (bx == 0) {
+			_ib_cnode_set_balance(x, -s);
+			_ib_cnode_set_balance(y, s);
+			shrink[0] = 0;
+		}	else {
+			_ib_cnode_set_balance(x, 0);
+			_ib_cnode_set_balance(y, 0);
+			shrink[0] = 1;
 		}
+		return x;
+	}
+	/* double rotation */
+	w = _ib_cnode_child(x, !dir);
+	_ib_cnode_set_child(x, !dir, _ib_cnode_child(w, dir));
+	_ib_cnode_set_child(w, dir, x);
+	_ib_cnode_set_child(y, dir, _ib_cnode_child(w, !dir));
+	_ib_cnode_set_child(w, !dir, y);
+	bx = _ib_cnode_balance(w);
+	_ib_cnode_set_balance(y, (bx == s)? -s : 0);
+	_ib_cnode_set_balance(x, (bx == -s)? s : 0);
+	_ib_cnode_set_balance(w, 0);
+	shrink[0] = 1;
+	return w;
+}
+
+void ib_ctree_init(struct ib_ctree *tree,
+	int (*compare)(const void*, const void*), size_t size, size_t offset)
+{
+	tree->root = NULL;
+	tree->offset = offset;
+	tree->size = size;
+	tree->count = 0;
+	tree->compare = compare;
+}
+
+void *ib_ctree_find(struct ib_ctree *tree, const void *data)
+{
+	struct ib_cnode *n = tree->root;
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	while (n) {
+		void *nd = IB_CNODE2DATA(n, offset);
+		int hr = compare(data, nd);
+		if (hr == 0) return nd;
+		n = _ib_cnode_child(n, hr > 0);
 	}
 	return NULL;
 }
 
-void ib_hash_erase(struct ib_hash_table *ht, struct ib_hash_node *node)
+/* top-down: remember the deepest unbalanced node on the path, only the
+ * part below it changes balance and at most one rotation is needed */
+void *ib_ctree_add(struct ib_ctree *tree, void *data)
 {
-	struct ib_hash_index *index;
-	ASSERTION(node && ht);
-	ASSERTION(!ib_node_empty(&node->avlnode));
-	index = &ht->index[node->hash & ht->index_mask];
-	if (index->avlroot.node == &node->avlnode && node->avlnode.height == 1) {
-		index->avlroot.node = NULL;
-		ilist_del_init(&index->node);
+	struct ib_cnode *stack[IB_CNODE_DEPTH];
+	unsigned char dirs[IB_CNODE_DEPTH];
+	struct ib_cnode *node = IB_DATA2CNODE(data, tree->offset);
+	struct ib_cnode *n = tree->root, *y;
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	int top = 0, yi = 0, i, shrink;
+	ASSERTION((((size_t)node) & 3) == 0);
+	if (n == NULL) {
+		node->child[0] = NULL;
+		node->child[1] = NULL;
+		tree->root = node;
+		tree->count++;
+		return NULL;
 	}
-	else {
-		ib_node_erase(&node->avlnode, &index->avlroot);
+	while (n) {
+		int hr = compare(data, IB_CNODE2DATA(n, offset));
+		if (hr == 0) return IB_CNODE2DATA(n, offset);
+		if (_ib_cnode_balance(n) != 0) yi = top;
+		ASSERTION(top < IB_CNODE_DEPTH);
+		stack[top] = n;
+		dirs[top] = (hr > 0)? 1 : 0;
+		n = _ib_cnode_child(n, dirs[top]);
+		top++;
 	}
-	ib_node_init(&node->avlnode);
-	ht->count--;
+	node->child[0] = NULL;
+	node->child[1] = NULL;
+	_ib_cnode_set_child(stack[top - 1], dirs[top - 1], node);
+	tree->count++;
+	for (i = yi + 1; i < top; i++) {
+		_ib_cnode_set_balance(stack[i], (dirs[i])? 1 : -1);
+	}
+	y = stack[yi];
+	i = _ib_cnode_balance(y) + ((dirs[yi])? 1 : -1);
+	if (i >= -1 && i <= 1) {
+		_ib_cnode_set_balance(y, i);
+		return NULL;
+	}
+	n = _ib_cnode_rotate(y, dirs[yi], &shrink);
+	if (yi == 0) tree->root = n;
+	else _ib_cnode_set_child(stack[yi - 1], dirs[yi - 1], n);
+	return NULL;
 }
 
-struct ib_node** ib_hash_track(struct ib_hash_table *ht,
-		const struct ib_hash_node *node, struct ib_node **parent)
+void *ib_ctree_remove(struct ib_ctree *tree, const void *data)
 {
-	size_t hash = node->hash;
-	const void *key = node->key;
-	struct ib_hash_index *index = &(ht->index[hash & ht->index_mask]);
-	struct ib_node **link = &index->avlroot.node;
-	struct ib_node *p = NULL;
-	int (*compare)(const void *key1, const void *key2) = ht->compare;
-	parent[0] = NULL;
-	while (link[0]) {
-		struct ib_hash_node *snode;
-		size_t shash;
-		p = link[0];
-		snode = IB_ENTRY(p, struct ib_hash_node, avlnode);
-		shash = snode->hash;
-		if (hash == shash) {
-			int hc = compare(key, snode->key);
-			if (hc == 0) {
-				parent[0] = p;
-				return NULL;
-			}
-			link = (hc < 0)? (&p->left) : (&p->right);
+	struct ib_cnode *stack[IB_CNODE_DEPTH];
+	unsigned char dirs[IB_CNODE_DEPTH];
+	struct ib_cnode *n = tree->root, *p, *r, *s;
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	int top = 0, k, i, hr, shrink;
+	while (1) {
+		if (n == NULL) return NULL;
+		hr = compare(data, IB_CNODE2DATA(n, offset));
+		if (hr == 0) break;
+		ASSERTION(top < IB_CNODE_DEPTH);
+		stack[top] = n;
+		dirs[top] = (hr > 0)? 1 : 0;
+		n = _ib_cnode_child(n, dirs[top]);
+		top++;
+	}
+	p = n;
+	k = top;
+	r = IB_CNODE_RIGHT(p);
+	if (r == NULL) {
+		s = IB_CNODE_LEFT(p);
+	}
+	else if (IB_CNODE_LEFT(r) == NULL) {
+		/* right child takes the place of p */
+		s = r;
+		_ib_cnode_set_child(s, 0, IB_CNODE_LEFT(p));
+		_ib_cnode_set_balance(s, _ib_cnode_balance(p));
+		stack[top] = s;
+		dirs[top] = 1;
+		top++;
+	}
+	else {
+		/* detach the successor and move it to the place of p */
+		top++;
+		for (n = r; ; n = s) {
+			ASSERTION(top < IB_CNODE_DEPTH);
+			stack[top] = n;
+			dirs[top] = 0;
+			top++;
+			s = IB_CNODE_LEFT(n);
+			if (IB_CNODE_LEFT(s) == NULL) break;
 		}
-		else {
-			link = (hash < shash)? (&p->left) : (&p->right);
+		_ib_cnode_set_child(n, 0, IB_CNODE_RIGHT(s));
+		s->child[0] = p->child[0];
+		s->child[1] = p->child[1];
+		stack[k] = s;
+		dirs[k] = 1;
+	}
+	if (k == 0) tree->root = s;
+	else _ib_cnode_set_child(stack[k - 1], dirs[k - 1], s);
+	tree->count--;
+	/* retrace: the subtree on side dirs[i] of stack[i] got shorter */
+	for (i = top - 1; i >= 0; i--) {
+		struct ib_cnode *y = stack[i];
+		int b = _ib_cnode_balance(y) + ((dirs[i])? -1 : 1);
+		if (b == 1 || b == -1) {
+			_ib_cnode_set_balance(y, b);
+			break;
 		}
+		if (b == 0) {
+			_ib_cnode_set_balance(y, 0);
+			continue;
+		}
+		n = _ib_cnode_rotate(y, (b > 0)? 1 : 0, &shrink);
+		if (i == 0) tree->root = n;
+		else _ib_cnode_set_child(stack[i - 1], dirs[i - 1], n);
+		if (shrink == 0) break;
 	}
-	parent[0] = p;
-	return link;
+	p->child[0] = NULL;
+	p->child[1] = NULL;
+	return IB_CNODE2DATA(p, offset);
 }
 
+void ib_ctree_clear(struct ib_ctree *tree, void (*destroy)(void *data))
+{
+	struct ib_cnode *n = tree->root;
+	size_t offset = tree->offset;
+	/* rotate left children up so the tree degrades into a list */
+	while (n) {
+		struct ib_cnode *left = IB_CNODE_LEFT(n);
+		if (left) {
+			_ib_cnode_set_child(n, 0, IB_CNODE_RIGHT(left));
+			left->child[1] = n;
+			n = left;
+		}	else {
+			struct ib_cnode *next = IB_CNODE_RIGHT(n);
+			if (destroy) destroy(IB_CNODE2DATA(n, offset));
+			n = next;
+		}
+	}
+	tree->root = NULL;
+	tree->count = 0;
+}
 
-struct ib_hash_node* ib_hash_add(struct ib_hash_table *ht,
-		struct ib_hash_node *node)
+static void *_ib_ctree_descend(struct ib_ctree *tree, 
+		struct ib_ctree_iter *it, struct ib_cnode *n, int dir)
 {
-	struct ib_hash_index *index = &(ht->index[node->hash & ht->index_mask]);
-	if (index->avlroot.node == NULL) {
-		index->avlroot.node = &node->avlnode;
-		node->avlnode.parent = NULL;
-		node->avlnode.left = NULL;
-		node->avlnode.right = NULL;
-		node->avlnode.height = 1;
-		ilist_add_tail(&index->node, &ht->head);
+	for (; n; n = _ib_cnode_child(n, dir)) {
+		ASSERTION(it->top < IB_CNODE_DEPTH);
+		it->stack[it->top++] = n;
 	}
-	else {
-		struct ib_node **link, *parent;
-		link = ib_hash_track(ht, node, &parent);
-		if (link == NULL) {
-			ASSERTION(parent);
-			return IB_ENTRY(parent, struct ib_hash_node, avlnode);
-		}
-		ib_node_link(&node->avlnode, parent, link);
-		ib_node_post_insert(&node->avlnode, &index->avlroot);
+	if (it->top == 0) return NULL;
+	return IB_CNODE2DATA(it->stack[it->top - 1], tree->offset);
+}
+
+/* dir = 1 for next, 0 for prev */
+static void *_ib_ctree_step(struct ib_ctree *tree, 
+		struct ib_ctree_iter *it, int dir)
+{
+	struct ib_cnode *n, *c;
+	if (it->top <= 0) return NULL;
+	n = _ib_cnode_child(it->stack[it->top - 1], dir);
+	if (n) {
+		ASSERTION(it->top < IB_CNODE_DEPTH);
+		it->stack[it->top++] = n;
+		return _ib_ctree_descend(tree, it, _ib_cnode_child(n, !dir), !dir);
+	}
+	do {
+		c = it->stack[--it->top];
+	}	while (it->top > 0 && _ib_cnode_child(it->stack[it->top - 1], 
+				dir) == c);
+	if (it->top == 0) return NULL;
+	return IB_CNODE2DATA(it->stack[it->top - 1], tree->offset);
+}
+
+void *ib_ctree_first(struct ib_ctree *tree, struct ib_ctree_iter *it)
+{
+	it->top = 0;
+	return _ib_ctree_descend(tree, it, tree->root, 0);
+}
+
+void *ib_ctree_last(struct ib_ctree *tree, struct ib_ctree_iter *it)
+{
+	it->top = 0;
+	return _ib_ctree_descend(tree, it, tree->root, 1);
+}
+
+void *ib_ctree_next(struct ib_ctree *tree, struct ib_ctree_iter *it)
+{
+	return _ib_ctree_step(tree, it, 1);
+}
+
+void *ib_ctree_prev(struct ib_ctree *tree, struct ib_ctree_iter *it)
+{
+	return _ib_ctree_step(tree, it, 0);
+}
+
+void *ib_ctree_lower_bound(struct ib_ctree *tree, struct ib_ctree_iter *it,
+		const void *data)
+{
+	struct ib_cnode *n = tree->root;
+	int (*compare)(const void*, const void*) = tree->compare;
+	int found = 0;
+	it->top = 0;
+	while (n) {
+		int hr = compare(data, IB_CNODE2DATA(n, tree->offset));
+		ASSERTION(it->top < IB_CNODE_DEPTH);
+		it->stack[it->top++] = n;
+		if (hr == 0) return IB_CNODE2DATA(n, tree->offset);
+		if (hr < 0) found = it->top;
+		n = _ib_cnode_child(n, hr > 0);
+	}
+	/* the last node where we turned left is the answer */
+	it->top = found;
+	if (found == 0) return NULL;
+	return IB_CNODE2DATA(it->stack[found - 1], tree->offset);
+}
+
+
+/*--------------------------------------------------------------------*/
+/* fastbin - fixed size object allocator                              */
+/*--------------------------------------------------------------------*/
+
+void ib_fastbin_init(struct ib_fastbin *fb, size_t obj_size)
+{
+	const size_t align = sizeof(void*);
+	size_t need;
+	fb->start = NULL;
+	fb->endup = NULL;
+	fb->next = NULL;
+	fb->pages = NULL;
+	fb->obj_size = (obj_size + align - 1) & (~(align - 1));
+	need = fb->obj_size * 32 + sizeof(void*) + 16;	
+	fb->page_size = (align <= 2)? 8 : 32;
+	while (fb->page_size < need) {
+		fb->page_size *= 2;
+	}
+	fb->maximum = (align <= 2)? fb->page_size : 0x10000;
+}
+
+void ib_fastbin_destroy(struct ib_fastbin *fb)
+{
+	while (fb->pages) {
+		void *page = fb->pages;
+		void *next = IB_NEXT(page);
+		fb->pages = next;
+		ikmem_free(page);
+	}
+	fb->start = NULL;
+	fb->endup = NULL;
+	fb->next = NULL;
+	fb->pages = NULL;
+}
+
+void* ib_fastbin_new(struct ib_fastbin *fb)
+{
+	size_t obj_size = fb->obj_size;
+	void *obj;
+	obj = fb->next;
+	if (obj) {
+		fb->next = IB_NEXT(fb->next);
+		return obj;
+	}
+	if (fb->start + obj_size > fb->endup) {
+		char *page = (char*)ikmem_malloc(fb->page_size);
+		size_t lineptr = (size_t)page;
+		ASSERTION(page);
+		IB_NEXT(page) = fb->pages;
+		fb->pages = page;
+		lineptr = (lineptr + sizeof(void*) + 15) & (~15);
+		fb->start = (char*)lineptr;
+		fb->endup = (char*)page + fb->page_size;
+		if (fb->page_size < fb->maximum) {
+			fb->page_size *= 2;
+		}
+	}
+	obj = fb->start;
+	fb->start += obj_size;
+	ASSERTION(fb->start <= fb->endup);
+	return obj;
+}
+
+void ib_fastbin_del(struct ib_fastbin *fb, void *ptr)
+{
+	IB_NEXT(ptr) = fb->next;
+	fb->next = ptr;
+}
+
+
+/*--------------------------------------------------------------------*/
+/* B+tree - ordered map with wide nodes and contiguous integer keys   */
+/*--------------------------------------------------------------------*/
+#define IB_BTREE_CAP      ((int)IB_BTREE_KEYS)
+#define IB_BTREE_MIN      ((int)IB_BTREE_KEYS / 2)
+
+#ifndef IB_BTREE_DEPTH
+#define IB_BTREE_DEPTH    32
+#endif
+
+/* count keys less than key, branchless for vectorization */
+static inline int 
+_ib_btree_search(const ib_btree_key *keys, int count, ib_btree_key key)
+{
+	int pos = 0, i;
+	for (i = 0; i < count; i++) {
+		pos += (keys[i] < key)? 1 : 0;
+	}
+	return pos;
+}
+
+/* count keys less than or equal to key: child index in inner node */
+static inline int 
+_ib_btree_route(const ib_btree_key *keys, int count, ib_btree_key key)
+{
+	int pos = 0, i;
+	for (i = 0; i < count; i++) {
+		pos += (keys[i] <= key)? 1 : 0;
+	}
+	return pos;
+}
+
+static inline struct ib_btree_leaf *
+_ib_btree_locate(const struct ib_btree *bt, ib_btree_key key)
+{
+	void *node = bt->root;
+	int level;
+	for (level = bt->depth; level > 0; level--) {
+		struct ib_btree_inner *inner = (struct ib_btree_inner*)node;
+		node = inner->child[_ib_btree_route(inner->keys, inner->count, key)];
+	}
+	return (struct ib_btree_leaf*)node;
+}
+
+void ib_btree_init(struct ib_btree *bt)
+{
+	bt->root = NULL;
+	bt->depth = 0;
+	bt->count = 0;
+	bt->head = NULL;
+	bt->tail = NULL;
+	ib_fastbin_init(&bt->leaves, sizeof(struct ib_btree_leaf));
+	ib_fastbin_init(&bt->inners, sizeof(struct ib_btree_inner));
+}
+
+void ib_btree_destroy(struct ib_btree *bt)
+{
+	ib_btree_clear(bt, NULL);
+	ib_fastbin_destroy(&bt->leaves);
+	ib_fastbin_destroy(&bt->inners);
+}
+
+void *ib_btree_first(struct ib_btree *bt, struct ib_btree_iter *it)
+{
+	it->leaf = bt->head;
+	it->pos = 0;
+	return (it->leaf)? it->leaf->data[0] : NULL;
+}
+
+void *ib_btree_last(struct ib_btree *bt, struct ib_btree_iter *it)
+{
+	it->leaf = bt->tail;
+	if (it->leaf == NULL) return NULL;
+	it->pos = it->leaf->count - 1;
+	return it->leaf->data[it->pos];
+}
+
+void *ib_btree_next(struct ib_btree *bt, struct ib_btree_iter *it)
+{
+	if (it->leaf == NULL) return NULL;
+	if (++it->pos >= it->leaf->count) {
+		it->leaf = it->leaf->next;
+		it->pos = 0;
+		if (it->leaf == NULL) return NULL;
+	}
+	bt = bt;
+	return it->leaf->data[it->pos];
+}
+
+void *ib_btree_prev(struct ib_btree *bt, struct ib_btree_iter *it)
+{
+	if (it->leaf == NULL) return NULL;
+	if (--it->pos < 0) {
+		it->leaf = it->leaf->prev;
+		if (it->leaf == NULL) return NULL;
+		it->pos = it->leaf->count - 1;
+	}
+	bt = bt;
+	return it->leaf->data[it->pos];
+}
+
+void *ib_btree_find(struct ib_btree *bt, ib_btree_key key,
+		struct ib_btree_iter *it)
+{
+	struct ib_btree_leaf *leaf = _ib_btree_locate(bt, key);
+	int pos;
+	if (leaf == NULL) return NULL;
+	pos = _ib_btree_search(leaf->keys, leaf->count, key);
+	if (pos >= leaf->count || leaf->keys[pos] != key) {
+		return NULL;
+	}
+	if (it) {
+		it->leaf = leaf;
+		it->pos = pos;
+	}
+	return leaf->data[pos];
+}
+
+void *ib_btree_nearest(struct ib_btree *bt, ib_btree_key key,
+		struct ib_btree_iter *it)
+{
+	struct ib_btree_leaf *leaf = _ib_btree_locate(bt, key);
+	int pos;
+	if (leaf == NULL) return NULL;
+	pos = _ib_btree_search(leaf->keys, leaf->count, key);
+	if (pos >= leaf->count) {
+		leaf = leaf->next;
+		pos = 0;
+		if (leaf == NULL) return NULL;
+	}
+	if (it) {
+		it->leaf = leaf;
+		it->pos = pos;
+	}
+	return leaf->data[pos];
+}
+
+static void 
+_ib_btree_inner_insert(struct ib_btree_inner *inner, int pos,
+		ib_btree_key key, void *child)
+{
+	int n = inner->count - pos;
+	memmove(inner->keys + pos + 1, inner->keys + pos, 
+			n * sizeof(ib_btree_key));
+	memmove(inner->child + pos + 2, inner->child + pos + 1,
+			n * sizeof(void*));
+	inner->keys[pos] = key;
+	inner->child[pos + 1] = child;
+	inner->count++;
+}
+
+static void
+_ib_btree_inner_remove(struct ib_btree_inner *inner, int pos)
+{
+	int n = inner->count - pos - 1;
+	memmove(inner->keys + pos, inner->keys + pos + 1, 
+			n * sizeof(ib_btree_key));
+	memmove(inner->child + pos + 1, inner->child + pos + 2,
+			n * sizeof(void*));
+	inner->count--;
+}
+
+/* returns NULL for success, otherwise returns the conflict data */
+void *ib_btree_add(struct ib_btree *bt, ib_btree_key key, void *data)
+{
+	struct ib_btree_inner *path[IB_BTREE_DEPTH];
+	int index[IB_BTREE_DEPTH];
+	ib_btree_key keys[IB_BTREE_KEYS + 1];
+	void *ptrs[IB_BTREE_KEYS + 2];
+	struct ib_btree_leaf *leaf, *right;
+	struct ib_btree_inner *top;
+	void *node = bt->root;
+	void *child;
+	ib_btree_key sep;
+	int level, pos, half;
+	ASSERTION(data);
+	if (node == NULL) {
+		leaf = (struct ib_btree_leaf*)ib_fastbin_new(&bt->leaves);
+		ASSERTION(leaf);
+		leaf->count = 0;
+		leaf->prev = NULL;
+		leaf->next = NULL;
+		bt->root = leaf;
+		bt->head = leaf;
+		bt->tail = leaf;
+		node = leaf;
+	}
+	for (level = 0; level < bt->depth; level++) {
+		struct ib_btree_inner *inner = (struct ib_btree_inner*)node;
+		ASSERTION(level < IB_BTREE_DEPTH);
+		path[level] = inner;
+		index[level] = _ib_btree_route(inner->keys, inner->count, key);
+		node = inner->child[index[level]];
+	}
+	leaf = (struct ib_btree_leaf*)node;
+	pos = _ib_btree_search(leaf->keys, leaf->count, key);
+	if (pos < leaf->count && leaf->keys[pos] == key) {
+		return leaf->data[pos];
+	}
+	bt->count++;
+	if (leaf->count < IB_BTREE_CAP) {
+		int n = leaf->count - pos;
+		memmove(leaf->keys + pos + 1, leaf->keys + pos, 
+				n * sizeof(ib_btree_key));
+		memmove(leaf->data + pos + 1, leaf->data + pos, n * sizeof(void*));
+		leaf->keys[pos] = key;
+		leaf->data[pos] = data;
+		leaf->count++;
+		return NULL;
+	}
+	/* split the full leaf in halves */
+	memcpy(keys, leaf->keys, pos * sizeof(ib_btree_key));
+	memcpy(ptrs, leaf->data, pos * sizeof(void*));
+	keys[pos] = key;
+	ptrs[pos] = data;
+	memcpy(keys + pos + 1, leaf->keys + pos, 
+			(IB_BTREE_CAP - pos) * sizeof(ib_btree_key));
+	memcpy(ptrs + pos + 1, leaf->data + pos, 
+			(IB_BTREE_CAP - pos) * sizeof(void*));
+	half = (IB_BTREE_CAP + 1) / 2;
+	right = (struct ib_btree_leaf*)ib_fastbin_new(&bt->leaves);
+	ASSERTION(right);
+	memcpy(leaf->keys, keys, half * sizeof(ib_btree_key));
+	memcpy(leaf->data, ptrs, half * sizeof(void*));
+	leaf->count = half;
+	right->count = IB_BTREE_CAP + 1 - half;
+	memcpy(right->keys, keys + half, right->count * sizeof(ib_btree_key));
+	memcpy(right->data, ptrs + half, right->count * sizeof(void*));
+	right->prev = leaf;
+	right->next = leaf->next;
+	if (leaf->next) leaf->next->prev = right;
+	else bt->tail = right;
+	leaf->next = right;
+	sep = right->keys[0];
+	child = right;
+	/* insert separator into parents, split them if necessary */
+	for (level = bt->depth - 1; level >= 0; level--) {
+		struct ib_btree_inner *inner = path[level];
+		struct ib_btree_inner *sibling;
+		pos = index[level];
+		if (inner->count < IB_BTREE_CAP) {
+			_ib_btree_inner_insert(inner, pos, sep, child);
+			return NULL;
+		}
+		memcpy(keys, inner->keys, pos * sizeof(ib_btree_key));
+		memcpy(ptrs, inner->child, (pos + 1) * sizeof(void*));
+		keys[pos] = sep;
+		ptrs[pos + 1] = child;
+		memcpy(keys + pos + 1, inner->keys + pos,
+				(IB_BTREE_CAP - pos) * sizeof(ib_btree_key));
+		memcpy(ptrs + pos + 2, inner->child + pos + 1,
+				(IB_BTREE_CAP - pos) * sizeof(void*));
+		half = (IB_BTREE_CAP + 1) / 2;
+		sibling = (struct ib_btree_inner*)ib_fastbin_new(&bt->inners);
+		ASSERTION(sibling);
+		memcpy(inner->keys, keys, half * sizeof(ib_btree_key));
+		memcpy(inner->child, ptrs, (half + 1) * sizeof(void*));
+		inner->count = half;
+		sibling->count = IB_BTREE_CAP - half;
+		memcpy(sibling->keys, keys + half + 1, 
+				sibling->count * sizeof(ib_btree_key));
+		memcpy(sibling->child, ptrs + half + 1, 
+				(sibling->count + 1) * sizeof(void*));
+		sep = keys[half];
+		child = sibling;
+	}
+	/* grow a new root */
+	top = (struct ib_btree_inner*)ib_fastbin_new(&bt->inners);
+	ASSERTION(top);
+	top->count = 1;
+	top->keys[0] = sep;
+	top->child[0] = bt->root;
+	top->child[1] = child;
+	bt->root = top;
+	bt->depth++;
+	return NULL;
+}
+
+/* fix underflow leaf by borrowing from or merging with a sibling */
+static void 
+_ib_btree_leaf_fix(struct ib_btree *bt, struct ib_btree_inner *parent,
+		int i, struct ib_btree_leaf *leaf)
+{
+	struct ib_btree_leaf *left = NULL, *right = NULL;
+	if (i > 0) left = (struct ib_btree_leaf*)parent->child[i - 1];
+	if (i < parent->count) right = (struct ib_btree_leaf*)parent->child[i + 1];
+	if (left && left->count > IB_BTREE_MIN) {
+		memmove(leaf->keys + 1, leaf->keys, 
+				leaf->count * sizeof(ib_btree_key));
+		memmove(leaf->data + 1, leaf->data, leaf->count * sizeof(void*));
+		left->count--;
+		leaf->keys[0] = left->keys[left->count];
+		leaf->data[0] = left->data[left->count];
+		leaf->count++;
+		parent->keys[i - 1] = leaf->keys[0];
+		return;
+	}
+	if (right && right->count > IB_BTREE_MIN) {
+		leaf->keys[leaf->count] = right->keys[0];
+		leaf->data[leaf->count] = right->data[0];
+		leaf->count++;
+		right->count--;
+		memmove(right->keys, right->keys + 1, 
+				right->count * sizeof(ib_btree_key));
+		memmove(right->data, right->data + 1, right->count * sizeof(void*));
+		parent->keys[i] = right->keys[0];
+		return;
+	}
+	if (left == NULL) {
+		/* merge right into leaf instead */
+		left = leaf;
+		leaf = right;
+		i++;
+	}
+	ASSERTION(left->count + leaf->count <= IB_BTREE_CAP);
+	memcpy(left->keys + left->count, leaf->keys, 
+			leaf->count * sizeof(ib_btree_key));
+	memcpy(left->data + left->count, leaf->data, 
+			leaf->count * sizeof(void*));
+	left->count += leaf->count;
+	left->next = leaf->next;
+	if (leaf->next) leaf->next->prev = left;
+	else bt->tail = left;
+	ib_fastbin_del(&bt->leaves, leaf);
+	_ib_btree_inner_remove(parent, i - 1);
+}
+
+/* fix underflow inner node by rotating through or merging with parent */
+static void 
+_ib_btree_inner_fix(struct ib_btree *bt, struct ib_btree_inner *parent,
+		int i, struct ib_btree_inner *inner)
+{
+	struct ib_btree_inner *left = NULL, *right = NULL;
+	if (i > 0) left = (struct ib_btree_inner*)parent->child[i - 1];
+	if (i < parent->count) right = (struct ib_btree_inner*)parent->child[i + 1];
+	if (left && left->count > IB_BTREE_MIN) {
+		memmove(inner->keys + 1, inner->keys, 
+				inner->count * sizeof(ib_btree_key));
+		memmove(inner->child + 1, inner->child, 
+				(inner->count + 1) * sizeof(void*));
+		inner->keys[0] = parent->keys[i - 1];
+		inner->child[0] = left->child[left->count];
+		inner->count++;
+		parent->keys[i - 1] = left->keys[left->count - 1];
+		left->count--;
+		return;
+	}
+	if (right && right->count > IB_BTREE_MIN) {
+		inner->keys[inner->count] = parent->keys[i];
+		inner->child[inner->count + 1] = right->child[0];
+		inner->count++;
+		parent->keys[i] = right->keys[0];
+		memmove(right->keys, right->keys + 1, 
+				(right->count - 1) * sizeof(ib_btree_key));
+		memmove(right->child, right->child + 1, 
+				right->count * sizeof(void*));
+		right->count--;
+		return;
+	}
+	if (left == NULL) {
+		left = inner;
+		inner = right;
+		i++;
+	}
+	ASSERTION(left->count + inner->count + 1 <= IB_BTREE_CAP);
+	left->keys[left->count] = parent->keys[i - 1];
+	memcpy(left->keys + left->count + 1, inner->keys,
+			inner->count * sizeof(ib_btree_key));
+	memcpy(left->child + left->count + 1, inner->child,
+			(inner->count + 1) * sizeof(void*));
+	left->count += inner->count + 1;
+	ib_fastbin_del(&bt->inners, inner);
+	_ib_btree_inner_remove(parent, i - 1);
+}
+
+/* returns the removed data, NULL for key mismatch */
+void *ib_btree_remove(struct ib_btree *bt, ib_btree_key key)
+{
+	struct ib_btree_inner *path[IB_BTREE_DEPTH];
+	int index[IB_BTREE_DEPTH];
+	struct ib_btree_leaf *leaf;
+	void *node = bt->root;
+	void *data;
+	int level, pos;
+	if (node == NULL) return NULL;
+	for (level = 0; level < bt->depth; level++) {
+		struct ib_btree_inner *inner = (struct ib_btree_inner*)node;
+		path[level] = inner;
+		index[level] = _ib_btree_route(inner->keys, inner->count, key);
+		node = inner->child[index[level]];
+	}
+	leaf = (struct ib_btree_leaf*)node;
+	pos = _ib_btree_search(leaf->keys, leaf->count, key);
+	if (pos >= leaf->count || leaf->keys[pos] != key) {
+		return NULL;
+	}
+	data = leaf->data[pos];
+	leaf->count--;
+	memmove(leaf->keys + pos, leaf->keys + pos + 1, 
+			(leaf->count - pos) * sizeof(ib_btree_key));
+	memmove(leaf->data + pos, leaf->data + pos + 1, 
+			(leaf->count - pos) * sizeof(void*));
+	bt->count--;
+	if (bt->depth == 0) {
+		if (leaf->count == 0) {
+			ib_fastbin_del(&bt->leaves, leaf);
+			bt->root = NULL;
+			bt->head = NULL;
+			bt->tail = NULL;
+		}
+		return data;
+	}
+	if (leaf->count >= IB_BTREE_MIN) {
+		return data;
+	}
+	level = bt->depth - 1;
+	_ib_btree_leaf_fix(bt, path[level], index[level], leaf);
+	for (; level > 0; level--) {
+		if (path[level]->count >= IB_BTREE_MIN) break;
+		_ib_btree_inner_fix(bt, path[level - 1], index[level - 1], 
+				path[level]);
+	}
+	/* shrink the root */
+	while (bt->depth > 0) {
+		struct ib_btree_inner *root = (struct ib_btree_inner*)bt->root;
+		if (root->count > 0) break;
+		bt->root = root->child[0];
+		bt->depth--;
+		ib_fastbin_del(&bt->inners, root);
+	}
+	return data;
+}
+
+static void _ib_btree_free(struct ib_btree *bt, void *node, int level,
+		void (*destroy)(void *data))
+{
+	int i;
+	if (level == 0) {
+		struct ib_btree_leaf *leaf = (struct ib_btree_leaf*)node;
+		if (destroy) {
+			for (i = 0; i < leaf->count; i++) {
+				destroy(leaf->data[i]);
+			}
+		}
+		ib_fastbin_del(&bt->leaves, leaf);
+	}
+	else {
+		struct ib_btree_inner *inner = (struct ib_btree_inner*)node;
+		for (i = 0; i <= inner->count; i++) {
+			_ib_btree_free(bt, inner->child[i], level - 1, destroy);
+		}
+		ib_fastbin_del(&bt->inners, inner);
+	}
+}
+
+void ib_btree_clear(struct ib_btree *bt, void (*destroy)(void *data))
+{
+	if (bt->root) {
+		_ib_btree_free(bt, bt->root, bt->depth, destroy);
+	}
+	bt->root = NULL;
+	bt->depth = 0;
+	bt->count = 0;
+	bt->head = NULL;
+	bt->tail = NULL;
+}
+
+
+/*--------------------------------------------------------------------*/
+/* epoch - epoch based memory reclamation for lock-free readers       */
+/*--------------------------------------------------------------------*/
+struct ib_epoch_limbo
+{
+	void *ptr;
+	ilong epoch;
+	struct ib_epoch_limbo * volatile next;
+};
+
+#define IB_EPOCH_BATCH    32
+
+/* lock-free stack push, a stale pop may still read next of first */
+static inline void _ib_epoch_push(struct ib_epoch_limbo * volatile *stack,
+		struct ib_epoch_limbo *first, struct ib_epoch_limbo *last)
+{
+	struct ib_epoch_limbo *head;
+	do {
+		head = IATOMIC_LOAD(stack);
+		IATOMIC_STORE(&last->next, head);
+	}	while (!IATOMIC_CAS(stack, head, first));
+}
+
+/* pop a free record, refill from the fastbin under the lock in batches.
+ * a record popped by another thread only comes back after a collect 
+ * which waits for every reader inside, so the pop is safe from ABA */
+static struct ib_epoch_limbo *_ib_epoch_record(struct ib_epoch *ep)
+{
+	struct ib_epoch_limbo *limbo, *next, *first = NULL, *last = NULL;
+	int i;
+	while (1) {
+		limbo = IATOMIC_LOAD(&ep->spare);
+		if (limbo == NULL) break;
+		next = IATOMIC_LOAD(&limbo->next);
+		if (IATOMIC_CAS(&ep->spare, limbo, next)) return limbo;
+	}
+	IMUTEX_LOCK(&ep->lock);
+	for (i = 0; i < IB_EPOCH_BATCH; i++) {
+		limbo = (struct ib_epoch_limbo*)ib_fastbin_new(&ep->fb);
+		ASSERTION(limbo);
+		IATOMIC_STORE(&limbo->next, first);
+		if (first == NULL) last = limbo;
+		first = limbo;
+	}
+	IMUTEX_UNLOCK(&ep->lock);
+	limbo = first;
+	first = limbo->next;
+	if (first) {
+		_ib_epoch_push(&ep->spare, first, last);
+	}
+	return limbo;
+}
+
+/* move the lock-free retired stack to the end of head, lock held */
+static void _ib_epoch_gather(struct ib_epoch *ep)
+{
+	struct ib_epoch_limbo *list, *order = NULL, *last = NULL;
+	do {
+		list = IATOMIC_LOAD(&ep->incoming);
+	}	while (list && !IATOMIC_CAS(&ep->incoming, list, NULL));
+	/* the stack is newest first */
+	while (list) {
+		struct ib_epoch_limbo *next = list->next;
+		IATOMIC_STORE(&list->next, order);
+		if (order == NULL) last = list;
+		order = list;
+		list = next;
+	}
+	if (order == NULL) return;
+	if (ep->tail) IATOMIC_STORE(&ep->tail->next, order);
+	else ep->head = order;
+	ep->tail = last;
+}
+
+void ib_epoch_init(struct ib_epoch *ep, 
+		void (*reclaim)(void *ptr, void *user), void *user)
+{
+	ep->epoch = 1;
+	ep->readers = NULL;
+	ep->head = NULL;
+	ep->tail = NULL;
+	ep->incoming = NULL;
+	ep->spare = NULL;
+	ep->retired = 0;
+	ep->reclaim = reclaim;
+	ep->user = user;
+	ib_fastbin_init(&ep->fb, sizeof(struct ib_epoch_limbo));
+	IMUTEX_INIT(&ep->lock);
+}
+
+void ib_epoch_destroy(struct ib_epoch *ep)
+{
+	_ib_epoch_gather(ep);
+	while (ep->head) {
+		struct ib_epoch_limbo *limbo = ep->head;
+		ep->head = limbo->next;
+		if (ep->reclaim) {
+			ep->reclaim(limbo->ptr, ep->user);
+		}
+	}
+	ep->tail = NULL;
+	ep->spare = NULL;
+	ep->retired = 0;
+	ep->readers = NULL;
+	ib_fastbin_destroy(&ep->fb);
+	IMUTEX_DESTROY(&ep->lock);
+}
+
+void ib_epoch_register(struct ib_epoch *ep, struct ib_epoch_reader *r)
+{
+	r->active = 0;
+	IMUTEX_LOCK(&ep->lock);
+	r->next = ep->readers;
+	ep->readers = r;
+	IMUTEX_UNLOCK(&ep->lock);
+}
+
+void ib_epoch_unregister(struct ib_epoch *ep, struct ib_epoch_reader *r)
+{
+	struct ib_epoch_reader **link;
+	IMUTEX_LOCK(&ep->lock);
+	for (link = &ep->readers; link[0]; link = &(link[0]->next)) {
+		if (link[0] == r) {
+			link[0] = r->next;
+			break;
+		}
+	}
+	IMUTEX_UNLOCK(&ep->lock);
+	r->next = NULL;
+}
+
+void ib_epoch_enter(struct ib_epoch *ep, struct ib_epoch_reader *r)
+{
+	ilong epoch = IATOMIC_LOAD(&ep->epoch);
+	IATOMIC_STORE(&r->active, epoch);
+	/* announcement must be visible before any shared pointer is read */
+	IATOMIC_FENCE();
+}
+
+void ib_epoch_leave(struct ib_epoch *ep, struct ib_epoch_reader *r)
+{
+	IATOMIC_STORE(&r->active, 0);
+	ep = ep;
+}
+
+size_t ib_epoch_retire(struct ib_epoch *ep, void *ptr)
+{
+	struct ib_epoch_limbo *limbo = _ib_epoch_record(ep);
+	limbo->ptr = ptr;
+	/* unlinking must be visible before the epoch is sampled */
+	IATOMIC_FENCE();
+	limbo->epoch = IATOMIC_LOAD(&ep->epoch);
+	_ib_epoch_push(&ep->incoming, limbo, limbo);
+	return (size_t)IATOMIC_ADD(&ep->retired, 1);
+}
+
+size_t ib_epoch_collect(struct ib_epoch *ep)
+{
+	struct ib_epoch_limbo *list = NULL, *last = NULL, *limbo;
+	struct ib_epoch_limbo * volatile *link = &list;
+	struct ib_epoch_reader *r;
+	size_t count = 0;
+	ilong least;
+	IMUTEX_LOCK(&ep->lock);
+	_ib_epoch_gather(ep);
+	if (ep->head == NULL) {
+		IMUTEX_UNLOCK(&ep->lock);
+		return 0;
+	}
+	/* objects retired in epoch e are safe when every reader > e */
+	least = IATOMIC_ADD(&ep->epoch, 1);
+	IATOMIC_FENCE();
+	for (r = ep->readers; r; r = r->next) {
+		ilong active = IATOMIC_LOAD(&r->active);
+		if (active != 0 && active < least) least = active;
+	}
+	/* concurrent retires can be slightly out of epoch order */
+	ep->tail = NULL;
+	for (limbo = ep->head; limbo; limbo = limbo->next) {
+		if (limbo->epoch < least) {
+			IATOMIC_STORE(link, limbo);
+			link = &limbo->next;
+			last = limbo;
+		}
+		else {
+			if (ep->tail) IATOMIC_STORE(&ep->tail->next, limbo);
+			else ep->head = limbo;
+			ep->tail = limbo;
+		}
+	}
+	if (ep->tail) IATOMIC_STORE(&ep->tail->next, NULL);
+	else ep->head = NULL;
+	IMUTEX_UNLOCK(&ep->lock);
+	if (list == NULL) {
+		return 0;
+	}
+	for (limbo = list; ; limbo = limbo->next) {
+		if (ep->reclaim) {
+			ep->reclaim(limbo->ptr, ep->user);
+		}
+		count++;
+		if (limbo == last) break;
+	}
+	_ib_epoch_push(&ep->spare, list, last);
+	IATOMIC_ADD(&ep->retired, -((ilong)count));
+	return count;
+}
+
+
+/*--------------------------------------------------------------------*/
+/* persistent avl - path copying snapshots for lock-free readers      */
+/*--------------------------------------------------------------------*/
+
+/* called by ib_epoch_collect inside the writer lock */
+static void _ib_ptree_reclaim(void *ptr, void *user)
+{
+	struct ib_ptree *pt = (struct ib_ptree*)user;
+	struct ib_pnode *node = (struct ib_pnode*)ptr;
+	if (node->height < 0 && pt->destroy) {
+		pt->destroy(node->data);
+	}
+	ib_fastbin_del(&pt->pool, node);
+}
+
+void ib_ptree_init(struct ib_ptree *pt,
+		int (*compare)(const void*, const void*), 
+		void (*destroy)(void *data))
+{
+	pt->root = NULL;
+	pt->count = 0;
+	pt->stamp = 0;
+	pt->compare = compare;
+	pt->destroy = destroy;
+	pt->removed = NULL;
+	iv_init(&pt->pending, NULL);
+	ib_fastbin_init(&pt->pool, sizeof(struct ib_pnode));
+	ib_epoch_init(&pt->epoch, _ib_ptree_reclaim, pt);
+	IMUTEX_INIT(&pt->lock);
+}
+
+static void _ib_ptree_free(struct ib_ptree *pt, struct ib_pnode *node)
+{
+	while (node) {
+		struct ib_pnode *right = node->right;
+		_ib_ptree_free(pt, node->left);
+		if (pt->destroy) pt->destroy(node->data);
+		ib_fastbin_del(&pt->pool, node);
+		node = right;
+	}
+}
+
+void ib_ptree_destroy(struct ib_ptree *pt)
+{
+	_ib_ptree_free(pt, pt->root);
+	pt->root = NULL;
+	pt->count = 0;
+	ib_epoch_destroy(&pt->epoch);
+	ib_fastbin_destroy(&pt->pool);
+	iv_destroy(&pt->pending);
+	IMUTEX_DESTROY(&pt->lock);
+}
+
+static inline int _ib_pnode_height(const struct ib_pnode *node)
+{
+	return (node)? node->height : 0;
+}
+
+static inline void _ib_pnode_height_update(struct ib_pnode *node)
+{
+	int h0 = _ib_pnode_height(node->left);
+	int h1 = _ib_pnode_height(node->right);
+	node->height = IB_MAX(h0, h1) + 1;
+}
+
+/* returns a writable node: nodes created by the current write can be
+ * modified in place, others are shared with snapshots and copied */
+static struct ib_pnode *
+_ib_ptree_own(struct ib_ptree *pt, struct ib_pnode *node)
+{
+	struct ib_pnode *copy;
+	if (node->stamp == pt->stamp) {
+		return node;
+	}
+	copy = (struct ib_pnode*)ib_fastbin_new(&pt->pool);
+	ASSERTION(copy);
+	copy[0] = node[0];
+	copy->stamp = pt->stamp;
+	iv_push(&pt->pending, &node, sizeof(struct ib_pnode*));
+	return copy;
+}
+
+static struct ib_pnode *
+_ib_ptree_rotate_left(struct ib_ptree *pt, struct ib_pnode *node)
+{
+	struct ib_pnode *right = _ib_ptree_own(pt, node->right);
+	node->right = right->left;
+	right->left = node;
+	_ib_pnode_height_update(node);
+	_ib_pnode_height_update(right);
+	return right;
+}
+
+static struct ib_pnode *
+_ib_ptree_rotate_right(struct ib_ptree *pt, struct ib_pnode *node)
+{
+	struct ib_pnode *left = _ib_ptree_own(pt, node->left);
+	node->left = left->right;
+	left->right = node;
+	_ib_pnode_height_update(node);
+	_ib_pnode_height_update(left);
+	return left;
+}
+
+/* node must be writable, returns the new subtree root */
+static struct ib_pnode *
+_ib_ptree_balance(struct ib_ptree *pt, struct ib_pnode *node)
+{
+	int h0 = _ib_pnode_height(node->left);
+	int h1 = _ib_pnode_height(node->right);
+	if (h0 - h1 >= 2) {
+		struct ib_pnode *left = node->left;
+		if (_ib_pnode_height(left->left) < _ib_pnode_height(left->right)) {
+			left = _ib_ptree_own(pt, left);
+			node->left = _ib_ptree_rotate_left(pt, left);
+		}
+		return _ib_ptree_rotate_right(pt, node);
+	}
+	if (h1 - h0 >= 2) {
+		struct ib_pnode *right = node->right;
+		if (_ib_pnode_height(right->right) < _ib_pnode_height(right->left)) {
+			right = _ib_ptree_own(pt, right);
+			node->right = _ib_ptree_rotate_right(pt, right);
+		}
+		return _ib_ptree_rotate_left(pt, node);
+	}
+	node->height = IB_MAX(h0, h1) + 1;
+	return node;
+}
+
+static struct ib_pnode *
+_ib_ptree_insert(struct ib_ptree *pt, struct ib_pnode *node, 
+		void *data, void **conflict)
+{
+	struct ib_pnode *child;
+	int hr;
+	if (node == NULL) {
+		node = (struct ib_pnode*)ib_fastbin_new(&pt->pool);
+		ASSERTION(node);
+		node->left = NULL;
+		node->right = NULL;
+		node->data = data;
+		node->height = 1;
+		node->stamp = pt->stamp;
+		return node;
+	}
+	hr = pt->compare(data, node->data);
+	if (hr == 0) {
+		conflict[0] = node->data;
+		return node;
+	}
+	child = _ib_ptree_insert(pt, (hr < 0)? node->left : node->right, 
+			data, conflict);
+	if (conflict[0]) {
+		return node;
+	}
+	node = _ib_ptree_own(pt, node);
+	if (hr < 0) node->left = child;
+	else node->right = child;
+	return _ib_ptree_balance(pt, node);
+}
+
+static struct ib_pnode *
+_ib_ptree_detach_min(struct ib_ptree *pt, struct ib_pnode *node,
+		struct ib_pnode **min)
+{
+	struct ib_pnode *child;
+	if (node->left == NULL) {
+		min[0] = node;
+		return node->right;
+	}
+	child = _ib_ptree_detach_min(pt, node->left, min);
+	node = _ib_ptree_own(pt, node);
+	node->left = child;
+	return _ib_ptree_balance(pt, node);
+}
+
+static struct ib_pnode *
+_ib_ptree_erase(struct ib_ptree *pt, struct ib_pnode *node, 
+		const void *data, int *found)
+{
+	struct ib_pnode *child, *min;
+	int hr;
+	if (node == NULL) {
+		found[0] = 0;
+		return NULL;
+	}
+	hr = pt->compare(data, node->data);
+	if (hr != 0) {
+		child = _ib_ptree_erase(pt, (hr < 0)? node->left : node->right,
+				data, found);
+		if (found[0] == 0) {
+			return node;
+		}
+		node = _ib_ptree_own(pt, node);
+		if (hr < 0) node->left = child;
+		else node->right = child;
+		return _ib_ptree_balance(pt, node);
+	}
+	found[0] = 1;
+	pt->removed = node;
+	if (node->left == NULL) return node->right;
+	if (node->right == NULL) return node->left;
+	child = _ib_ptree_detach_min(pt, node->right, &min);
+	min = _ib_ptree_own(pt, min);
+	min->left = node->left;
+	min->right = child;
+	return _ib_ptree_balance(pt, min);
+}
+
+/* publish the new version, then retire nodes replaced by this write */
+static void _ib_ptree_publish(struct ib_ptree *pt, struct ib_pnode *root)
+{
+	struct ib_pnode **pending;
+	size_t count, i;
+	IATOMIC_STORE(&pt->root, root);
+	pending = (struct ib_pnode**)pt->pending.data;
+	count = pt->pending.size / sizeof(struct ib_pnode*);
+	for (i = 0; i < count; i++) {
+		ib_epoch_retire(&pt->epoch, pending[i]);
+	}
+	iv_resize(&pt->pending, 0);
+	if (pt->removed) {
+		pt->removed->height = -1;
+		ib_epoch_retire(&pt->epoch, pt->removed);
+		pt->removed = NULL;
+	}
+	ib_epoch_collect(&pt->epoch);
+}
+
+void *ib_ptree_add(struct ib_ptree *pt, void *data)
+{
+	struct ib_pnode *root;
+	void *conflict = NULL;
+	IMUTEX_LOCK(&pt->lock);
+	pt->stamp++;
+	root = _ib_ptree_insert(pt, pt->root, data, &conflict);
+	if (conflict == NULL) {
+		pt->count++;
+		_ib_ptree_publish(pt, root);
+	}
+	IMUTEX_UNLOCK(&pt->lock);
+	return conflict;
+}
+
+int ib_ptree_remove(struct ib_ptree *pt, const void *data)
+{
+	struct ib_pnode *root;
+	int found = 0;
+	IMUTEX_LOCK(&pt->lock);
+	pt->stamp++;
+	root = _ib_ptree_erase(pt, pt->root, data, &found);
+	if (found) {
+		pt->count--;
+		_ib_ptree_publish(pt, root);
+	}
+	IMUTEX_UNLOCK(&pt->lock);
+	return (found)? 0 : -1;
+}
+
+const struct ib_pnode *ib_ptree_acquire(struct ib_ptree *pt, 
+		struct ib_epoch_reader *reader)
+{
+	ib_epoch_enter(&pt->epoch, reader);
+	return IATOMIC_LOAD(&pt->root);
+}
+
+void ib_ptree_release(struct ib_ptree *pt, struct ib_epoch_reader *reader)
+{
+	ib_epoch_leave(&pt->epoch, reader);
+}
+
+void *ib_ptree_find(const struct ib_ptree *pt, 
+		const struct ib_pnode *snapshot, const void *data)
+{
+	int (*compare)(const void*, const void*) = pt->compare;
+	const struct ib_pnode *node = snapshot;
+	while (node) {
+		int hr = compare(data, node->data);
+		if (hr == 0) return node->data;
+		node = (hr < 0)? node->left : node->right;
+	}
+	return NULL;
+}
+
+void *ib_ptree_first(const struct ib_pnode *snapshot, 
+		struct ib_ptree_iter *it)
+{
+	const struct ib_pnode *node;
+	it->top = 0;
+	for (node = snapshot; node; node = node->left) {
+		ASSERTION(it->top < IB_PNODE_DEPTH);
+		it->stack[it->top++] = node;
+	}
+	return (it->top > 0)? it->stack[it->top - 1]->data : NULL;
+}
+
+void *ib_ptree_seek(const struct ib_ptree *pt, 
+		const struct ib_pnode *snapshot, struct ib_ptree_iter *it,
+		const void *data)
+{
+	const struct ib_pnode *node = snapshot;
+	it->top = 0;
+	while (node) {
+		if (pt->compare(data, node->data) <= 0) {
+			ASSERTION(it->top < IB_PNODE_DEPTH);
+			it->stack[it->top++] = node;
+			node = node->left;
+		}	else {
+			node = node->right;
+		}
+	}
+	return (it->top > 0)? it->stack[it->top - 1]->data : NULL;
+}
+
+void *ib_ptree_next(struct ib_ptree_iter *it)
+{
+	const struct ib_pnode *node;
+	if (it->top <= 0) return NULL;
+	node = it->stack[--it->top]->right;
+	for (; node; node = node->left) {
+		ASSERTION(it->top < IB_PNODE_DEPTH);
+		it->stack[it->top++] = node;
+	}
+	return (it->top > 0)? it->stack[it->top - 1]->data : NULL;
+}
+
+
+/*--------------------------------------------------------------------*/
+/* skiplist - concurrent ordered set with the ib_tree interface       */
+/*--------------------------------------------------------------------*/
+struct ib_slnode
+{
+	void *data;
+	volatile ilong lock;
+	volatile ilong marked;     /* logically removed */
+	volatile ilong linked;     /* linked in all levels */
+	int level;
+	struct ib_slnode * volatile next[1];
+};
+
+#define IB_SLNODE_SIZE(level) \
+	(sizeof(struct ib_slnode) + sizeof(struct ib_slnode*) * ((level) - 1))
+
+static inline void _ib_slnode_lock(struct ib_slnode *node)
+{
+	while (!IATOMIC_CAS(&node->lock, 0, 1)) {
+		while (IATOMIC_LOAD(&node->lock) != 0) IATOMIC_PAUSE();
+	}
+}
+
+static inline void _ib_slnode_unlock(struct ib_slnode *node)
+{
+	IATOMIC_STORE(&node->lock, 0);
+}
+
+/* free nodes of each height are kept in a lock-free stack linked by
+ * next[0]. pop is safe from ABA: a node popped by another thread can
+ * only come back after its removal is reclaimed, and that waits for
+ * every thread inside the epoch, including the one popping here. */
+static void _ib_slnode_push(struct ib_skiplist *sl, int level,
+		struct ib_slnode *first, struct ib_slnode *last)
+{
+	struct ib_slnode * volatile *cache = &sl->cache[level - 1];
+	struct ib_slnode *head;
+	do {
+		head = IATOMIC_LOAD(cache);
+		IATOMIC_STORE(&last->next[0], head);
+	}	while (!IATOMIC_CAS(cache, head, first));
+}
+
+/* fill the cache from the pool, the lock is taken once per batch */
+static struct ib_slnode *_ib_slnode_refill(struct ib_skiplist *sl, 
+		int level)
+{
+	struct ib_slnode *first = NULL, *last = NULL, *node;
+	int i;
+	IMUTEX_LOCK(&sl->lock);
+	for (i = 0; i < IB_SKIPLIST_BATCH; i++) {
+		node = (struct ib_slnode*)ib_fastbin_new(&sl->pools[level - 1]);
+		ASSERTION(node);
+		IATOMIC_STORE(&node->next[0], first);
+		if (first == NULL) last = node;
+		first = node;
+	}
+	IMUTEX_UNLOCK(&sl->lock);
+	node = first;
+	first = node->next[0];
+	if (first) {
+		_ib_slnode_push(sl, level, first, last);
+	}
+	return node;
+}
+
+static struct ib_slnode *_ib_slnode_new(struct ib_skiplist *sl, int level)
+{
+	struct ib_slnode * volatile *cache = &sl->cache[level - 1];
+	struct ib_slnode *node, *next;
+	int i;
+	while (1) {
+		node = IATOMIC_LOAD(cache);
+		if (node == NULL) {
+			node = _ib_slnode_refill(sl, level);
+			break;
+		}
+		next = IATOMIC_LOAD(&node->next[0]);
+		if (IATOMIC_CAS(cache, node, next)) break;
+	}
+	node->data = NULL;
+	node->lock = 0;
+	node->marked = 0;
+	node->linked = 0;
+	node->level = level;
+	/* a stale pop in another thread may still read next[0] */
+	for (i = 0; i < level; i++) IATOMIC_STORE(&node->next[i], NULL);
+	return node;
+}
+
+static void _ib_slnode_free(struct ib_skiplist *sl, struct ib_slnode *node)
+{
+	_ib_slnode_push(sl, node->level, node, node);
+}
+
+/* nodes never linked (lost an add race) don't own their data */
+static void _ib_skiplist_reclaim(void *ptr, void *user)
+{
+	struct ib_skiplist *sl = (struct ib_skiplist*)user;
+	struct ib_slnode *node = (struct ib_slnode*)ptr;
+	if (sl->destroy && node->linked) sl->destroy(node->data);
+	_ib_slnode_free(sl, node);
+}
+
+void ib_skiplist_init(struct ib_skiplist *sl,
+		int (*compare)(const void*, const void*),
+		void (*destroy)(void *data))
+{
+	int i;
+	for (i = 0; i < IB_SKIPLIST_LEVEL; i++) {
+		ib_fastbin_init(&sl->pools[i], IB_SLNODE_SIZE(i + 1));
+		sl->cache[i] = NULL;
+	}
+	IMUTEX_INIT(&sl->lock);
+	sl->count = 0;
+	sl->seed = 0;
+	sl->compare = compare;
+	sl->destroy = destroy;
+	ib_epoch_init(&sl->epoch, _ib_skiplist_reclaim, sl);
+	sl->head = _ib_slnode_new(sl, IB_SKIPLIST_LEVEL);
+	sl->head->linked = 1;
+}
+
+void ib_skiplist_destroy(struct ib_skiplist *sl)
+{
+	int i;
+	ib_skiplist_clear(sl);
+	ib_epoch_destroy(&sl->epoch);
+	sl->head = NULL;
+	/* cached nodes live in the pool pages */
+	for (i = 0; i < IB_SKIPLIST_LEVEL; i++) {
+		ib_fastbin_destroy(&sl->pools[i]);
+		sl->cache[i] = NULL;
+	}
+	IMUTEX_DESTROY(&sl->lock);
+}
+
+/* geometric level with p = 1/4 from a hashed shared counter */
+static int _ib_skiplist_random(struct ib_skiplist *sl)
+{
+	IUINT32 x = (IUINT32)IATOMIC_ADD(&sl->seed, 1);
+	int level = 1;
+	x ^= x >> 16;
+	x *= 0x7feb352dUL;
+	x ^= x >> 15;
+	x *= 0x846ca68bUL;
+	x ^= x >> 16;
+	for (; (x & 3) == 0 && level < IB_SKIPLIST_LEVEL; x >>= 2) {
+		level++;
+	}
+	return level;
+}
+
+/* fill the last node < data and its successor for every level, 
+ * returns the highest level where data is found, -1 for not found */
+static int _ib_skiplist_search(struct ib_skiplist *sl, const void *data,
+		struct ib_slnode **preds, struct ib_slnode **succs)
+{
+	int (*compare)(const void*, const void*) = sl->compare;
+	struct ib_slnode *pred = sl->head, *curr, *last = NULL;
+	int found = -1, level, hr = 1;
+	for (level = IB_SKIPLIST_LEVEL - 1; level >= 0; level--) {
+		curr = IATOMIC_LOAD(&pred->next[level]);
+		while (curr) {
+			/* already compared on the upper level */
+			if (curr != last) hr = compare(curr->data, data);
+			last = curr;
+			if (hr >= 0) break;
+			pred = curr;
+			curr = IATOMIC_LOAD(&pred->next[level]);
+		}
+		if (curr && hr == 0 && found < 0) found = level;
+		preds[level] = pred;
+		succs[level] = curr;
+	}
+	return found;
+}
+
+static inline void _ib_skiplist_unlock(struct ib_slnode **preds, int top)
+{
+	int i;
+	for (i = 0; i <= top; i++) {
+		if (i == 0 || preds[i] != preds[i - 1]) {
+			_ib_slnode_unlock(preds[i]);
+		}
+	}
+}
+
+static inline int _ib_slnode_alive(const struct ib_slnode *node)
+{
+	return IATOMIC_LOAD(&node->linked) && !IATOMIC_LOAD(&node->marked);
+}
+
+/* first alive node >= data (or > data if upper), NULL for head */
+static struct ib_slnode *_ib_skiplist_ceil(struct ib_skiplist *sl,
+		const void *data, int upper)
+{
+	int (*compare)(const void*, const void*) = sl->compare;
+	struct ib_slnode *pred = sl->head, *curr;
+	int level;
+	if (data) {
+		for (level = IB_SKIPLIST_LEVEL - 1; level >= 0; level--) {
+			curr = IATOMIC_LOAD(&pred->next[level]);
+			while (curr) {
+				int hr = compare(curr->data, data);
+				if (hr > 0 || (hr == 0 && upper == 0)) break;
+				pred = curr;
+				curr = IATOMIC_LOAD(&pred->next[level]);
+			}
+		}
+	}
+	curr = IATOMIC_LOAD(&pred->next[0]);
+	while (curr && !_ib_slnode_alive(curr)) {
+		curr = IATOMIC_LOAD(&curr->next[0]);
+	}
+	return curr;
+}
+
+/* last alive node < data (data == NULL for the last one) */
+static struct ib_slnode *_ib_skiplist_floor(struct ib_skiplist *sl,
+		const void *data)
+{
+	int (*compare)(const void*, const void*) = sl->compare;
+	struct ib_slnode *pred, *curr;
+	int level;
+	while (1) {
+		pred = sl->head;
+		for (level = IB_SKIPLIST_LEVEL - 1; level >= 0; level--) {
+			curr = IATOMIC_LOAD(&pred->next[level]);
+			for (; curr; curr = IATOMIC_LOAD(&pred->next[level])) {
+				if (data && compare(curr->data, data) >= 0) break;
+				pred = curr;
+			}
+		}
+		if (pred == sl->head) return NULL;
+		if (_ib_slnode_alive(pred)) return pred;
+		/* no backward link: search again below the dead one */
+		data = pred->data;
+	}
+}
+
+void *ib_skiplist_first(struct ib_skiplist *sl)
+{
+	struct ib_slnode *node = _ib_skiplist_ceil(sl, NULL, 0);
+	return (node)? node->data : NULL;
+}
+
+void *ib_skiplist_last(struct ib_skiplist *sl)
+{
+	struct ib_slnode *node = _ib_skiplist_floor(sl, NULL);
+	return (node)? node->data : NULL;
+}
+
+void *ib_skiplist_next(struct ib_skiplist *sl, const void *data)
+{
+	struct ib_slnode *node;
+	if (data == NULL) return NULL;
+	node = _ib_skiplist_ceil(sl, data, 1);
+	return (node)? node->data : NULL;
+}
+
+void *ib_skiplist_prev(struct ib_skiplist *sl, const void *data)
+{
+	struct ib_slnode *node;
+	if (data == NULL) return NULL;
+	node = _ib_skiplist_floor(sl, data);
+	return (node)? node->data : NULL;
+}
+
+void *ib_skiplist_iter_seek(struct ib_skiplist_iter *it,
+		struct ib_skiplist *sl, const void *data)
+{
+	it->sl = sl;
+	it->node = _ib_skiplist_ceil(sl, data, 0);
+	return (it->node)? it->node->data : NULL;
+}
+
+void *ib_skiplist_iter_next(struct ib_skiplist_iter *it)
+{
+	struct ib_slnode *node = it->node;
+	if (node == NULL) return NULL;
+	if (_ib_slnode_alive(node)) {
+		node = IATOMIC_LOAD(&node->next[0]);
+		while (node && !_ib_slnode_alive(node)) {
+			node = IATOMIC_LOAD(&node->next[0]);
+		}
+	}
+	else {
+		/* removed meanwhile: its links may be stale */
+		node = _ib_skiplist_ceil(it->sl, node->data, 1);
+	}
+	it->node = node;
+	return (node)? node->data : NULL;
+}
+
+void *ib_skiplist_find(struct ib_skiplist *sl, const void *data)
+{
+	struct ib_slnode *node = _ib_skiplist_ceil(sl, data, 0);
+	if (node == NULL) return NULL;
+	return (sl->compare(node->data, data) == 0)? node->data : NULL;
+}
+
+void *ib_skiplist_lower_bound(struct ib_skiplist *sl, const void *data)
+{
+	struct ib_slnode *node = _ib_skiplist_ceil(sl, data, 0);
+	return (node)? node->data : NULL;
+}
+
+void *ib_skiplist_upper_bound(struct ib_skiplist *sl, const void *data)
+{
+	struct ib_slnode *node = _ib_skiplist_ceil(sl, data, 1);
+	return (node)? node->data : NULL;
+}
+
+void *ib_skiplist_add(struct ib_skiplist *sl, void *data)
+{
+	struct ib_slnode *preds[IB_SKIPLIST_LEVEL];
+	struct ib_slnode *succs[IB_SKIPLIST_LEVEL];
+	struct ib_slnode *node, *pred, *succ, *prev;
+	int level = _ib_skiplist_random(sl);
+	int found, locked, valid, i;
+	node = _ib_slnode_new(sl, level);
+	node->data = data;
+	while (1) {
+		found = _ib_skiplist_search(sl, data, preds, succs);
+		if (found >= 0) {
+			struct ib_slnode *conflict = succs[found];
+			if (!IATOMIC_LOAD(&conflict->marked)) {
+				/* wait for the insertion in progress */
+				while (!IATOMIC_LOAD(&conflict->linked)) IATOMIC_PAUSE();
+				/* pushing it back now could let a stale pop in 
+				 * another thread succeed (ABA), let it age first */
+				if (ib_epoch_retire(&sl->epoch, node) >= 
+						IB_SKIPLIST_COLLECT) {
+					ib_epoch_collect(&sl->epoch);
+				}
+				return conflict->data;
+			}
+			continue;
+		}
+		/* lock predecessors bottom-up and validate */
+		for (i = 0, locked = -1, valid = 1, prev = NULL; 
+				valid && i < level; i++) {
+			pred = preds[i];
+			succ = succs[i];
+			if (pred != prev) {
+				_ib_slnode_lock(pred);
+				locked = i;
+				prev = pred;
+			}
+			valid = !IATOMIC_LOAD(&pred->marked) && 
+				(succ == NULL || !IATOMIC_LOAD(&succ->marked)) &&
+				IATOMIC_LOAD(&pred->next[i]) == succ;
+		}
+		if (valid) break;
+		_ib_skiplist_unlock(preds, locked);
+	}
+	for (i = 0; i < level; i++) {
+		IATOMIC_STORE(&node->next[i], succs[i]);
+	}
+	for (i = 0; i < level; i++) {
+		IATOMIC_STORE(&preds[i]->next[i], node);
+	}
+	IATOMIC_STORE(&node->linked, 1);
+	_ib_skiplist_unlock(preds, locked);
+	IATOMIC_ADD(&sl->count, 1);
+	return NULL;
+}
+
+int ib_skiplist_remove(struct ib_skiplist *sl, const void *data)
+{
+	struct ib_slnode *preds[IB_SKIPLIST_LEVEL];
+	struct ib_slnode *succs[IB_SKIPLIST_LEVEL];
+	struct ib_slnode *victim = NULL, *pred, *prev;
+	int found, locked, valid, i, level = 0;
+	while (1) {
+		found = _ib_skiplist_search(sl, data, preds, succs);
+		if (victim == NULL) {
+			if (found < 0) return -1;
+			victim = succs[found];
+			/* not fully linked or found below its top: not ours */
+			if (!IATOMIC_LOAD(&victim->linked) || 
+				victim->level - 1 != found ||
+				IATOMIC_LOAD(&victim->marked)) {
+				return -1;
+			}
+			_ib_slnode_lock(victim);
+			if (victim->marked) {
+				_ib_slnode_unlock(victim);
+				return -1;
+			}
+			IATOMIC_STORE(&victim->marked, 1);
+			level = victim->level;
+		}
+		for (i = 0, locked = -1, valid = 1, prev = NULL; 
+				valid && i < level; i++) {
+			pred = preds[i];
+			if (pred != prev) {
+				_ib_slnode_lock(pred);
+				locked = i;
+				prev = pred;
+			}
+			valid = !IATOMIC_LOAD(&pred->marked) &&
+				IATOMIC_LOAD(&pred->next[i]) == victim;
+		}
+		if (valid) break;
+		_ib_skiplist_unlock(preds, locked);
+	}
+	for (i = level - 1; i >= 0; i--) {
+		IATOMIC_STORE(&preds[i]->next[i], victim->next[i]);
+	}
+	_ib_slnode_unlock(victim);
+	_ib_skiplist_unlock(preds, locked);
+	IATOMIC_ADD(&sl->count, -1);
+	if (ib_epoch_retire(&sl->epoch, victim) >= IB_SKIPLIST_COLLECT) {
+		ib_epoch_collect(&sl->epoch);
+	}
+	return 0;
+}
+
+void ib_skiplist_clear(struct ib_skiplist *sl)
+{
+	struct ib_slnode *node = sl->head->next[0];
+	int i;
+	while (node) {
+		struct ib_slnode *next = node->next[0];
+		if (sl->destroy) sl->destroy(node->data);
+		_ib_slnode_free(sl, node);
+		node = next;
+	}
+	for (i = 0; i < IB_SKIPLIST_LEVEL; i++) {
+		sl->head->next[i] = NULL;
+	}
+	sl->count = 0;
+	ib_epoch_collect(&sl->epoch);
+}
+
+
+/*--------------------------------------------------------------------*/
+/* string                                                             */
+/*--------------------------------------------------------------------*/
+
+ib_string* ib_string_new(void)
+{
+	struct ib_string* str = (ib_string*)ikmem_malloc(sizeof(ib_string));
+	assert(str);
+	str->ptr = str->sso;
+	str->size = 0;
+	str->capacity = IB_STRING_SSO;
+	str->ptr[0] = 0;
+	return str;
+}
+
+
+void ib_string_delete(ib_string *str)
+{
+	assert(str);
+	if (str) {
+		if (str->ptr && str->ptr != str->sso) 
+			ikmem_free(str->ptr);
+		str->ptr = NULL;
+		str->size = str->capacity = 0;
+	}
+	ikmem_free(str);
+}
+
+ib_string* ib_string_new_size(const char *text, int size)
+{
+	struct ib_string *str = ib_string_new();
+	size = (size > 0)? size : 0;
+	if (size > 0 && text) {
+		ib_string_resize(str, size);
+		memcpy(str->ptr, text, size);
+	}
+	return str;
+}
+
+ib_string* ib_string_new_from(const char *text)
+{
+	return ib_string_new_size(text, (text)? ((int)strlen(text)) : 0);
+}
+
+static void _ib_string_set_capacity(ib_string *str, int capacity)
+{
+	assert(str);
+	assert(capacity >= 0);
+	if (capacity <= IB_STRING_SSO) {
+		capacity = IB_STRING_SSO;
+		if (str->ptr != str->sso) {
+			if (str->size > 0) {
+				int csize = (str->size < capacity) ? str->size : capacity;
+				memcpy(str->sso, str->ptr, csize);
+			}
+			ikmem_free(str->ptr);
+			str->ptr = str->sso;
+			str->capacity = IB_STRING_SSO;
+		}
+	}
+	else {
+		char *ptr = (char*)ikmem_malloc(capacity + 2);
+		int csize = (capacity < str->size) ? capacity : str->size;
+		assert(ptr);
+		if (csize > 0) {
+			memcpy(ptr, str->ptr, csize);
+		}
+		if (str->ptr != str->sso)
+			ikmem_free(str->ptr);
+		str->ptr = ptr;
+		str->capacity = capacity;
+	}
+	if (str->size > str->capacity)
+		str->size = str->capacity;
+	str->ptr[str->size] = 0;
+}
+
+ib_string* ib_string_resize(ib_string *str, int newsize)
+{
+	assert(str && newsize >= 0);
+	if (newsize > str->capacity) {
+		int capacity = str->capacity * 2;
+		if (capacity < newsize) {
+			while (capacity < newsize) {
+				capacity = capacity * 2;
+			}
+		}
+		_ib_string_set_capacity(str, capacity);
+	}
+	str->size = newsize;
+	str->ptr[str->size] = 0;
+	return str;
+}
+
+ib_string* ib_string_reserve(ib_string *str, int newsize)
+{
+	int size = (newsize >= str->size)? newsize : str->size;
+	_ib_string_set_capacity(str, size);
+	return str;
+}
+
+ib_string* ib_string_insert(ib_string *str, int pos, 
+		const void *data, int size)
+{
+	int current = str->size;
+	if (pos < 0 || pos > str->size)
+		return NULL;
+	ib_string_resize(str, str->size + size);
+	if (pos < current) {
+		memmove(str->ptr + pos + size, str->ptr + pos, current - pos);
+	}
+	if (data) {
+		memcpy(str->ptr + pos, data, size);
+	}
+	return str;
+}
+
+ib_string* ib_string_insert_c(ib_string *str, int pos, char c)
+{
+	int current = str->size;
+	if (pos < 0 || pos > str->size)
+		return NULL;
+	ib_string_resize(str, str->size + 1);
+	if (pos < current) {
+		memmove(str->ptr + pos + 1, str->ptr + pos, current - pos);
+	}
+	str->ptr[pos] = c;
+	return str;
+}
+
+ib_string* ib_string_erase(ib_string *str, int pos, int size)
+{
+	int current = str->size;
+	if (pos >= current) return 0;
+	if (pos + size >= current) size = current - pos;
+	if (size == 0) return 0;
+	memmove(str->ptr + pos, str->ptr + pos + size, current - pos - size);
+	return ib_string_resize(str, current - size);
+}
+
+int ib_string_compare(const struct ib_string *a, const struct ib_string *b)
+{
+	int minsize = (a->size < b->size)? a->size : b->size;
+	int hr = memcmp(a->ptr, b->ptr, minsize);
+	if (hr < 0) return -1;
+	else if (hr > 0) return 1;
+	if (a->size < b->size) return -1;
+	else if (a->size > b->size) return 1;
+	return 0;
+}
+
+
+ib_string* ib_string_assign(ib_string *str, const char *src)
+{
+	return ib_string_assign_size(str, src, (int)strlen(src));
+}
+
+ib_string* ib_string_assign_size(ib_string *str, const char *src, int size)
+{
+	assert(size >= 0);
+	ib_string_resize(str, size);
+	if (src) {
+		memcpy(str->ptr, src, size);
+	}
+	return str;
+}
+
+
+ib_string* ib_string_append(ib_string *str, const char *src)
+{
+	return ib_string_append_size(str, src, (int)strlen(src));
+}
+
+
+ib_string* ib_string_append_size(ib_string *str, const char *src, int size)
+{
+	return ib_string_insert(str, str->size, src, size);
+}
+
+ib_string* ib_string_append_c(ib_string *str, char c)
+{
+	ib_string_resize(str, str->size + 1);
+	str->ptr[str->size - 1] = c;
+	return str;
+}
+
+ib_string* ib_string_prepend(ib_string *str, const char *src)
+{
+	return ib_string_prepend_size(str, src, (int)strlen(src));
+}
+
+ib_string* ib_string_prepend_size(ib_string *str, const char *src, int size)
+{
+	return ib_string_insert(str, 0, src, size);
+}
+
+ib_string* ib_string_prepend_c(ib_string *str, char c)
+{
+	int current = str->size;
+	ib_string_resize(str, current + 1);
+	if (current > 0) {
+		memmove(str->ptr + 1, str->ptr, current);
+	}
+	str->ptr[0] = c;
+	return str;
+}
+
+ib_string* ib_string_rewrite(ib_string *str, int pos, const char *src)
+{
+	return ib_string_rewrite_size(str, pos, src, (int)strlen(src));
+}
+
+ib_string* ib_string_rewrite_size(ib_string *str, int pos, 
+		const char *src, int size)
+{
+	if (pos < 0) size += pos, pos = 0;
+	if (pos + size >= str->size) size = str->size - pos;
+	if (size <= 0) return str;
+	if (src) {
+		memcpy(str->ptr + pos, src, size);
+	}
+	return str;
+}
+
+
+
+/*--------------------------------------------------------------------*/
+/* static hash table (closed hash table with avlnode)                 */
+/*--------------------------------------------------------------------*/
+
+
+void ib_hash_init(struct ib_hash_table *ht, 
+		size_t (*hash)(const void *key),
+		int (*compare)(const void *key1, const void *key2))
+{
+	size_t i;
+	ht->count = 0;
+	ht->index_size = IB_HASH_INIT_SIZE;
+	ht->index_mask = ht->index_size - 1;
+	ht->hash = hash;
+	ht->compare = compare;
+	ilist_init(&ht->head);
+	ht->index = ht->init;
+	ht->old_index = NULL;
+	ht->old_mask = 0;
+	ht->migrate = 0;
+	for (i = 0; i < IB_HASH_INIT_SIZE; i++) {
+		ht->index[i].avlroot.node = NULL;
+		IB_ROOT_STATS_INIT(&ht->index[i].avlroot);
+		ilist_init(&(ht->index[i].node));
+	}
+}
+
+struct ib_hash_node* ib_hash_node_first(struct ib_hash_table *ht)
+{
+	struct ILISTHEAD *head = ht->head.next;
+	if (head != &ht->head) {
+		struct ib_hash_index *index = 
+			ilist_entry(head, struct ib_hash_index, node);
+		struct ib_node *avlnode = ib_node_first(&index->avlroot);
+		if (avlnode == NULL) return NULL;
+		return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+	}
+	return NULL;
+}
+
+struct ib_hash_node* ib_hash_node_last(struct ib_hash_table *ht)
+{
+	struct ILISTHEAD *head = ht->head.prev;
+	if (head != &ht->head) {
+		struct ib_hash_index *index = 
+			ilist_entry(head, struct ib_hash_index, node);
+		struct ib_node *avlnode = ib_node_last(&index->avlroot);
+		if (avlnode == NULL) return NULL;
+		return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+	}
+	return NULL;
+}
+
+struct ib_hash_node* ib_hash_node_next(struct ib_hash_table *ht, 
+		struct ib_hash_node *node)
+{
+	struct ib_node *avlnode;
+	struct ib_hash_index *index;
+	struct ILISTHEAD *listnode;
+	if (node == NULL) return NULL;
+	avlnode = ib_node_next(&node->avlnode);
+	if (avlnode) {
+		return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+	}
+	index = ib_hash_locate(ht, node->hash);
+	listnode = index->node.next;
+	if (listnode == &(ht->head)) {
+		return NULL;
+	}
+	index = ilist_entry(listnode, struct ib_hash_index, node);
+	avlnode = ib_node_first(&index->avlroot);
+	if (avlnode == NULL) return NULL;
+	return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+}
+
+struct ib_hash_node* ib_hash_node_prev(struct ib_hash_table *ht, 
+		struct ib_hash_node *node)
+{
+	struct ib_node *avlnode;
+	struct ib_hash_index *index;
+	struct ILISTHEAD *listnode;
+	if (node == NULL) return NULL;
+	avlnode = ib_node_prev(&node->avlnode);
+	if (avlnode) {
+		return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+	}
+	index = ib_hash_locate(ht, node->hash);
+	listnode = index->node.prev;
+	if (listnode == &(ht->head)) {
+		return NULL;
+	}
+	index = ilist_entry(listnode, struct ib_hash_index, node);
+	avlnode = ib_node_last(&index->avlroot);
+	if (avlnode == NULL) return NULL;
+	return IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+}
+
+struct ib_hash_node* ib_hash_find(struct ib_hash_table *ht,
+		const struct ib_hash_node *node)
+{
+	size_t hash = node->hash;
+	const void *key = node->key;
+	struct ib_hash_index *index = ib_hash_locate(ht, hash);
+	struct ib_node *avlnode = index->avlroot.node;
+	int (*compare)(const void *, const void *) = ht->compare;
+	while (avlnode) {
+		struct ib_hash_node *snode = 
+			IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+		size_t shash = snode->hash;
+		if (hash == shash) {
+			int hc = compare(key, snode->key);
+			if (hc == 0) return snode;
+			avlnode = (hc < 0)? avlnode->left : avlnode->right;
+		}
+		else {
+			avlnode = (hash < shash)? avlnode->left : avlnode->right;
+		}
+	}
+	return NULL;
+}
+
+void ib_hash_erase(struct ib_hash_table *ht, struct ib_hash_node *node)
+{
+	struct ib_hash_index *index;
+	ASSERTION(node && ht);
+	ASSERTION(!ib_node_empty(&node->avlnode));
+	index = ib_hash_locate(ht, node->hash);
+	if (index->avlroot.node == &node->avlnode && node->avlnode.height == 1) {
+		index->avlroot.node = NULL;
+		ilist_del_init(&index->node);
+	}
+	else {
+		ib_node_erase(&node->avlnode, &index->avlroot);
+	}
+	ib_node_init(&node->avlnode);
+	ht->count--;
+}
+
+static struct ib_node** _ib_hash_track(struct ib_hash_table *ht,
+		struct ib_hash_index *index, const struct ib_hash_node *node, 
+		struct ib_node **parent)
+{
+	size_t hash = node->hash;
+	const void *key = node->key;
+	struct ib_node **link = &index->avlroot.node;
+	struct ib_node *p = NULL;
+	int (*compare)(const void *key1, const void *key2) = ht->compare;
+	parent[0] = NULL;
+	while (link[0]) {
+		struct ib_hash_node *snode;
+		size_t shash;
+		p = link[0];
+		snode = IB_ENTRY(p, struct ib_hash_node, avlnode);
+		shash = snode->hash;
+		if (hash == shash) {
+			int hc = compare(key, snode->key);
+			if (hc == 0) {
+				parent[0] = p;
+				return NULL;
+			}
+			link = (hc < 0)? (&p->left) : (&p->right);
+		}
+		else {
+			link = (hash < shash)? (&p->left) : (&p->right);
+		}
+	}
+	parent[0] = p;
+	return link;
+}
+
+struct ib_node** ib_hash_track(struct ib_hash_table *ht,
+		const struct ib_hash_node *node, struct ib_node **parent)
+{
+	struct ib_hash_index *index = ib_hash_locate(ht, node->hash);
+	return _ib_hash_track(ht, index, node, parent);
+}
+
+static struct ib_hash_node* _ib_hash_add(struct ib_hash_table *ht,
+		struct ib_hash_index *index, struct ib_hash_node *node)
+{
+	if (index->avlroot.node == NULL) {
+		index->avlroot.node = &node->avlnode;
+		node->avlnode.parent = NULL;
+		node->avlnode.left = NULL;
+		node->avlnode.right = NULL;
+		node->avlnode.height = 1;
+		ilist_add_tail(&index->node, &ht->head);
+	}
+	else {
+		struct ib_node **link, *parent;
+		link = _ib_hash_track(ht, index, node, &parent);
+		if (link == NULL) {
+			ASSERTION(parent);
+			return IB_ENTRY(parent, struct ib_hash_node, avlnode);
+		}
+		ib_node_link(&node->avlnode, parent, link);
+		ib_node_post_insert(&node->avlnode, &index->avlroot);
+	}
+	return NULL;
+}
+
+struct ib_hash_node* ib_hash_add(struct ib_hash_table *ht,
+		struct ib_hash_node *node)
+{
+	struct ib_hash_index *index = ib_hash_locate(ht, node->hash);
+	struct ib_hash_node *hr = _ib_hash_add(ht, index, node);
+	if (hr == NULL) {
+		ht->count++;
+	}
+	return hr;
+}
+
+
+void ib_hash_replace(struct ib_hash_table *ht, 
+		struct ib_hash_node *victim, struct ib_hash_node *newnode)
+{
+	struct ib_hash_index *index = ib_hash_locate(ht, victim->hash);
+	ib_node_replace(&victim->avlnode, &newnode->avlnode, &index->avlroot);
+}
+
+void ib_hash_clear(struct ib_hash_table *ht,
+		void (*destroy)(struct ib_hash_node *node))
+{
+	while (!ilist_is_empty(&ht->head)) {
+		struct ib_hash_index *index = ilist_entry(ht->head.next, 
+				struct ib_hash_index, node);
+		struct ib_node *next = NULL;
+		while (index->avlroot.node != NULL) {
+			struct ib_node *avlnode = ib_node_tear(&index->avlroot, &next);
+			ASSERTION(avlnode);
+			if (destroy) {
+				struct ib_hash_node *node = 
+					IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+				destroy(node);
+			}
+		}
+		ilist_del_init(&index->node);
+	}
+	ht->count = 0;
+}
+
+
+void* ib_hash_swap(struct ib_hash_table *ht, void *ptr, size_t nbytes)
+{
+	struct ib_hash_index *old_index = ht->index;
+	struct ib_hash_index *new_index = (struct ib_hash_index*)ptr;
+	size_t index_size = 1;
+	struct ILISTHEAD head;
+	size_t i;
+	ASSERTION(nbytes >= sizeof(struct ib_hash_index));
+	ASSERTION(ht->old_index == NULL);
+	if (new_index == NULL) {
+		if (ht->index == ht->init) {
+			return NULL;
+		}
+		new_index = ht->init;
+		index_size = IB_HASH_INIT_SIZE;
+	}
+	else if (new_index == old_index) {
+		return old_index;
+	}
+	if (new_index != ht->init) {
+		size_t test_size = sizeof(struct ib_hash_index);
+		while (test_size < nbytes) {
+			size_t next_size = test_size * 2;
+			if (next_size > nbytes) break;
+			test_size = next_size;
+			index_size = index_size * 2;
+		}
+	}
+	ht->index = new_index;
+	ht->index_size = index_size;
+	ht->index_mask = index_size - 1;
+	ht->count = 0;
+	for (i = 0; i < index_size; i++) {
+		ht->index[i].avlroot.node = NULL;
+		IB_ROOT_STATS_INIT(&ht->index[i].avlroot);
+		ilist_init(&ht->index[i].node);
+	}
+	ilist_replace(&ht->head, &head);
+	ilist_init(&ht->head);
+	while (!ilist_is_empty(&head)) {
+		struct ib_hash_index *index = ilist_entry(head.next, 
+				struct ib_hash_index, node);
+	#if 1
+		struct ib_node *next = NULL;
+		while (index->avlroot.node) {
+			struct ib_node *avlnode = ib_node_tear(&index->avlroot, &next);
+			struct ib_hash_node *snode, *hr;
+			ASSERTION(avlnode);
+			snode = IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+			hr = ib_hash_add(ht, snode);
+			if (hr != NULL) {
+				ASSERTION(hr == NULL);
+				return NULL;
+			}
+		}
+	#else
+		while (index->avlroot.node) {
+			struct ib_node *avlnode = index->avlroot.node;
+			struct ib_hash_node *snode, *hr;
+			ib_node_erase(avlnode, &index->avlroot);
+			snode = IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+			hr = ib_hash_add(ht, snode);
+			ASSERTION(hr == NULL);
+			hr = hr;
+		}
+	#endif
+		ilist_del_init(&index->node);
+	}
+	return (old_index == ht->init)? NULL : old_index;
+}
+
+int ib_hash_rehash(struct ib_hash_table *ht, void *ptr, size_t nbytes)
+{
+	struct ib_hash_index *new_index = (struct ib_hash_index*)ptr;
+	size_t index_size = 1;
+	size_t i;
+	if (ht->old_index != NULL) {
+		return -1;
+	}
+	if (new_index == NULL) {
+		if (ht->index == ht->init) {
+			return 0;
+		}
+		new_index = ht->init;
+		index_size = IB_HASH_INIT_SIZE;
+	}
+	else if (new_index == ht->index) {
+		return 0;
+	}
+	else {
+		while (index_size * 2 * sizeof(struct ib_hash_index) <= nbytes) {
+			index_size *= 2;
+		}
+	}
+	for (i = 0; i < index_size; i++) {
+		new_index[i].avlroot.node = NULL;
+		IB_ROOT_STATS_INIT(&new_index[i].avlroot);
+		ilist_init(&new_index[i].node);
+	}
+	/* both indexes share the bucket list, nodes stay where they are */
+	ht->old_index = ht->index;
+	ht->old_mask = ht->index_mask;
+	ht->migrate = 0;
+	ht->index = new_index;
+	ht->index_size = index_size;
+	ht->index_mask = index_size - 1;
+	return 0;
+}
+
+void* ib_hash_migrate(struct ib_hash_table *ht, size_t n)
+{
+	struct ib_hash_index *old_index = ht->old_index;
+	size_t old_size;
+	if (old_index == NULL) {
+		return NULL;
+	}
+	old_size = ht->old_mask + 1;
+	for (; n > 0 && ht->migrate < old_size; n--) {
+		struct ib_hash_index *index = &old_index[ht->migrate];
+		struct ib_node *next = NULL;
+		while (index->avlroot.node) {
+			struct ib_node *avlnode = ib_node_tear(&index->avlroot, &next);
+			struct ib_hash_node *snode, *hr;
+			ASSERTION(avlnode);
+			snode = IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
+			hr = _ib_hash_add(ht, 
+					&ht->index[snode->hash & ht->index_mask], snode);
+			ASSERTION(hr == NULL);
+			hr = hr;
+		}
+		ilist_del_init(&index->node);
+		ht->migrate++;
+	}
+	if (ht->migrate < old_size) {
+		return NULL;
+	}
+	ht->old_index = NULL;
+	ht->old_mask = 0;
+	ht->migrate = 0;
+	return (old_index == ht->init)? NULL : old_index;
+}
+
+
+/*--------------------------------------------------------------------*/
+/* compact chained hash table (single linked, treeify long chains)    */
+/*--------------------------------------------------------------------*/
+
+/* tree buckets are allocated on demand, one wrapper per entry, the 
+ * next field of chain nodes is unused while they are in a tree */
+struct ib_chain_tnode
+{
+	struct ib_node avlnode;
+	struct ib_chain_node *node;
+};
+
+struct ib_chain_tree
+{
+	struct ib_root root;
+	size_t count;
+};
+
+#define IB_CHAIN_IS_TREE(p)  ((((size_t)(p)) & 1) != 0)
+#define IB_CHAIN_TREE(p) \
+	((struct ib_chain_tree*)(((size_t)(p)) & ~((size_t)1)))
+#define IB_CHAIN_TAG(tree) \
+	((struct ib_chain_node*)(((size_t)(tree)) | 1))
+#define IB_CHAIN_TNODE(n)    IB_ENTRY(n, struct ib_chain_tnode, avlnode)
+
+void ib_chain_init(struct ib_chain_table *ht,
+		size_t (*hash)(const void *key),
+		int (*compare)(const void *key1, const void *key2))
+{
+	size_t i;
+	ht->count = 0;
+	ht->index_size = IB_HASH_INIT_SIZE;
+	ht->index_mask = ht->index_size - 1;
+	ht->hash = hash;
+	ht->compare = compare;
+	ht->index = ht->init;
+	for (i = 0; i < IB_HASH_INIT_SIZE; i++) {
+		ht->index[i] = NULL;
+	}
+}
+
+/* tree buckets are ordered by hash first, then by key */
+static inline int _ib_chain_compare(struct ib_chain_table *ht,
+		size_t hash, const void *key, const struct ib_chain_node *snode)
+{
+	if (hash != snode->hash) {
+		return (hash < snode->hash)? -1 : 1;
+	}
+	return ht->compare(key, snode->key);
+}
+
+static struct ib_chain_tnode* _ib_chain_tree_find(struct ib_chain_table *ht,
+		struct ib_chain_tree *tree, size_t hash, const void *key)
+{
+	struct ib_node *avlnode = tree->root.node;
+	while (avlnode) {
+		struct ib_chain_tnode *tnode = IB_CHAIN_TNODE(avlnode);
+		int hr = _ib_chain_compare(ht, hash, key, tnode->node);
+		if (hr == 0) return tnode;
+		avlnode = (hr < 0)? avlnode->left : avlnode->right;
+	}
+	return NULL;
+}
+
+/* key must not be in the tree, returns 0 for success, -1 for no mem */
+static int _ib_chain_tree_add(struct ib_chain_table *ht,
+		struct ib_chain_tree *tree, struct ib_chain_node *node)
+{
+	struct ib_node **link = &tree->root.node;
+	struct ib_node *parent = NULL;
+	struct ib_chain_tnode *tnode;
+	tnode = (struct ib_chain_tnode*)
+		ikmem_malloc(sizeof(struct ib_chain_tnode));
+	if (tnode == NULL) {
+		return -1;
+	}
+	tnode->node = node;
+	while (link[0]) {
+		struct ib_chain_node *snode;
+		parent = link[0];
+		snode = IB_CHAIN_TNODE(parent)->node;
+		if (_ib_chain_compare(ht, node->hash, node->key, snode) < 0) {
+			link = &parent->left;
+		}	else {
+			link = &parent->right;
+		}
+	}
+	ib_node_link(&tnode->avlnode, parent, link);
+	ib_node_post_insert(&tnode->avlnode, &tree->root);
+	tree->count++;
+	return 0;
+}
+
+/* free every wrapper and the tree, returns the nodes as a chain */
+static struct ib_chain_node* _ib_chain_tree_free(struct ib_chain_tree *tree)
+{
+	struct ib_chain_node *head = NULL;
+	struct ib_node *next = NULL;
+	while (tree->root.node) {
+		struct ib_node *avlnode = ib_node_tear(&tree->root, &next);
+		struct ib_chain_tnode *tnode = IB_CHAIN_TNODE(avlnode);
+		tnode->node->next = head;
+		head = tnode->node;
+		ikmem_free(tnode);
+	}
+	ikmem_free(tree);
+	return head;
+}
+
+/* convert bucket to a tree, stays as a chain if out of memory */
+static void _ib_chain_treeify(struct ib_chain_table *ht, size_t pos)
+{
+	struct ib_chain_tree *tree;
+	struct ib_chain_node *node;
+	tree = (struct ib_chain_tree*)ikmem_malloc(sizeof(struct ib_chain_tree));
+	if (tree == NULL) {
+		return;
+	}
+	tree->root.node = NULL;
+	IB_ROOT_STATS_INIT(&tree->root);
+	tree->count = 0;
+	for (node = ht->index[pos]; node; node = node->next) {
+		if (_ib_chain_tree_add(ht, tree, node) != 0) {
+			/* the chain is still intact, drop the wrappers only */
+			struct ib_node *next = NULL;
+			while (tree->root.node) {
+				ikmem_free(IB_CHAIN_TNODE(ib_node_tear(&tree->root, &next)));
+			}
+			ikmem_free(tree);
+			return;
+		}
+	}
+	ht->index[pos] = IB_CHAIN_TAG(tree);
+}
+
+struct ib_chain_node* ib_chain_find(struct ib_chain_table *ht,
+		const struct ib_chain_node *node)
+{
+	size_t hash = node->hash;
+	const void *key = node->key;
+	struct ib_chain_node *p = ht->index[hash & ht->index_mask];
+	if (!IB_CHAIN_IS_TREE(p)) {
+		int (*compare)(const void*, const void*) = ht->compare;
+		for (; p; p = p->next) {
+			if (p->hash == hash && compare(key, p->key) == 0) {
+				return p;
+			}
+		}
+	}
+	else {
+		struct ib_chain_tnode *tnode;
+		tnode = _ib_chain_tree_find(ht, IB_CHAIN_TREE(p), hash, key);
+		if (tnode) return tnode->node;
+	}
+	return NULL;
+}
+
+/* insert a node known to be absent, never fails: if the tree bucket
+ * can not get a wrapper, the bucket goes back to a chain */
+static void _ib_chain_insert(struct ib_chain_table *ht, 
+		struct ib_chain_node *node)
+{
+	size_t pos = node->hash & ht->index_mask;
+	struct ib_chain_node *p = ht->index[pos];
+	size_t length = 1;
+	ht->count++;
+	if (IB_CHAIN_IS_TREE(p)) {
+		if (_ib_chain_tree_add(ht, IB_CHAIN_TREE(p), node) == 0) {
+			return;
+		}
+		p = _ib_chain_tree_free(IB_CHAIN_TREE(p));
+		ht->index[pos] = p;
+	}
+	for (; p; p = p->next) length++;
+	node->next = ht->index[pos];
+	ht->index[pos] = node;
+	if (length > IB_CHAIN_TREEIFY) {
+		_ib_chain_treeify(ht, pos);
+	}
+}
+
+struct ib_chain_node* ib_chain_add(struct ib_chain_table *ht,
+		struct ib_chain_node *node)
+{
+	struct ib_chain_node *conflict = ib_chain_find(ht, node);
+	if (conflict) {
+		return conflict;
+	}
+	_ib_chain_insert(ht, node);
+	return NULL;
+}
+
+void ib_chain_erase(struct ib_chain_table *ht, struct ib_chain_node *node)
+{
+	size_t pos = node->hash & ht->index_mask;
+	struct ib_chain_node *p = ht->index[pos];
+	if (!IB_CHAIN_IS_TREE(p)) {
+		struct ib_chain_node **link = &ht->index[pos];
+		while (link[0] != node) {
+			ASSERTION(link[0]);
+			link = &(link[0]->next);
+		}
+		link[0] = node->next;
+	}
+	else {
+		struct ib_chain_tree *tree = IB_CHAIN_TREE(p);
+		struct ib_chain_tnode *tnode;
+		tnode = _ib_chain_tree_find(ht, tree, node->hash, node->key);
+		ASSERTION(tnode && tnode->node == node);
+		ib_node_erase(&tnode->avlnode, &tree->root);
+		ikmem_free(tnode);
+		tree->count--;
+		if (tree->count <= IB_CHAIN_UNTREEIFY) {
+			ht->index[pos] = _ib_chain_tree_free(tree);
+		}
+	}
+	node->next = NULL;
+	ht->count--;
+}
+
+/* first node of the first non-empty bucket from pos */
+static struct ib_chain_node* _ib_chain_scan(struct ib_chain_table *ht,
+		size_t pos)
+{
+	for (; pos < ht->index_size; pos++) {
+		struct ib_chain_node *p = ht->index[pos];
+		if (p == NULL) continue;
+		if (!IB_CHAIN_IS_TREE(p)) return p;
+		return IB_CHAIN_TNODE(ib_node_first(&IB_CHAIN_TREE(p)->root))->node;
+	}
+	return NULL;
+}
+
+struct ib_chain_node* ib_chain_node_first(struct ib_chain_table *ht)
+{
+	return _ib_chain_scan(ht, 0);
+}
+
+struct ib_chain_node* ib_chain_node_next(struct ib_chain_table *ht,
+		struct ib_chain_node *node)
+{
+	size_t pos = node->hash & ht->index_mask;
+	struct ib_chain_node *p = ht->index[pos];
+	if (!IB_CHAIN_IS_TREE(p)) {
+		if (node->next) return node->next;
+	}
+	else {
+		struct ib_chain_tnode *tnode;
+		struct ib_node *avlnode;
+		tnode = _ib_chain_tree_find(ht, IB_CHAIN_TREE(p), 
+				node->hash, node->key);
+		ASSERTION(tnode);
+		avlnode = ib_node_next(&tnode->avlnode);
+		if (avlnode) return IB_CHAIN_TNODE(avlnode)->node;
+	}
+	return _ib_chain_scan(ht, pos + 1);
+}
+
+/* detach every node of the index into one chain */
+static struct ib_chain_node* _ib_chain_detach(struct ib_chain_table *ht)
+{
+	struct ib_chain_node *head = NULL;
+	size_t pos;
+	for (pos = 0; pos < ht->index_size; pos++) {
+		struct ib_chain_node *p = ht->index[pos];
+		if (IB_CHAIN_IS_TREE(p)) {
+			p = _ib_chain_tree_free(IB_CHAIN_TREE(p));
+		}
+		while (p) {
+			struct ib_chain_node *next = p->next;
+			p->next = head;
+			head = p;
+			p = next;
+		}
+		ht->index[pos] = NULL;
+	}
+	ht->count = 0;
+	return head;
+}
+
+void ib_chain_clear(struct ib_chain_table *ht,
+		void (*destroy)(struct ib_chain_node *node))
+{
+	struct ib_chain_node *node = _ib_chain_detach(ht);
+	while (node) {
+		struct ib_chain_node *next = node->next;
+		node->next = NULL;
+		if (destroy) destroy(node);
+		node = next;
+	}
+}
+
+void* ib_chain_swap(struct ib_chain_table *ht, void *ptr, size_t nbytes)
+{
+	struct ib_chain_node **old_index = ht->index;
+	struct ib_chain_node **new_index = (struct ib_chain_node**)ptr;
+	struct ib_chain_node *head;
+	size_t index_size = 1;
+	size_t i;
+	ASSERTION(nbytes >= sizeof(struct ib_chain_node*));
+	if (new_index == NULL) {
+		if (ht->index == ht->init) {
+			return NULL;
+		}
+		new_index = ht->init;
+		index_size = IB_HASH_INIT_SIZE;
+	}
+	else if (new_index == old_index) {
+		return old_index;
+	}
+	else {
+		while (index_size * 2 * sizeof(struct ib_chain_node*) <= nbytes) {
+			index_size *= 2;
+		}
+	}
+	head = _ib_chain_detach(ht);
+	ht->index = new_index;
+	ht->index_size = index_size;
+	ht->index_mask = index_size - 1;
+	for (i = 0; i < index_size; i++) {
+		ht->index[i] = NULL;
+	}
+	while (head) {
+		struct ib_chain_node *next = head->next;
+		_ib_chain_insert(ht, head);
+		head = next;
+	}
+	return (old_index == ht->init)? NULL : old_index;
+}
+
+
+/*--------------------------------------------------------------------*/
+/* hash map, wrapper of ib_hash_table to support direct key/value     */
+/*--------------------------------------------------------------------*/
+
+struct ib_hash_entry* ib_map_first(struct ib_hash_map *hm)
+{
+	struct ib_hash_node *node = ib_hash_node_first(&hm->ht);
+	if (node == NULL) return NULL;
+	return IB_ENTRY(node, struct ib_hash_entry, node);
+}
+
+
+struct ib_hash_entry* ib_map_last(struct ib_hash_map *hm)
+{
+	struct ib_hash_node *node = ib_hash_node_last(&hm->ht);
+	if (node == NULL) return NULL;
+	return IB_ENTRY(node, struct ib_hash_entry, node);
+}
+
+
+struct ib_hash_entry* ib_map_next(struct ib_hash_map *hm, 
+		struct ib_hash_entry *n)
+{
+	struct ib_hash_node *node = ib_hash_node_next(&hm->ht, &n->node);
+	if (node == NULL) return NULL;
+	return IB_ENTRY(node, struct ib_hash_entry, node);
+}
+
+
+struct ib_hash_entry* ib_map_prev(struct ib_hash_map *hm, 
+		struct ib_hash_entry *n)
+{
+	struct ib_hash_node *node = ib_hash_node_prev(&hm->ht, &n->node);
+	if (node == NULL) return NULL;
+	return IB_ENTRY(node, struct ib_hash_entry, node);
+}
+
+
+void ib_map_init(struct ib_hash_map *hm, size_t (*hash)(const void*),
+		int (*compare)(const void *, const void *))
+{
+	hm->count = 0;
+	hm->key_copy = NULL;
+	hm->key_destroy = NULL;
+	hm->value_copy = NULL;
+	hm->value_destroy = NULL;
+	hm->insert = 0;
+	hm->fixed = 0;
+	hm->incremental = 0;
+	hm->inline_keys = IB_MAP_INLINE_NONE;
+	hm->grow = IB_MAP_GROW;
+	hm->shrink = IB_MAP_SHRINK;
+	ib_hash_init(&hm->ht, hash, compare);
+	ib_fastbin_init(&hm->fb, sizeof(struct ib_hash_entry));
+}
+
+void ib_map_destroy(struct ib_hash_map *hm)
+{
+	void *ptr;
+	ib_map_clear(hm);
+	ptr = ib_hash_migrate(&hm->ht, ~((size_t)0));
+	if (ptr) {
+		ikmem_free(ptr);
+	}
+	ptr = ib_hash_swap(&hm->ht, NULL, 0);
+	if (ptr) {
+		ikmem_free(ptr);
+	}
+	ib_fastbin_destroy(&hm->fb);
+}
+
+/* find with a hash computed by the caller */
+static inline struct ib_hash_entry* 
+ib_map_find_hashed(struct ib_hash_map *hm, size_t hash, const void *key)
+{
+	struct ib_hash_node dummy;
+	struct ib_hash_node *rh;
+	dummy.key = (void*)key;
+	dummy.hash = hash;
+	rh = ib_hash_find(&hm->ht, &dummy);
+	return (rh == NULL)? NULL : IB_ENTRY(rh, struct ib_hash_entry, node);
+}
+
+struct ib_hash_entry* ib_map_find(struct ib_hash_map *hm, const void *key)
+{
+	return ib_map_find_hashed(hm, hm->ht.hash(key), key);
+}
+
+
+void* ib_map_lookup(struct ib_hash_map *hm, const void *key, void *defval)
+{
+	struct ib_hash_entry *entry = ib_map_find(hm, key);
+	if (entry == NULL) return defval;
+	return ib_hash_value(entry);
+}
+
+/* inline key area right behind the entry */
+#define IB_HASH_ENTRY_AREA(entry) ((void*)((entry) + 1))
+
+int ib_map_inline_keys(struct ib_hash_map *hm, int mode)
+{
+	size_t area = 0;
+	if (hm->ht.count > 0) {
+		return -1;
+	}
+	if (mode == IB_MAP_INLINE_CSTR) area = IB_MAP_INLINE;
+	else if (mode == IB_MAP_INLINE_STR) area = sizeof(struct ib_string);
+	else mode = IB_MAP_INLINE_NONE;
+	hm->inline_keys = mode;
+	ib_fastbin_destroy(&hm->fb);
+	ib_fastbin_init(&hm->fb, sizeof(struct ib_hash_entry) + area);
+	return 0;
+}
+
+/* copy a short key into the entry, returns 0 if it doesn't fit */
+static inline int 
+ib_hash_entry_embed(struct ib_hash_map *hm, struct ib_hash_entry *entry,
+		const void *key)
+{
+	if (hm->inline_keys == IB_MAP_INLINE_CSTR) {
+		char *text = (char*)IB_HASH_ENTRY_AREA(entry);
+		size_t size = strlen((const char*)key);
+		if (size >= IB_MAP_INLINE) return 0;
+		memcpy(text, key, size + 1);
+		entry->node.key = text;
+	}
+	else {
+		const struct ib_string *src = (const struct ib_string*)key;
+		struct ib_string *str = (struct ib_string*)IB_HASH_ENTRY_AREA(entry);
+		if (src->size > IB_STRING_SSO) return 0;
+		str->ptr = str->sso;
+		str->size = src->size;
+		str->capacity = IB_STRING_SSO;
+		if (src->size > 0) {
+			memcpy(str->sso, src->ptr, src->size);
+		}
+		str->sso[src->size] = 0;
+		entry->node.key = str;
+	}
+	return 1;
+}
+
+/* value is stored as is if copy is zero */
+static inline struct ib_hash_entry* 
+ib_hash_entry_allocate(struct ib_hash_map *hm, void *key, void *value,
+		int copy)
+{
+	struct ib_hash_entry *entry;
+	entry = (struct ib_hash_entry*)ib_fastbin_new(&hm->fb);
+	ASSERTION(entry);
+	if (hm->inline_keys && ib_hash_entry_embed(hm, entry, key)) {
+		/* stored inline, key_copy is not required */
+	}
+	else if (hm->key_copy) entry->node.key = hm->key_copy(key);
+	else entry->node.key = key;
+	if (hm->value_copy && copy) entry->value = hm->value_copy(value);
+	else entry->value = value;
+	return entry;
+}
+
+static inline struct ib_hash_entry*
+ib_hash_update(struct ib_hash_map *hm, size_t hash, void *key, void *value, 
+		int update, int copy)
+{
+	struct ib_hash_index *index = ib_hash_locate(&hm->ht, hash);
+	struct ib_node **link = &index->avlroot.node;
+	struct ib_node *parent = NULL;
+	struct ib_hash_entry *entry;
+	int (*compare)(const void *key1, const void *key2) = hm->ht.compare;
+	if (index->avlroot.node == NULL) {
+		entry = ib_hash_entry_allocate(hm, key, value, copy);
+		ASSERTION(entry);
+		entry->node.avlnode.height = 1;
+		entry->node.avlnode.left = NULL;
+		entry->node.avlnode.right = NULL;
+		entry->node.avlnode.parent = NULL;
+		entry->node.hash = hash;
+		index->avlroot.node = &(entry->node.avlnode);
+		ilist_add_tail(&index->node, &(hm->ht.head));
+		hm->ht.count++;
+		hm->insert = 1;
+		return entry;
+	}
+	while (link[0]) {
+		struct ib_hash_node *snode;
+		size_t shash;
+		parent = link[0];
+		snode = IB_ENTRY(parent, struct ib_hash_node, avlnode);
+		shash = snode->hash;
+		if (hash != shash) {
+			link = (hash < shash)? (&parent->left) : (&parent->right);
+		}	else {
+			int hc = compare(key, snode->key);
+			if (hc == 0) {
+				entry = IB_ENTRY(snode, struct ib_hash_entry, node);
+				if (update) {
+					if (hm->value_destroy) {
+						hm->value_destroy(entry->value);
+					}
+					if (hm->value_copy == NULL) entry->value = value;
+					else entry->value = hm->value_copy(value);
+				}
+				hm->insert = 0;
+				return entry;
+			}	else {
+				link = (hc < 0)? (&parent->left) : (&parent->right);
+			}
+		}
+	}
+	entry = ib_hash_entry_allocate(hm, key, value, copy);
+	ASSERTION(entry);
+	entry->node.hash = hash;
+	ib_node_link(&(entry->node.avlnode), parent, link);
+	ib_node_post_insert(&(entry->node.avlnode), &index->avlroot);
+	hm->ht.count++;
+	hm->insert = 1;
+	return entry;
+}
+
+/* move n buckets of a running migration and free the old index */
+static inline void ib_map_migrate(struct ib_hash_map *hm, size_t n)
+{
+	if (ib_hash_migrating(&hm->ht)) {
+		void *ptr = ib_hash_migrate(&hm->ht, n);
+		if (ptr) {
+			ikmem_free(ptr);
+		}
+	}
+}
+
+/* smallest index size which satisfies the grow limit */
+static inline size_t ib_map_fit(struct ib_hash_map *hm, size_t capacity)
+{
+	size_t limit = capacity * hm->grow / 100;
+	size_t need = IB_HASH_INIT_SIZE;
+	while (need < limit) need <<= 1;
+	return need;
+}
+
+static void ib_map_resize(struct ib_hash_map *hm, size_t need)
+{
+	size_t size = need * sizeof(struct ib_hash_index);
+	void *ptr = NULL;
+	if (need > IB_HASH_INIT_SIZE) {
+		ptr = ikmem_malloc(size);
+		ASSERTION(ptr);
+	}
+	/* resizing again before the last migration ends */
+	ib_map_migrate(hm, ~((size_t)0));
+	if (hm->incremental) {
+		ib_hash_rehash(&hm->ht, ptr, size);
+		return;
+	}
+	ptr = ib_hash_swap(&hm->ht, ptr, size);
+	if (ptr) {
+		ikmem_free(ptr);
+	}
+}
+
+static inline void ib_map_rehash(struct ib_hash_map *hm, size_t capacity)
+{
+	size_t isize = hm->ht.index_size;
+	size_t limit = capacity * hm->grow / 100;
+	if (hm->incremental) {
+		ib_map_migrate(hm, hm->incremental);
+	}
+	if (isize < limit && hm->fixed == 0) {
+		size_t need = isize;
+		while (need < limit) need <<= 1;
+		ib_map_resize(hm, need);
+	}
+}
+
+static inline void ib_map_shrink(struct ib_hash_map *hm)
+{
+	size_t isize = hm->ht.index_size;
+	if (hm->incremental) {
+		ib_map_migrate(hm, hm->incremental);
+	}
+	if (hm->fixed || hm->shrink == 0 || isize <= IB_HASH_INIT_SIZE) {
+		return;
+	}
+	if (isize > hm->ht.count * hm->shrink / 100) {
+		size_t need = ib_map_fit(hm, hm->ht.count);
+		if (need < isize) {
+			ib_map_resize(hm, need);
+		}
+	}
+}
+
+void ib_map_reserve(struct ib_hash_map *hm, size_t capacity)
+{
+	ib_map_rehash(hm, capacity);
+}
+
+void ib_map_shrink_to_fit(struct ib_hash_map *hm)
+{
+	size_t need = ib_map_fit(hm, hm->ht.count);
+	if (hm->fixed == 0 && need != hm->ht.index_size) {
+		ib_map_resize(hm, need);
+	}
+	ib_map_migrate(hm, ~((size_t)0));
+}
+
+struct ib_hash_entry* 
+ib_map_add(struct ib_hash_map *hm, void *key, void *value, int *success)
+{
+	size_t hash = hm->ht.hash(key);
+	struct ib_hash_entry *entry = ib_hash_update(hm, hash, key, value, 0, 1);
+	if (success) success[0] = hm->insert;
+	ib_map_rehash(hm, hm->ht.count);
+	return entry;
+}
+
+struct ib_hash_entry*
+ib_map_set(struct ib_hash_map *hm, void *key, void *value)
+{
+	size_t hash = hm->ht.hash(key);
+	struct ib_hash_entry *entry = ib_hash_update(hm, hash, key, value, 0, 1);
+	ib_map_rehash(hm, hm->ht.count);
+	return entry;
+}
+
+void *ib_map_get(struct ib_hash_map *hm, const void *key)
+{
+	return ib_map_lookup(hm, key, NULL);
+}
+
+size_t ib_map_find_batch(struct ib_hash_map *hm, void **keys, size_t n,
+		struct ib_hash_entry **out)
+{
+	size_t (*hash)(const void *key) = hm->ht.hash;
+	int (*compare)(const void *key1, const void *key2) = hm->ht.compare;
+	size_t count = 0, i;
+	ib_map_search_batch(hm, keys, n, hash, compare, out);
+	for (i = 0; i < n; i++) {
+		if (out[i]) count++;
+	}
+	return count;
+}
+
+void ib_map_erase(struct ib_hash_map *hm, struct ib_hash_entry *entry)
+{
+	ASSERTION(entry);
+	ASSERTION(!ib_node_empty(&(entry->node.avlnode)));
+	ib_hash_erase(&hm->ht, &entry->node);
+	ib_node_init(&(entry->node.avlnode));
+	if (hm->key_destroy) {
+		if (hm->inline_keys == 0 || 
+			entry->node.key != IB_HASH_ENTRY_AREA(entry)) {
+			hm->key_destroy(entry->node.key);
+		}
+	}
+	if (hm->value_destroy) hm->value_destroy(entry->value);
+	entry->node.key = NULL;
+	entry->value = NULL;
+	ib_fastbin_del(&hm->fb, entry);
+}
+
+int ib_map_remove(struct ib_hash_map *hm, const void *key)
+{
+	struct ib_hash_entry *entry;
+	entry = ib_map_find(hm, key);
+	if (entry == NULL) {
+		return -1;
+	}
+	ib_map_erase(hm, entry);
+	ib_map_shrink(hm);
+	return 0;
+}
+
+void ib_map_clear(struct ib_hash_map *hm)
+{
+	while (1) {
+		struct ib_hash_entry *entry = ib_map_first(hm);
+		if (entry == NULL) break;
+		ib_map_erase(hm, entry);
+	}
+	ASSERTION(hm->count == 0);
+	if (hm->shrink != 0) {
+		ib_map_shrink_to_fit(hm);
+	}
+}
+
+
+/*--------------------------------------------------------------------*/
+/* common type hash and equal functions                               */
+/*--------------------------------------------------------------------*/
+size_t ib_hash_seed = 0x11223344;
+
+size_t ib_hash_func_uint(const void *key)
+{
+#if 0
+	size_t x = (size_t)key;
+	return (x * 2654435761u) ^ ib_hash_seed;
+#else
+	return (size_t)key;
+#endif
+}
+
+size_t ib_hash_func_int(const void *key)
+{
+#if 0
+	size_t x = (size_t)key;
+	return (x * 2654435761u) ^ ib_hash_seed;
+#else
+	return (size_t)key;
+#endif
+}
+
+size_t ib_hash_bytes_stl(const void *ptr, size_t size, size_t seed)
+{
+	const unsigned char *buf = (const unsigned char*)ptr;
+	const size_t m = 0x5bd1e995;
+	size_t hash = size ^ seed;
+	for (; size >= 4; buf += 4, size -= 4) {
+		size_t k = *((IUINT32*)buf);
+		k *= m;
+		k = (k >> 24) * m;
+		hash = (hash * m) ^ k;
+	}
+	switch (size) {
+	case 3: hash ^= ((IUINT32)buf[2]) << 16;
+	case 2: hash ^= ((IUINT32)buf[1]) << 8;
+	case 1: hash ^= ((IUINT32)buf[0]); hash = hash * m; break;
+	}
+	hash = (hash ^ (hash >> 13)) * m;
+	return hash ^ (hash >> 15);
+}
+
+size_t ib_hash_bytes_lua(const void *ptr, size_t size, size_t seed)
+{
+	const unsigned char *name = (const unsigned char*)ptr;
+	size_t step = (size >> 5) + 1;
+	size_t h = size ^ seed, i;
+    for(i = size; i >= step; i -= step)
+        h = h ^ ((h << 5) + (h >> 2) + (size_t)name[i - 1]);
+    return h;
+}
+
+size_t ib_hash_func_str(const void *key)
+{
+	ib_string *str = (ib_string*)key;
+#ifndef IB_HASH_BYTES_STL
+	return ib_hash_bytes_lua(str->ptr, str->size, ib_hash_seed);
+#else
+	return ib_hash_bytes_stl(str->ptr, str->size, ib_hash_seed);
+#endif
+}
+
+size_t ib_hash_func_cstr(const void *key)
+{
+	const char *str = (const char*)key;
+	size_t size = strlen(str);
+#ifndef IB_HASH_BYTES_STL
+	return ib_hash_bytes_lua(str, size, ib_hash_seed);
+#else
+	return ib_hash_bytes_stl(str, size, ib_hash_seed);
+#endif
+}
+
+int ib_hash_compare_uint(const void *key1, const void *key2)
+{
+	size_t x = (size_t)key1;
+	size_t y = (size_t)key2;
+	if (x == y) return 0;
+	return (x < y)? -1 : 1;
+}
+
+int ib_hash_compare_int(const void *key1, const void *key2)
+{
+	ilong x = (ilong)key1;
+	ilong y = (ilong)key2;
+	if (x == y) return 0;
+	return (x < y)? -1 : 1;
+}
+
+int ib_hash_compare_str(const void *key1, const void *key2)
+{
+	return ib_string_compare((const ib_string*)key1, (const ib_string*)key2);
+}
+
+int ib_compare_bytes(const void *p1, size_t s1, const void *p2, size_t s2)
+{
+	int minsize = (s1 < s2)? s1 : s2;
+	int hr = memcmp(p1, p2, minsize);
+	if (hr == 0) {
+		if (s1 == s2) return 0;
+		return (s1 < s2)? -1 : 1;
+	}
+	else {
+		return (hr < 0)? -1 : 1;
+	}
+}
+
+int ib_hash_compare_cstr(const void *key1, const void *key2)
+{
+	const char *x = (const char*)key1;
+	const char *y = (const char*)key2;
+	return ib_compare_bytes(x, strlen(x), y, strlen(y));
+}
+
+
+
+struct ib_hash_entry *ib_map_find_uint(struct ib_hash_map *hm, iulong key)
+{
+	struct ib_hash_entry *hr;
+	void *kk = (void*)key;
+	ib_map_search(hm, kk, ib_hash_func_uint, ib_hash_compare_uint, hr);
+	return hr;
+}
+
+struct ib_hash_entry *ib_map_find_int(struct ib_hash_map *hm, ilong key)
+{
+	struct ib_hash_entry *hr;
+	void *kk = (void*)key;
+	ib_map_search(hm, kk, ib_hash_func_int, ib_hash_compare_int, hr);
+	return hr;
+}
+
+struct ib_hash_entry *ib_map_find_str(struct ib_hash_map *hm, const ib_string *key)
+{
+	struct ib_hash_entry *hr;
+	void *kk = (void*)key;
+	ib_map_search(hm, kk, ib_hash_func_str, ib_hash_compare_str, hr);
+	return hr;
+}
+
+struct ib_hash_entry *ib_map_find_cstr(struct ib_hash_map *hm, const char *key)
+{
+	struct ib_hash_entry *hr;
+	void *kk = (void*)key;
+	ib_map_search(hm, kk, ib_hash_func_cstr, ib_hash_compare_cstr, hr);
+	return hr;
+}
+
+
+
+
+/*--------------------------------------------------------------------*/
+/* flat map - open addressing with control byte groups                */
+/*--------------------------------------------------------------------*/
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
+	(defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define IB_FLAT_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define IB_FLAT_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define IB_FLAT_EMPTY     0x80
+#define IB_FLAT_DELETED   0xfe
+
+/* bit i of the result is set if ctrl[i] == h2 */
+static inline unsigned int _ib_flat_match(const IUINT8 *ctrl, int h2)
+{
+#if defined(IB_FLAT_SSE2)
+	__m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+	__m128i cmp = _mm_cmpeq_epi8(group, _mm_set1_epi8((char)h2));
+	return (unsigned int)_mm_movemask_epi8(cmp);
+#elif defined(IB_FLAT_NEON)
+	static const IUINT8 bits[16] = { 
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t cmp = vceqq_u8(vld1q_u8(ctrl), vdupq_n_u8((IUINT8)h2));
+	cmp = vandq_u8(cmp, vld1q_u8(bits));
+	return (unsigned int)vaddv_u8(vget_low_u8(cmp)) | 
+		((unsigned int)vaddv_u8(vget_high_u8(cmp)) << 8);
+#else
+	unsigned int mask = 0;
+	int i;
+	for (i = 0; i < IB_FLAT_GROUP; i++) {
+		if (ctrl[i] == (IUINT8)h2) mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+/* bit i of the result is set if ctrl[i] is empty or deleted */
+static inline unsigned int _ib_flat_match_free(const IUINT8 *ctrl)
+{
+#if defined(IB_FLAT_SSE2)
+	__m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+	return (unsigned int)_mm_movemask_epi8(group);
+#elif defined(IB_FLAT_NEON)
+	static const IUINT8 bits[16] = { 
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t cmp = vcltzq_s8(vreinterpretq_s8_u8(vld1q_u8(ctrl)));
+	cmp = vandq_u8(cmp, vld1q_u8(bits));
+	return (unsigned int)vaddv_u8(vget_low_u8(cmp)) | 
+		((unsigned int)vaddv_u8(vget_high_u8(cmp)) << 8);
+#else
+	unsigned int mask = 0;
+	int i;
+	for (i = 0; i < IB_FLAT_GROUP; i++) {
+		if (ctrl[i] & 0x80) mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+static inline int _ib_flat_ctz(unsigned int mask)
+{
+#if defined(__GNUC__)
+	return __builtin_ctz(mask);
+#elif defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	int n = 0;
+	while ((mask & 1) == 0) mask >>= 1, n++;
+	return n;
+#endif
+}
+
+/* user hash functions can be identity (eg. ib_hash_func_uint), mix the
+ * bits so that both the low 7 bits and the group index look random */
+static inline size_t _ib_flat_mix(size_t hash)
+{
+	if (sizeof(size_t) > 4) {
+		size_t k = (((size_t)0x9e3779b9) << 16 << 16) | 0x7f4a7c15;
+		hash *= k;
+		hash ^= hash >> 16 >> 16;
+	}	else {
+		hash *= (size_t)0x9e3779b9;
+		hash ^= hash >> 16;
+	}
+	return hash;
+}
+
+void ib_flat_init(struct ib_flat_map *fm, size_t (*hash)(const void*),
+		int (*compare)(const void *, const void *))
+{
+	fm->count = 0;
+	fm->capacity = 0;
+	fm->deleted = 0;
+	fm->growth = 0;
+	fm->insert = 0;
+	fm->ctrl = NULL;
+	fm->slots = NULL;
+	fm->hash = hash;
+	fm->compare = compare;
+	fm->key_copy = NULL;
+	fm->key_destroy = NULL;
+	fm->value_copy = NULL;
+	fm->value_destroy = NULL;
+}
+
+void ib_flat_destroy(struct ib_flat_map *fm)
+{
+	ib_flat_clear(fm);
+	if (fm->slots) {
+		ikmem_free(fm->slots);
+	}
+	fm->slots = NULL;
+	fm->ctrl = NULL;
+	fm->capacity = 0;
+	fm->growth = 0;
+}
+
+/* at most 7/8 of the slots can be used */
+#define IB_FLAT_LIMIT(capacity) ((capacity) - ((capacity) >> 3))
+
+/* returns the index of the first free slot on the probe sequence */
+static inline size_t _ib_flat_probe_free(const struct ib_flat_map *fm,
+		size_t hash)
+{
+	size_t gmask = (fm->capacity / IB_FLAT_GROUP) - 1;
+	size_t group = (hash >> 7) & gmask;
+	size_t step = 0;
+	while (1) {
+		const IUINT8 *ctrl = fm->ctrl + group * IB_FLAT_GROUP;
+		unsigned int mask = _ib_flat_match_free(ctrl);
+		if (mask) {
+			return group * IB_FLAT_GROUP + _ib_flat_ctz(mask);
+		}
+		step++;
+		group = (group + step) & gmask;
+	}
+}
+
+static void _ib_flat_rehash(struct ib_flat_map *fm, size_t capacity)
+{
+	struct ib_flat_entry *slots = fm->slots;
+	IUINT8 *ctrl = fm->ctrl;
+	size_t size = fm->capacity;
+	size_t i;
+	char *ptr;
+	ASSERTION(IB_FLAT_LIMIT(capacity) >= fm->count);
+	ptr = (char*)ikmem_malloc(capacity * 
+			(sizeof(struct ib_flat_entry) + 1));
+	ASSERTION(ptr);
+	fm->slots = (struct ib_flat_entry*)ptr;
+	fm->ctrl = (IUINT8*)(ptr + capacity * sizeof(struct ib_flat_entry));
+	fm->capacity = capacity;
+	memset(fm->ctrl, IB_FLAT_EMPTY, capacity);
+	for (i = 0; i < size; i++) {
+		if ((ctrl[i] & 0x80) == 0) {
+			size_t hash = _ib_flat_mix(fm->hash(slots[i].key));
+			size_t pos = _ib_flat_probe_free(fm, hash);
+			fm->ctrl[pos] = (IUINT8)(hash & 0x7f);
+			fm->slots[pos] = slots[i];
+		}
+	}
+	fm->deleted = 0;
+	fm->growth = IB_FLAT_LIMIT(capacity) - fm->count;
+	if (slots) {
+		ikmem_free(slots);
+	}
+}
+
+static inline size_t _ib_flat_capacity(size_t count)
+{
+	size_t capacity = IB_FLAT_GROUP;
+	while (IB_FLAT_LIMIT(capacity) < count) capacity <<= 1;
+	return capacity;
+}
+
+void ib_flat_reserve(struct ib_flat_map *fm, size_t capacity)
+{
+	if (capacity < fm->count) capacity = fm->count;
+	if (IB_FLAT_LIMIT(fm->capacity) - fm->deleted < capacity) {
+		_ib_flat_rehash(fm, _ib_flat_capacity(capacity));
+	}
+}
+
+struct ib_flat_entry* ib_flat_find(struct ib_flat_map *fm, const void *key)
+{
+	int (*compare)(const void *key1, const void *key2) = fm->compare;
+	size_t hash, gmask, group, step = 0;
+	if (fm->count == 0) return NULL;
+	hash = _ib_flat_mix(fm->hash(key));
+	gmask = (fm->capacity / IB_FLAT_GROUP) - 1;
+	group = (hash >> 7) & gmask;
+	while (1) {
+		const IUINT8 *ctrl = fm->ctrl + group * IB_FLAT_GROUP;
+		unsigned int mask = _ib_flat_match(ctrl, (int)(hash & 0x7f));
+		while (mask) {
+			size_t pos = group * IB_FLAT_GROUP + _ib_flat_ctz(mask);
+			if (compare(key, fm->slots[pos].key) == 0) {
+				return &fm->slots[pos];
+			}
+			mask &= mask - 1;
+		}
+		/* a group with an empty slot ends every probe sequence */
+		if (_ib_flat_match(ctrl, IB_FLAT_EMPTY)) {
+			return NULL;
+		}
+		step++;
+		if (step > gmask) return NULL;
+		group = (group + step) & gmask;
 	}
-	ht->count++;
-	return NULL;
 }
 
+void* ib_flat_lookup(struct ib_flat_map *fm, const void *key, void *defval)
+{
+	struct ib_flat_entry *entry = ib_flat_find(fm, key);
+	if (entry == NULL) return defval;
+	return entry->value;
+}
 
-void ib_hash_replace(struct ib_hash_table *ht, 
-		struct ib_hash_node *victim, struct ib_hash_node *newnode)
+void* ib_flat_get(struct ib_flat_map *fm, const void *key)
 {
-	struct ib_hash_index *index = &ht->index[victim->hash & ht->index_mask];
-	ib_node_replace(&victim->avlnode, &newnode->avlnode, &index->avlroot);
+	return ib_flat_lookup(fm, key, NULL);
 }
 
-void ib_hash_clear(struct ib_hash_table *ht,
-		void (*destroy)(struct ib_hash_node *node))
+static struct ib_flat_entry*
+_ib_flat_update(struct ib_flat_map *fm, void *key, void *value, int update)
 {
-	while (!ilist_is_empty(&ht->head)) {
-		struct ib_hash_index *index = ilist_entry(ht->head.next, 
-				struct ib_hash_index, node);
-		struct ib_node *next = NULL;
-		while (index->avlroot.node != NULL) {
-			struct ib_node *avlnode = ib_node_tear(&index->avlroot, &next);
-			ASSERTION(avlnode);
-			if (destroy) {
-				struct ib_hash_node *node = 
-					IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
-				destroy(node);
+	struct ib_flat_entry *entry = ib_flat_find(fm, key);
+	size_t hash, pos;
+	if (entry) {
+		if (update) {
+			if (fm->value_destroy) {
+				fm->value_destroy(entry->value);
 			}
+			if (fm->value_copy == NULL) entry->value = value;
+			else entry->value = fm->value_copy(value);
 		}
-		ilist_del_init(&index->node);
+		fm->insert = 0;
+		return entry;
 	}
-	ht->count = 0;
+	if (fm->growth == 0) {
+		/* rebuild at the same size to drop tombstones only if that frees
+		 * at least half of the limit, otherwise double the capacity, so 
+		 * set/remove churn can not trigger a rehash every few inserts */
+		if (fm->capacity > 0 && 
+			fm->count + 1 <= (IB_FLAT_LIMIT(fm->capacity) >> 1)) {
+			_ib_flat_rehash(fm, fm->capacity);
+		}	else if (fm->capacity > 0) {
+			_ib_flat_rehash(fm, fm->capacity * 2);
+		}	else {
+			_ib_flat_rehash(fm, _ib_flat_capacity(fm->count + 1));
+		}
+	}
+	hash = _ib_flat_mix(fm->hash(key));
+	pos = _ib_flat_probe_free(fm, hash);
+	if (fm->ctrl[pos] == IB_FLAT_DELETED) {
+		fm->deleted--;
+	}	else {
+		fm->growth--;
+	}
+	fm->ctrl[pos] = (IUINT8)(hash & 0x7f);
+	entry = &fm->slots[pos];
+	if (fm->key_copy) entry->key = fm->key_copy(key);
+	else entry->key = key;
+	if (fm->value_copy) entry->value = fm->value_copy(value);
+	else entry->value = value;
+	fm->count++;
+	fm->insert = 1;
+	return entry;
+}
+
+struct ib_flat_entry* ib_flat_add(struct ib_flat_map *fm,
+		void *key, void *value, int *success)
+{
+	struct ib_flat_entry *entry = _ib_flat_update(fm, key, value, 0);
+	if (success) success[0] = fm->insert;
+	return entry;
 }
 
+struct ib_flat_entry* ib_flat_set(struct ib_flat_map *fm,
+		void *key, void *value)
+{
+	return _ib_flat_update(fm, key, value, 1);
+}
 
-void* ib_hash_swap(struct ib_hash_table *ht, void *ptr, size_t nbytes)
+void ib_flat_erase(struct ib_flat_map *fm, struct ib_flat_entry *entry)
 {
-	struct ib_hash_index *old_index = ht->index;
-	struct ib_hash_index *new_index = (struct ib_hash_index*)ptr;
-	size_t index_size = 1;
-	struct ILISTHEAD head;
-	size_t i;
-	ASSERTION(nbytes >= sizeof(struct ib_hash_index));
-	if (new_index == NULL) {
-		if (ht->index == ht->init) {
-			return NULL;
-		}
-		new_index = ht->init;
-		index_size = IB_HASH_INIT_SIZE;
+	size_t pos = (size_t)(entry - fm->slots);
+	const IUINT8 *group;
+	ASSERTION(pos < fm->capacity);
+	ASSERTION((fm->ctrl[pos] & 0x80) == 0);
+	if (fm->key_destroy) fm->key_destroy(entry->key);
+	if (fm->value_destroy) fm->value_destroy(entry->value);
+	entry->key = NULL;
+	entry->value = NULL;
+	/* no probe sequence has ever passed a group which still has an 
+	 * empty slot, so the slot can go back to empty directly */
+	group = fm->ctrl + (pos & ~((size_t)IB_FLAT_GROUP - 1));
+	if (_ib_flat_match(group, IB_FLAT_EMPTY)) {
+		fm->ctrl[pos] = IB_FLAT_EMPTY;
+		fm->growth++;
+	}	else {
+		fm->ctrl[pos] = IB_FLAT_DELETED;
+		fm->deleted++;
 	}
-	else if (new_index == old_index) {
-		return old_index;
+	fm->count--;
+}
+
+int ib_flat_remove(struct ib_flat_map *fm, const void *key)
+{
+	struct ib_flat_entry *entry = ib_flat_find(fm, key);
+	if (entry == NULL) {
+		return -1;
 	}
-	if (new_index != ht->init) {
-		size_t test_size = sizeof(struct ib_hash_index);
-		while (test_size < nbytes) {
-			size_t next_size = test_size * 2;
-			if (next_size > nbytes) break;
-			test_size = next_size;
-			index_size = index_size * 2;
+	ib_flat_erase(fm, entry);
+	return 0;
+}
+
+void ib_flat_clear(struct ib_flat_map *fm)
+{
+	size_t i;
+	if (fm->key_destroy || fm->value_destroy) {
+		for (i = 0; i < fm->capacity; i++) {
+			if ((fm->ctrl[i] & 0x80) == 0) {
+				struct ib_flat_entry *entry = &fm->slots[i];
+				if (fm->key_destroy) fm->key_destroy(entry->key);
+				if (fm->value_destroy) fm->value_destroy(entry->value);
+			}
 		}
 	}
-	ht->index = new_index;
-	ht->index_size = index_size;
-	ht->index_mask = index_size - 1;
-	ht->count = 0;
-	for (i = 0; i < index_size; i++) {
-		ht->index[i].avlroot.node = NULL;
-		ilist_init(&ht->index[i].node);
+	if (fm->capacity > 0) {
+		memset(fm->ctrl, IB_FLAT_EMPTY, fm->capacity);
 	}
-	ilist_replace(&ht->head, &head);
-	ilist_init(&ht->head);
-	while (!ilist_is_empty(&head)) {
-		struct ib_hash_index *index = ilist_entry(head.next, 
-				struct ib_hash_index, node);
-	#if 1
-		struct ib_node *next = NULL;
-		while (index->avlroot.node) {
-			struct ib_node *avlnode = ib_node_tear(&index->avlroot, &next);
-			struct ib_hash_node *snode, *hr;
-			ASSERTION(avlnode);
-			snode = IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
-			hr = ib_hash_add(ht, snode);
-			if (hr != NULL) {
-				ASSERTION(hr == NULL);
-				return NULL;
-			}
-		}
-	#else
-		while (index->avlroot.node) {
-			struct ib_node *avlnode = index->avlroot.node;
-			struct ib_hash_node *snode, *hr;
-			ib_node_erase(avlnode, &index->avlroot);
-			snode = IB_ENTRY(avlnode, struct ib_hash_node, avlnode);
-			hr = ib_hash_add(ht, snode);
-			ASSERTION(hr == NULL);
-			hr = hr;
+	fm->count = 0;
+	fm->deleted = 0;
+	fm->growth = IB_FLAT_LIMIT(fm->capacity);
+}
+
+static inline struct ib_flat_entry* 
+_ib_flat_scan(struct ib_flat_map *fm, size_t pos, int dir)
+{
+	while (pos < fm->capacity) {
+		if ((fm->ctrl[pos] & 0x80) == 0) {
+			return &fm->slots[pos];
 		}
-	#endif
-		ilist_del_init(&index->node);
+		pos = (dir)? pos + 1 : pos - 1;     /* wraps to the end */
 	}
-	return (old_index == ht->init)? NULL : old_index;
+	return NULL;
+}
+
+struct ib_flat_entry* ib_flat_first(struct ib_flat_map *fm)
+{
+	if (fm->count == 0) return NULL;
+	return _ib_flat_scan(fm, 0, 1);
+}
+
+struct ib_flat_entry* ib_flat_last(struct ib_flat_map *fm)
+{
+	if (fm->count == 0) return NULL;
+	return _ib_flat_scan(fm, fm->capacity - 1, 0);
+}
+
+struct ib_flat_entry* ib_flat_next(struct ib_flat_map *fm,
+		struct ib_flat_entry *n)
+{
+	return _ib_flat_scan(fm, (size_t)(n - fm->slots) + 1, 1);
+}
+
+struct ib_flat_entry* ib_flat_prev(struct ib_flat_map *fm,
+		struct ib_flat_entry *n)
+{
+	return _ib_flat_scan(fm, (size_t)(n - fm->slots) - 1, 0);
 }
 
 
+
 /*--------------------------------------------------------------------*/
-/* hash map, wrapper of ib_hash_table to support direct key/value     */
+/* shard map - concurrent hash map with a rwlock per ib_hash_map      */
 /*--------------------------------------------------------------------*/
 
-struct ib_hash_entry* ib_map_first(struct ib_hash_map *hm)
+/* ib_hash_map indexes with the low bits, pick shards with the high
+ * bits of the mixed hash, hash is the value of sm->hash(key) */
+static inline struct ib_shard* 
+_ib_shard_locate(struct ib_shard_map *sm, size_t hash)
 {
-	struct ib_hash_node *node = ib_hash_node_first(&hm->ht);
-	if (node == NULL) return NULL;
-	return IB_ENTRY(node, struct ib_hash_entry, node);
+	size_t mixed = _ib_flat_mix(hash);
+	size_t pos = (mixed >> (sizeof(size_t) * 8 - 16)) & (sm->nshards - 1);
+	return &sm->shards[pos];
 }
 
+int ib_shard_init(struct ib_shard_map *sm, size_t nshards,
+		size_t (*hash)(const void*), 
+		int (*compare)(const void *, const void *))
+{
+	size_t n = 1, i;
+	if (nshards == 0) nshards = IB_SHARD_DEFAULT;
+	if (nshards > IB_SHARD_MAX) nshards = IB_SHARD_MAX;
+	while (n < nshards) n <<= 1;
+	sm->shards = (struct ib_shard*)ikmem_malloc(sizeof(struct ib_shard) * n);
+	if (sm->shards == NULL) {
+		sm->nshards = 0;
+		return -1;
+	}
+	sm->nshards = n;
+	sm->hash = hash;
+	sm->value_copy = NULL;
+	for (i = 0; i < n; i++) {
+		IRWLOCK_INIT(&sm->shards[i].lock);
+		ib_map_init(&sm->shards[i].map, hash, compare);
+	}
+	return 0;
+}
 
-struct ib_hash_entry* ib_map_last(struct ib_hash_map *hm)
+void ib_shard_destroy(struct ib_shard_map *sm)
 {
-	struct ib_hash_node *node = ib_hash_node_last(&hm->ht);
-	if (node == NULL) return NULL;
-	return IB_ENTRY(node, struct ib_hash_entry, node);
+	size_t i;
+	for (i = 0; i < sm->nshards; i++) {
+		ib_map_destroy(&sm->shards[i].map);
+		IRWLOCK_DESTROY(&sm->shards[i].lock);
+	}
+	if (sm->shards) {
+		ikmem_free(sm->shards);
+	}
+	sm->shards = NULL;
+	sm->nshards = 0;
 }
 
+void ib_shard_config(struct ib_shard_map *sm, 
+		void* (*key_copy)(void *key), void (*key_destroy)(void *key),
+		void* (*value_copy)(void *value), void (*value_destroy)(void *value))
+{
+	size_t i;
+	for (i = 0; i < sm->nshards; i++) {
+		struct ib_hash_map *hm = &sm->shards[i].map;
+		hm->key_copy = key_copy;
+		hm->key_destroy = key_destroy;
+		hm->value_copy = value_copy;
+		hm->value_destroy = value_destroy;
+	}
+	sm->value_copy = value_copy;
+}
 
-struct ib_hash_entry* ib_map_next(struct ib_hash_map *hm, 
-		struct ib_hash_entry *n)
+/* copy the value of entry out, the shard lock is held by the caller,
+ * returns -1 if entry is NULL */
+static inline int _ib_shard_copy_out(struct ib_shard_map *sm,
+		struct ib_hash_entry *entry, void **value)
 {
-	struct ib_hash_node *node = ib_hash_node_next(&hm->ht, &n->node);
-	if (node == NULL) return NULL;
-	return IB_ENTRY(node, struct ib_hash_entry, node);
+	if (entry == NULL) {
+		return -1;
+	}
+	if (value) {
+		void *v = ib_hash_value(entry);
+		value[0] = (sm->value_copy)? sm->value_copy(v) : v;
+	}
+	return 0;
 }
 
+int ib_shard_get(struct ib_shard_map *sm, const void *key, void **value)
+{
+	size_t hash = sm->hash(key);
+	struct ib_shard *shard = _ib_shard_locate(sm, hash);
+	struct ib_hash_entry *entry;
+	int hr;
+	IRWLOCK_RDLOCK(&shard->lock);
+	entry = ib_map_find_hashed(&shard->map, hash, key);
+	hr = _ib_shard_copy_out(sm, entry, value);
+	IRWLOCK_RDUNLOCK(&shard->lock);
+	return hr;
+}
 
-struct ib_hash_entry* ib_map_prev(struct ib_hash_map *hm, 
-		struct ib_hash_entry *n)
+int ib_shard_set(struct ib_shard_map *sm, void *key, void *value)
 {
-	struct ib_hash_node *node = ib_hash_node_prev(&hm->ht, &n->node);
-	if (node == NULL) return NULL;
-	return IB_ENTRY(node, struct ib_hash_entry, node);
+	struct ib_shard *shard = _ib_shard_locate(sm, sm->hash(key));
+	int hr;
+	IRWLOCK_WRLOCK(&shard->lock);
+	ib_map_set(&shard->map, key, value);
+	hr = shard->map.insert;
+	IRWLOCK_WRUNLOCK(&shard->lock);
+	return hr;
 }
 
+int ib_shard_add(struct ib_shard_map *sm, void *key, void *value)
+{
+	struct ib_shard *shard = _ib_shard_locate(sm, sm->hash(key));
+	int hr;
+	IRWLOCK_WRLOCK(&shard->lock);
+	ib_map_add(&shard->map, key, value, &hr);
+	IRWLOCK_WRUNLOCK(&shard->lock);
+	return hr;
+}
 
-void ib_map_init(struct ib_hash_map *hm, size_t (*hash)(const void*),
-		int (*compare)(const void *, const void *))
+int ib_shard_remove(struct ib_shard_map *sm, const void *key)
 {
-	hm->count = 0;
-	hm->key_copy = NULL;
-	hm->key_destroy = NULL;
-	hm->value_copy = NULL;
-	hm->value_destroy = NULL;
-	hm->insert = 0;
-	hm->fixed = 0;
-	ib_hash_init(&hm->ht, hash, compare);
-	ib_fastbin_init(&hm->fb, sizeof(struct ib_hash_entry));
+	struct ib_shard *shard = _ib_shard_locate(sm, sm->hash(key));
+	int hr;
+	IRWLOCK_WRLOCK(&shard->lock);
+	hr = ib_map_remove(&shard->map, key);
+	IRWLOCK_WRUNLOCK(&shard->lock);
+	return hr;
 }
 
-void ib_map_destroy(struct ib_hash_map *hm)
+int ib_shard_compute(struct ib_shard_map *sm, void *key,
+		void* (*create)(const void *key, void *user), void *user,
+		void **value)
 {
-	void *ptr;
-	ib_map_clear(hm);
-	ptr = ib_hash_swap(&hm->ht, NULL, 0);
-	if (ptr) {
-		ikmem_free(ptr);
+	size_t hash = sm->hash(key);
+	struct ib_shard *shard = _ib_shard_locate(sm, hash);
+	struct ib_hash_map *hm = &shard->map;
+	struct ib_hash_entry *entry;
+	int hr;
+	/* optimistic read first, most calls find an existing entry */
+	IRWLOCK_RDLOCK(&shard->lock);
+	entry = ib_map_find_hashed(hm, hash, key);
+	hr = _ib_shard_copy_out(sm, entry, value);
+	IRWLOCK_RDUNLOCK(&shard->lock);
+	if (hr == 0) {
+		return 0;
 	}
-	ib_fastbin_destroy(&hm->fb);
+	IRWLOCK_WRLOCK(&shard->lock);
+	entry = ib_map_find_hashed(hm, hash, key);
+	hr = 0;
+	if (entry == NULL) {
+		void *created = create(key, user);
+		if (created == NULL) {
+			IRWLOCK_WRUNLOCK(&shard->lock);
+			return -1;
+		}
+		/* the created value is owned by the map, store it as is */
+		entry = ib_hash_update(hm, hash, key, created, 0, 0);
+		ib_map_rehash(hm, hm->ht.count);
+		hr = 1;
+	}
+	_ib_shard_copy_out(sm, entry, value);
+	IRWLOCK_WRUNLOCK(&shard->lock);
+	return hr;
 }
 
-struct ib_hash_entry* ib_map_find(struct ib_hash_map *hm, const void *key)
+size_t ib_shard_count(struct ib_shard_map *sm)
 {
-	struct ib_hash_table *ht = &hm->ht;
-	struct ib_hash_node dummy;
-	struct ib_hash_node *rh;
-	void *ptr = (void*)key;
-	ib_hash_node_key(ht, &dummy, ptr);
-	rh = ib_hash_find(ht, &dummy);
-	return (rh == NULL)? NULL : IB_ENTRY(rh, struct ib_hash_entry, node);
+	size_t count = 0, i;
+	for (i = 0; i < sm->nshards; i++) {
+		struct ib_shard *shard = &sm->shards[i];
+		IRWLOCK_RDLOCK(&shard->lock);
+		count += shard->map.ht.count;
+		IRWLOCK_RDUNLOCK(&shard->lock);
+	}
+	return count;
 }
 
-
-void* ib_map_lookup(struct ib_hash_map *hm, const void *key, void *defval)
+void ib_shard_foreach(struct ib_shard_map *sm, 
+		void (*visit)(void *key, void *value, void *user), void *user)
 {
-	struct ib_hash_entry *entry = ib_map_find(hm, key);
-	if (entry == NULL) return defval;
-	return ib_hash_value(entry);
+	size_t i;
+	for (i = 0; i < sm->nshards; i++) {
+		struct ib_shard *shard = &sm->shards[i];
+		struct ib_hash_entry *entry;
+		IRWLOCK_RDLOCK(&shard->lock);
+		entry = ib_map_first(&shard->map);
+		for (; entry; entry = ib_map_next(&shard->map, entry)) {
+			visit(ib_hash_key(entry), ib_hash_value(entry), user);
+		}
+		IRWLOCK_RDUNLOCK(&shard->lock);
+	}
 }
 
-static inline struct ib_hash_entry* 
-ib_hash_entry_allocate(struct ib_hash_map *hm, void *key, void *value)
+void ib_shard_clear(struct ib_shard_map *sm)
 {
-	struct ib_hash_entry *entry;
-	entry = (struct ib_hash_entry*)ib_fastbin_new(&hm->fb);
-	ASSERTION(entry);
-	if (hm->key_copy) entry->node.key = hm->key_copy(key);
-	else entry->node.key = key;
-	if (hm->value_copy) entry->value = hm->value_copy(value);
-	else entry->value = value;
-	return entry;
+	size_t i;
+	for (i = 0; i < sm->nshards; i++) {
+		struct ib_shard *shard = &sm->shards[i];
+		IRWLOCK_WRLOCK(&shard->lock);
+		ib_map_clear(&shard->map);
+		IRWLOCK_WRUNLOCK(&shard->lock);
+	}
 }
 
-static inline struct ib_hash_entry*
-ib_hash_update(struct ib_hash_map *hm, void *key, void *value, int update)
+
+
+/*--------------------------------------------------------------------*/
+/* dense map - insertion ordered entry array with a compact index     */
+/*--------------------------------------------------------------------*/
+
+/* index slot: 0 for empty, 1 for deleted, otherwise entry position + 2 */
+#define IB_DENSE_EMPTY      0
+#define IB_DENSE_DELETED    1
+#define IB_DENSE_MIN        8
+
+/* keys of erased entries point here */
+static char ib_dense_hole = 0;
+
+#define IB_DENSE_IS_HOLE(e)  ((e)->key == (void*)&ib_dense_hole)
+
+/* at most 2/3 of the index slots can be used */
+#define IB_DENSE_LIMIT(size) (((size) * 2) / 3)
+
+static inline size_t _ib_dense_slot(const struct ib_dense_map *dm, size_t i)
 {
-	size_t hash = hm->ht.hash(key);
-	struct ib_hash_index *index = &(hm->ht.index[hash & hm->ht.index_mask]);
-	struct ib_node **link = &index->avlroot.node;
-	struct ib_node *parent = NULL;
-	struct ib_hash_entry *entry;
-	int (*compare)(const void *key1, const void *key2) = hm->ht.compare;
-	if (index->avlroot.node == NULL) {
-		entry = ib_hash_entry_allocate(hm, key, value);
-		ASSERTION(entry);
-		entry->node.avlnode.height = 1;
-		entry->node.avlnode.left = NULL;
-		entry->node.avlnode.right = NULL;
-		entry->node.avlnode.parent = NULL;
-		entry->node.hash = hash;
-		index->avlroot.node = &(entry->node.avlnode);
-		ilist_add_tail(&index->node, &(hm->ht.head));
-		hm->ht.count++;
-		hm->insert = 1;
-		return entry;
+	switch (dm->width) {
+	case 1: return ((const IUINT8*)dm->index)[i];
+	case 2: return ((const IUINT16*)dm->index)[i];
+	case 4: return ((const IUINT32*)dm->index)[i];
+	}
+	return ((const size_t*)dm->index)[i];
+}
+
+static inline void _ib_dense_store(struct ib_dense_map *dm, size_t i,
+		size_t value)
+{
+	switch (dm->width) {
+	case 1: ((IUINT8*)dm->index)[i] = (IUINT8)value; break;
+	case 2: ((IUINT16*)dm->index)[i] = (IUINT16)value; break;
+	case 4: ((IUINT32*)dm->index)[i] = (IUINT32)value; break;
+	default: ((size_t*)dm->index)[i] = value; break;
 	}
-	while (link[0]) {
-		struct ib_hash_node *snode;
-		size_t shash;
-		parent = link[0];
-		snode = IB_ENTRY(parent, struct ib_hash_node, avlnode);
-		shash = snode->hash;
-		if (hash != shash) {
-			link = (hash < shash)? (&parent->left) : (&parent->right);
-		}	else {
-			int hc = compare(key, snode->key);
-			if (hc == 0) {
-				entry = IB_ENTRY(snode, struct ib_hash_entry, node);
-				if (update) {
-					if (hm->value_destroy) {
-						hm->value_destroy(entry->value);
-					}
-					if (hm->value_copy == NULL) entry->value = value;
-					else entry->value = hm->value_copy(value);
-				}
-				hm->insert = 0;
-				return entry;
-			}	else {
-				link = (hc < 0)? (&parent->left) : (&parent->right);
-			}
+}
+
+void ib_dense_init(struct ib_dense_map *dm, size_t (*hash)(const void*),
+		int (*compare)(const void *, const void *))
+{
+	dm->count = 0;
+	dm->used = 0;
+	dm->capacity = 0;
+	dm->index_size = 0;
+	dm->width = 1;
+	dm->insert = 0;
+	dm->entries = NULL;
+	dm->index = NULL;
+	dm->hash = hash;
+	dm->compare = compare;
+	dm->key_copy = NULL;
+	dm->key_destroy = NULL;
+	dm->value_copy = NULL;
+	dm->value_destroy = NULL;
+}
+
+void ib_dense_destroy(struct ib_dense_map *dm)
+{
+	ib_dense_clear(dm);
+	if (dm->entries) ikmem_free(dm->entries);
+	if (dm->index) ikmem_free(dm->index);
+	dm->entries = NULL;
+	dm->index = NULL;
+	dm->capacity = 0;
+	dm->index_size = 0;
+}
+
+/* index slot of the entry at pos, or of the first free slot if pos is
+ * (size_t)-1 and key is absent */
+static size_t _ib_dense_probe(const struct ib_dense_map *dm, size_t hash,
+		size_t pos)
+{
+	size_t mask = dm->index_size - 1;
+	size_t i = _ib_flat_mix(hash) & mask;
+	while (1) {
+		size_t slot = _ib_dense_slot(dm, i);
+		if (pos == (size_t)-1) {
+			if (slot <= IB_DENSE_DELETED) return i;
 		}
+		else if (slot == pos + 2) {
+			return i;
+		}
+		i = (i + 1) & mask;
 	}
-	entry = ib_hash_entry_allocate(hm, key, value);
-	ASSERTION(entry);
-	entry->node.hash = hash;
-	ib_node_link(&(entry->node.avlnode), parent, link);
-	ib_node_post_insert(&(entry->node.avlnode), &index->avlroot);
-	hm->ht.count++;
-	hm->insert = 1;
-	return entry;
 }
 
-static inline void ib_map_rehash(struct ib_hash_map *hm, size_t capacity)
+/* move live entries together and rebuild the index, size for need */
+static void _ib_dense_rebuild(struct ib_dense_map *dm, size_t need)
 {
-	size_t isize = hm->ht.index_size;
-	size_t limit = (capacity * 6) >> 2;    /* capacity * 6 / 4 */
-	if (isize < limit && hm->fixed == 0) {
-		size_t need = isize;
-		size_t size;
-		void *ptr;
-		while (need < limit) need <<= 1;
-		size = need * sizeof(struct ib_hash_index);
-		ptr = ikmem_malloc(size);
+	size_t index_size = IB_DENSE_MIN;
+	size_t capacity, i, j;
+	void *index;
+	if (need < dm->count) need = dm->count;
+	while (IB_DENSE_LIMIT(index_size) < need) index_size <<= 1;
+	capacity = IB_DENSE_LIMIT(index_size);
+	for (i = 0, j = 0; i < dm->used; i++) {
+		if (!IB_DENSE_IS_HOLE(&dm->entries[i])) {
+			if (i != j) dm->entries[j] = dm->entries[i];
+			j++;
+		}
+	}
+	ASSERTION(j == dm->count);
+	dm->used = j;
+	if (capacity != dm->capacity) {
+		void *ptr = ikmem_realloc(dm->entries, 
+				capacity * sizeof(struct ib_dense_entry));
 		ASSERTION(ptr);
-		ptr = ib_hash_swap(&hm->ht, ptr, size);
-		if (ptr) {
-			ikmem_free(ptr);
+		dm->entries = (struct ib_dense_entry*)ptr;
+		dm->capacity = capacity;
+	}
+	/* positions + 2 must fit in the slot width */
+	if (capacity + 2 <= 0xff) dm->width = 1;
+	else if (capacity + 2 <= 0xffff) dm->width = 2;
+	else if (capacity + 2 <= 0xfffffffful) dm->width = 4;
+	else dm->width = (int)sizeof(size_t);
+	index = ikmem_malloc(index_size * dm->width);
+	ASSERTION(index);
+	if (dm->index) ikmem_free(dm->index);
+	dm->index = index;
+	dm->index_size = index_size;
+	memset(dm->index, 0, index_size * dm->width);
+	for (i = 0; i < dm->used; i++) {
+		size_t slot = _ib_dense_probe(dm, dm->entries[i].hash, (size_t)-1);
+		_ib_dense_store(dm, slot, i + 2);
+	}
+}
+
+struct ib_dense_entry* ib_dense_find(struct ib_dense_map *dm, 
+		const void *key)
+{
+	int (*compare)(const void *key1, const void *key2) = dm->compare;
+	size_t hash, mask, i;
+	if (dm->count == 0) return NULL;
+	hash = dm->hash(key);
+	mask = dm->index_size - 1;
+	i = _ib_flat_mix(hash) & mask;
+	while (1) {
+		size_t slot = _ib_dense_slot(dm, i);
+		if (slot == IB_DENSE_EMPTY) {
+			return NULL;
+		}
+		if (slot != IB_DENSE_DELETED) {
+			struct ib_dense_entry *entry = &dm->entries[slot - 2];
+			if (entry->hash == hash && compare(key, entry->key) == 0) {
+				return entry;
+			}
 		}
+		i = (i + 1) & mask;
 	}
 }
 
-void ib_map_reserve(struct ib_hash_map *hm, size_t capacity)
+void* ib_dense_lookup(struct ib_dense_map *dm, const void *key, 
+		void *defval)
 {
-	ib_map_rehash(hm, capacity);
+	struct ib_dense_entry *entry = ib_dense_find(dm, key);
+	if (entry == NULL) return defval;
+	return entry->value;
 }
 
-struct ib_hash_entry* 
-ib_map_add(struct ib_hash_map *hm, void *key, void *value, int *success)
+void* ib_dense_get(struct ib_dense_map *dm, const void *key)
 {
-	struct ib_hash_entry *entry = ib_hash_update(hm, key, value, 0);
-	if (success) success[0] = hm->insert;
-	ib_map_rehash(hm, hm->ht.count);
+	return ib_dense_lookup(dm, key, NULL);
+}
+
+static struct ib_dense_entry*
+_ib_dense_update(struct ib_dense_map *dm, void *key, void *value, int update)
+{
+	struct ib_dense_entry *entry = ib_dense_find(dm, key);
+	size_t hash, slot;
+	if (entry) {
+		if (update) {
+			if (dm->value_destroy) {
+				dm->value_destroy(entry->value);
+			}
+			if (dm->value_copy == NULL) entry->value = value;
+			else entry->value = dm->value_copy(value);
+		}
+		dm->insert = 0;
+		return entry;
+	}
+	if (dm->used >= dm->capacity) {
+		/* reuse the same size if a quarter are holes, or double */
+		if (dm->used - dm->count >= (dm->capacity >> 2) && dm->capacity) {
+			_ib_dense_rebuild(dm, dm->capacity);
+		}	else {
+			_ib_dense_rebuild(dm, dm->capacity * 2);
+		}
+	}
+	hash = dm->hash(key);
+	slot = _ib_dense_probe(dm, hash, (size_t)-1);
+	_ib_dense_store(dm, slot, dm->used + 2);
+	entry = &dm->entries[dm->used++];
+	entry->hash = hash;
+	if (dm->key_copy) entry->key = dm->key_copy(key);
+	else entry->key = key;
+	if (dm->value_copy) entry->value = dm->value_copy(value);
+	else entry->value = value;
+	dm->count++;
+	dm->insert = 1;
 	return entry;
 }
 
-struct ib_hash_entry*
-ib_map_set(struct ib_hash_map *hm, void *key, void *value)
+struct ib_dense_entry* ib_dense_add(struct ib_dense_map *dm,
+		void *key, void *value, int *success)
 {
-	struct ib_hash_entry *entry = ib_hash_update(hm, key, value, 0);
-	ib_map_rehash(hm, hm->ht.count);
+	struct ib_dense_entry *entry = _ib_dense_update(dm, key, value, 0);
+	if (success) success[0] = dm->insert;
 	return entry;
 }
 
-void *ib_map_get(struct ib_hash_map *hm, const void *key)
+struct ib_dense_entry* ib_dense_set(struct ib_dense_map *dm,
+		void *key, void *value)
 {
-	return ib_map_lookup(hm, key, NULL);
+	return _ib_dense_update(dm, key, value, 1);
 }
 
-void ib_map_erase(struct ib_hash_map *hm, struct ib_hash_entry *entry)
+void ib_dense_erase(struct ib_dense_map *dm, struct ib_dense_entry *entry)
 {
-	ASSERTION(entry);
-	ASSERTION(!ib_node_empty(&(entry->node.avlnode)));
-	ib_hash_erase(&hm->ht, &entry->node);
-	ib_node_init(&(entry->node.avlnode));
-	if (hm->key_destroy) hm->key_destroy(entry->node.key);
-	if (hm->value_destroy) hm->value_destroy(entry->value);
-	entry->node.key = NULL;
+	size_t pos = (size_t)(entry - dm->entries);
+	size_t slot;
+	ASSERTION(pos < dm->used);
+	ASSERTION(!IB_DENSE_IS_HOLE(entry));
+	slot = _ib_dense_probe(dm, entry->hash, pos);
+	_ib_dense_store(dm, slot, IB_DENSE_DELETED);
+	if (dm->key_destroy) dm->key_destroy(entry->key);
+	if (dm->value_destroy) dm->value_destroy(entry->value);
+	entry->key = (void*)&ib_dense_hole;
 	entry->value = NULL;
-	ib_fastbin_del(&hm->fb, entry);
+	dm->count--;
 }
 
-int ib_map_remove(struct ib_hash_map *hm, const void *key)
+int ib_dense_remove(struct ib_dense_map *dm, const void *key)
 {
-	struct ib_hash_entry *entry;
-	entry = ib_map_find(hm, key);
+	struct ib_dense_entry *entry = ib_dense_find(dm, key);
+	size_t holes;
 	if (entry == NULL) {
 		return -1;
 	}
-	ib_map_erase(hm, entry);
+	ib_dense_erase(dm, entry);
+	holes = dm->used - dm->count;
+	if (holes > IB_DENSE_MIN && holes > dm->count) {
+		_ib_dense_rebuild(dm, dm->count);
+	}
 	return 0;
 }
 
-void ib_map_clear(struct ib_hash_map *hm)
+void ib_dense_clear(struct ib_dense_map *dm)
 {
-	while (1) {
-		struct ib_hash_entry *entry = ib_map_first(hm);
-		if (entry == NULL) break;
-		ib_map_erase(hm, entry);
+	size_t i;
+	if (dm->key_destroy || dm->value_destroy) {
+		for (i = 0; i < dm->used; i++) {
+			struct ib_dense_entry *entry = &dm->entries[i];
+			if (IB_DENSE_IS_HOLE(entry)) continue;
+			if (dm->key_destroy) dm->key_destroy(entry->key);
+			if (dm->value_destroy) dm->value_destroy(entry->value);
+		}
 	}
-	ASSERTION(hm->count == 0);
+	if (dm->index) {
+		memset(dm->index, 0, dm->index_size * dm->width);
+	}
+	dm->count = 0;
+	dm->used = 0;
 }
 
+void ib_dense_reserve(struct ib_dense_map *dm, size_t capacity)
+{
+	if (capacity > dm->capacity) {
+		_ib_dense_rebuild(dm, capacity);
+	}
+}
 
-/*--------------------------------------------------------------------*/
-/* common type hash and equal functions                               */
-/*--------------------------------------------------------------------*/
-size_t ib_hash_seed = 0x11223344;
+void ib_dense_compact(struct ib_dense_map *dm)
+{
+	if (dm->capacity > 0) {
+		_ib_dense_rebuild(dm, dm->count);
+	}
+}
 
-size_t ib_hash_func_uint(const void *key)
+static inline struct ib_dense_entry*
+_ib_dense_scan(struct ib_dense_map *dm, size_t pos, int dir)
 {
-#if 0
-	size_t x = (size_t)key;
-	return (x * 2654435761u) ^ ib_hash_seed;
-#else
-	return (size_t)key;
-#endif
+	while (pos < dm->used) {
+		if (!IB_DENSE_IS_HOLE(&dm->entries[pos])) {
+			return &dm->entries[pos];
+		}
+		pos = (dir)? pos + 1 : pos - 1;     /* wraps to the end */
+	}
+	return NULL;
 }
 
-size_t ib_hash_func_int(const void *key)
+struct ib_dense_entry* ib_dense_first(struct ib_dense_map *dm)
 {
-#if 0
-	size_t x = (size_t)key;
-	return (x * 2654435761u) ^ ib_hash_seed;
-#else
-	return (size_t)key;
-#endif
+	if (dm->count == 0) return NULL;
+	return _ib_dense_scan(dm, 0, 1);
 }
 
-size_t ib_hash_bytes_stl(const void *ptr, size_t size, size_t seed)
+struct ib_dense_entry* ib_dense_last(struct ib_dense_map *dm)
 {
-	const unsigned char *buf = (const unsigned char*)ptr;
-	const size_t m = 0x5bd1e995;
-	size_t hash = size ^ seed;
-	for (; size >= 4; buf += 4, size -= 4) {
-		size_t k = *((IUINT32*)buf);
-		k *= m;
-		k = (k >> 24) * m;
-		hash = (hash * m) ^ k;
+	if (dm->count == 0) return NULL;
+	return _ib_dense_scan(dm, dm->used - 1, 0);
+}
+
+struct ib_dense_entry* ib_dense_next(struct ib_dense_map *dm,
+		struct ib_dense_entry *n)
+{
+	return _ib_dense_scan(dm, (size_t)(n - dm->entries) + 1, 1);
+}
+
+struct ib_dense_entry* ib_dense_prev(struct ib_dense_map *dm,
+		struct ib_dense_entry *n)
+{
+	return _ib_dense_scan(dm, (size_t)(n - dm->entries) - 1, 0);
+}
+
+
+
+/*--------------------------------------------------------------------*/
+/* int map - integer keys, linear probing, no function pointers       */
+/*--------------------------------------------------------------------*/
+
+/* at most 3/4 of the slots can be used */
+#define IB_INT_LIMIT(capacity)  ((capacity) - ((capacity) >> 2))
+#define IB_INT_MIN              16
+
+/* murmur3 finalizer, sequential ids spread over the whole table */
+static inline size_t _ib_int_hash(IUINT64 x)
+{
+	x ^= x >> 33;
+	x *= (((IUINT64)0xff51afd7) << 32) | 0xed558ccd;
+	x ^= x >> 33;
+	x *= (((IUINT64)0xc4ceb9fe) << 32) | 0x1a85ec53;
+	x ^= x >> 33;
+	return (size_t)x;
+}
+
+/* position of key, or of the free slot where it should go */
+static inline size_t _ib_int_probe(const struct ib_int_map *im, 
+		IUINT64 key, int *found)
+{
+	const IUINT64 *keys = im->keys;
+	IUINT64 empty = im->empty;
+	size_t mask = im->capacity - 1;
+	size_t i = _ib_int_hash(key) & mask;
+#ifdef IB_FLAT_SSE2
+	/* two keys per step, 64 bit equality from two 32 bit compares */
+	__m128i target = _mm_set_epi32((int)(IUINT32)(key >> 32), 
+			(int)(IUINT32)key, (int)(IUINT32)(key >> 32), (int)(IUINT32)key);
+	__m128i hole = _mm_set_epi32((int)(IUINT32)(empty >> 32), 
+			(int)(IUINT32)empty, (int)(IUINT32)(empty >> 32), 
+			(int)(IUINT32)empty);
+	while (i + 1 < im->capacity) {
+		__m128i group = _mm_loadu_si128((const __m128i*)(keys + i));
+		__m128i x = _mm_cmpeq_epi32(group, target);
+		__m128i y = _mm_cmpeq_epi32(group, hole);
+		int mx, my;
+		x = _mm_and_si128(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+		y = _mm_and_si128(y, _mm_shuffle_epi32(y, _MM_SHUFFLE(2, 3, 0, 1)));
+		mx = _mm_movemask_pd(_mm_castsi128_pd(x));
+		my = _mm_movemask_pd(_mm_castsi128_pd(y));
+		if ((mx | my) & 1) {
+			found[0] = mx & 1;
+			return i;
+		}
+		if ((mx | my) & 2) {
+			found[0] = (mx >> 1) & 1;
+			return i + 1;
+		}
+		i += 2;
 	}
-	switch (size) {
-	case 3: hash ^= ((IUINT32)buf[2]) << 16;
-	case 2: hash ^= ((IUINT32)buf[1]) << 8;
-	case 1: hash ^= ((IUINT32)buf[0]); hash = hash * m; break;
+	i &= mask;
+#endif
+	while (1) {
+		IUINT64 k = keys[i];
+		if (k == key) {
+			found[0] = 1;
+			return i;
+		}
+		if (k == empty) {
+			found[0] = 0;
+			return i;
+		}
+		i = (i + 1) & mask;
 	}
-	hash = (hash ^ (hash >> 13)) * m;
-	return hash ^ (hash >> 15);
 }
 
-size_t ib_hash_bytes_lua(const void *ptr, size_t size, size_t seed)
+void ib_int_init(struct ib_int_map *im, IUINT64 empty)
 {
-	const unsigned char *name = (const unsigned char*)ptr;
-	size_t step = (size >> 5) + 1;
-	size_t h = size ^ seed, i;
-    for(i = size; i >= step; i -= step)
-        h = h ^ ((h << 5) + (h >> 2) + (size_t)name[i - 1]);
-    return h;
+	im->count = 0;
+	im->capacity = 0;
+	im->empty = empty;
+	im->has_empty = 0;
+	im->empty_value = NULL;
+	im->keys = NULL;
+	im->values = NULL;
 }
 
-size_t ib_hash_func_str(const void *key)
+void ib_int_destroy(struct ib_int_map *im)
 {
-	ib_string *str = (ib_string*)key;
-#ifndef IB_HASH_BYTES_STL
-	return ib_hash_bytes_lua(str->ptr, str->size, ib_hash_seed);
-#else
-	return ib_hash_bytes_stl(str->ptr, str->size, ib_hash_seed);
-#endif
+	if (im->keys) {
+		ikmem_free(im->keys);
+	}
+	im->keys = NULL;
+	im->values = NULL;
+	im->capacity = 0;
+	im->count = 0;
+	im->has_empty = 0;
+	im->empty_value = NULL;
 }
 
-size_t ib_hash_func_cstr(const void *key)
+static void _ib_int_rehash(struct ib_int_map *im, size_t capacity)
 {
-	const char *str = (const char*)key;
-	size_t size = strlen(str);
-#ifndef IB_HASH_BYTES_STL
-	return ib_hash_bytes_lua(str, size, ib_hash_seed);
-#else
-	return ib_hash_bytes_stl(str, size, ib_hash_seed);
-#endif
+	IUINT64 *keys = im->keys;
+	void **values = im->values;
+	size_t size = im->capacity;
+	IUINT64 empty = im->empty;
+	size_t i;
+	char *ptr;
+	ptr = (char*)ikmem_malloc(capacity * (sizeof(IUINT64) + sizeof(void*)));
+	ASSERTION(ptr);
+	im->keys = (IUINT64*)ptr;
+	im->values = (void**)(ptr + capacity * sizeof(IUINT64));
+	im->capacity = capacity;
+	for (i = 0; i < capacity; i++) {
+		im->keys[i] = empty;
+	}
+	for (i = 0; i < size; i++) {
+		if (keys[i] != empty) {
+			int found;
+			size_t pos = _ib_int_probe(im, keys[i], &found);
+			im->keys[pos] = keys[i];
+			im->values[pos] = values[i];
+		}
+	}
+	if (keys) {
+		ikmem_free(keys);
+	}
 }
 
-int ib_hash_compare_uint(const void *key1, const void *key2)
+void ib_int_reserve(struct ib_int_map *im, size_t capacity)
 {
-	size_t x = (size_t)key1;
-	size_t y = (size_t)key2;
-	if (x == y) return 0;
-	return (x < y)? -1 : 1;
+	size_t need = IB_INT_MIN;
+	if (capacity < im->count) capacity = im->count;
+	while (IB_INT_LIMIT(need) < capacity) need <<= 1;
+	if (need > im->capacity) {
+		_ib_int_rehash(im, need);
+	}
 }
 
-int ib_hash_compare_int(const void *key1, const void *key2)
+void** ib_int_find(const struct ib_int_map *im, IUINT64 key)
 {
-	ilong x = (ilong)key1;
-	ilong y = (ilong)key2;
-	if (x == y) return 0;
-	return (x < y)? -1 : 1;
+	size_t pos;
+	int found;
+	if (key == im->empty) {
+		return (im->has_empty)? (void**)&im->empty_value : NULL;
+	}
+	if (im->capacity == 0) return NULL;
+	pos = _ib_int_probe(im, key, &found);
+	return (found)? &im->values[pos] : NULL;
 }
 
-int ib_hash_compare_str(const void *key1, const void *key2)
+void* ib_int_lookup(const struct ib_int_map *im, IUINT64 key, void *defval)
 {
-	return ib_string_compare((const ib_string*)key1, (const ib_string*)key2);
+	void **value = ib_int_find(im, key);
+	return (value)? value[0] : defval;
 }
 
-int ib_compare_bytes(const void *p1, size_t s1, const void *p2, size_t s2)
+static int _ib_int_update(struct ib_int_map *im, IUINT64 key, 
+		void *value, int update)
 {
-	int minsize = (s1 < s2)? s1 : s2;
-	int hr = memcmp(p1, p2, minsize);
-	if (hr == 0) {
-		if (s1 == s2) return 0;
-		return (s1 < s2)? -1 : 1;
+	size_t pos;
+	int found;
+	if (key == im->empty) {
+		int inserted = !im->has_empty;
+		if (inserted || update) im->empty_value = value;
+		if (inserted) im->count++;
+		im->has_empty = 1;
+		return inserted;
 	}
-	else {
-		return (hr < 0)? -1 : 1;
+	if (im->count - im->has_empty + 1 > IB_INT_LIMIT(im->capacity)) {
+		_ib_int_rehash(im, (im->capacity)? im->capacity * 2 : IB_INT_MIN);
+	}
+	pos = _ib_int_probe(im, key, &found);
+	if (found) {
+		if (update) im->values[pos] = value;
+		return 0;
 	}
+	im->keys[pos] = key;
+	im->values[pos] = value;
+	im->count++;
+	return 1;
 }
 
-int ib_hash_compare_cstr(const void *key1, const void *key2)
+int ib_int_set(struct ib_int_map *im, IUINT64 key, void *value)
 {
-	const char *x = (const char*)key1;
-	const char *y = (const char*)key2;
-	return ib_compare_bytes(x, strlen(x), y, strlen(y));
+	return _ib_int_update(im, key, value, 1);
 }
 
+int ib_int_add(struct ib_int_map *im, IUINT64 key, void *value)
+{
+	return _ib_int_update(im, key, value, 0);
+}
 
-
-struct ib_hash_entry *ib_map_find_uint(struct ib_hash_map *hm, iulong key)
+size_t ib_int_set_bulk(struct ib_int_map *im, const IUINT64 *keys, 
+		void *const *values, size_t n)
 {
-	struct ib_hash_entry *hr;
-	void *kk = (void*)key;
-	ib_map_search(hm, kk, ib_hash_func_uint, ib_hash_compare_uint, hr);
-	return hr;
+	size_t inserted = 0, i;
+	ib_int_reserve(im, im->count + n);
+	for (i = 0; i < n; i++) {
+		if (i + 8 < n && im->capacity > 0) {
+			size_t ahead = _ib_int_hash(keys[i + 8]) & (im->capacity - 1);
+			IB_PREFETCH(&im->keys[ahead]);
+		}
+		inserted += _ib_int_update(im, keys[i], 
+				(values)? values[i] : NULL, 1);
+	}
+	return inserted;
 }
 
-struct ib_hash_entry *ib_map_find_int(struct ib_hash_map *hm, ilong key)
+int ib_int_remove(struct ib_int_map *im, IUINT64 key)
 {
-	struct ib_hash_entry *hr;
-	void *kk = (void*)key;
-	ib_map_search(hm, kk, ib_hash_func_int, ib_hash_compare_int, hr);
-	return hr;
+	size_t mask, i, j;
+	int found;
+	if (key == im->empty) {
+		if (im->has_empty == 0) return -1;
+		im->has_empty = 0;
+		im->empty_value = NULL;
+		im->count--;
+		return 0;
+	}
+	if (im->capacity == 0) return -1;
+	i = _ib_int_probe(im, key, &found);
+	if (found == 0) return -1;
+	mask = im->capacity - 1;
+	/* backward shift: pull later keys of the run into the hole if the
+	 * hole lies between their home slot and where they are now */
+	for (j = i; ; ) {
+		size_t home;
+		j = (j + 1) & mask;
+		if (im->keys[j] == im->empty) break;
+		home = _ib_int_hash(im->keys[j]) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			im->keys[i] = im->keys[j];
+			im->values[i] = im->values[j];
+			i = j;
+		}
+	}
+	im->keys[i] = im->empty;
+	im->values[i] = NULL;
+	im->count--;
+	return 0;
 }
 
-struct ib_hash_entry *ib_map_find_str(struct ib_hash_map *hm, const ib_string *key)
+void ib_int_clear(struct ib_int_map *im)
 {
-	struct ib_hash_entry *hr;
-	void *kk = (void*)key;
-	ib_map_search(hm, kk, ib_hash_func_str, ib_hash_compare_str, hr);
-	return hr;
+	size_t i;
+	for (i = 0; i < im->capacity; i++) {
+		im->keys[i] = im->empty;
+	}
+	im->count = 0;
+	im->has_empty = 0;
+	im->empty_value = NULL;
 }
 
-struct ib_hash_entry *ib_map_find_cstr(struct ib_hash_map *hm, const char *key)
+size_t ib_int_next(const struct ib_int_map *im, size_t pos)
 {
-	struct ib_hash_entry *hr;
-	void *kk = (void*)key;
-	ib_map_search(hm, kk, ib_hash_func_cstr, ib_hash_compare_cstr, hr);
-	return hr;
+	for (pos++; pos < im->capacity; pos++) {
+		if (im->keys[pos] != im->empty) return pos;
+	}
+	if (pos == im->capacity && im->has_empty) {
+		return pos;
+	}
+	return im->capacity + 1;
 }
 
+size_t ib_int_first(const struct ib_int_map *im)
+{
+	return ib_int_next(im, (size_t)-1);
+}
 
 
 
@@ -101,6 +101,24 @@ typedef ISTDINT32 IINT32;
 typedef ISTDUINT32 IUINT32;
 #endif
 
+#ifndef __IINT64_DEFINED
+#define __IINT64_DEFINED
+#if defined(_MSC_VER) || defined(__BORLANDC__)
+typedef __int64 IINT64;
+#else
+typedef long long IINT64;
+#endif
+#endif
+
+#ifndef __IUINT64_DEFINED
+#define __IUINT64_DEFINED
+#if defined(_MSC_VER) || defined(__BORLANDC__)
+typedef unsigned __int64 IUINT64;
+#else
+typedef unsigned long long IUINT64;
+#endif
+#endif
+
 
 /*--------------------------------------------------------------------*/
 /* INLINE                                                             */
@@ -421,6 +439,123 @@ typedef struct ILISTHEAD ilist_head;
 #endif
 
 
+/*====================================================================*/
+/* IRWLOCK - reader/writer lock interfaces                            */
+/*====================================================================*/
+#ifndef IRWLOCK_TYPE
+
+#ifndef IMUTEX_DISABLE
+#if (defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64))
+#if defined(_WIN32_WINNT) && (_WIN32_WINNT >= 0x0600) && (!defined(_XBOX))
+#define IRWLOCK_TYPE         SRWLOCK
+#define IRWLOCK_INIT(m)      InitializeSRWLock((SRWLOCK*)(m))
+#define IRWLOCK_DESTROY(m)   { (void)(m); }
+#define IRWLOCK_RDLOCK(m)    AcquireSRWLockShared((SRWLOCK*)(m))
+#define IRWLOCK_RDUNLOCK(m)  ReleaseSRWLockShared((SRWLOCK*)(m))
+#define IRWLOCK_WRLOCK(m)    AcquireSRWLockExclusive((SRWLOCK*)(m))
+#define IRWLOCK_WRUNLOCK(m)  ReleaseSRWLockExclusive((SRWLOCK*)(m))
+#endif
+
+#elif defined(__unix) || defined(__unix__) || defined(__MACH__)
+#ifdef PTHREAD_RWLOCK_INITIALIZER   /* hidden by strict ansi modes */
+#define IRWLOCK_TYPE         pthread_rwlock_t
+#define IRWLOCK_INIT(m)      pthread_rwlock_init((pthread_rwlock_t*)(m), 0)
+#define IRWLOCK_DESTROY(m)   pthread_rwlock_destroy((pthread_rwlock_t*)(m))
+#define IRWLOCK_RDLOCK(m)    pthread_rwlock_rdlock((pthread_rwlock_t*)(m))
+#define IRWLOCK_RDUNLOCK(m)  pthread_rwlock_unlock((pthread_rwlock_t*)(m))
+#define IRWLOCK_WRLOCK(m)    pthread_rwlock_wrlock((pthread_rwlock_t*)(m))
+#define IRWLOCK_WRUNLOCK(m)  pthread_rwlock_unlock((pthread_rwlock_t*)(m))
+#endif
+#endif
+#endif
+
+/* fall back to mutex, readers exclude each other too */
+#ifndef IRWLOCK_TYPE
+#define IRWLOCK_TYPE         IMUTEX_TYPE
+#define IRWLOCK_INIT(m)      IMUTEX_INIT(m)
+#define IRWLOCK_DESTROY(m)   IMUTEX_DESTROY(m)
+#define IRWLOCK_RDLOCK(m)    IMUTEX_LOCK(m)
+#define IRWLOCK_RDUNLOCK(m)  IMUTEX_UNLOCK(m)
+#define IRWLOCK_WRLOCK(m)    IMUTEX_LOCK(m)
+#define IRWLOCK_WRUNLOCK(m)  IMUTEX_UNLOCK(m)
+#endif
+
+#endif
+
+
+/*====================================================================*/
+/* IATOMIC - atomic operations on pointer sized variables             */
+/*====================================================================*/
+#ifndef IATOMIC_LOAD
+
+#if defined(__GNUC__) && defined(__ATOMIC_SEQ_CST)
+#define IATOMIC_LOAD(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define IATOMIC_STORE(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define IATOMIC_ADD(p, v)      __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST)
+#define IATOMIC_CAS(p, o, n)   __sync_bool_compare_and_swap(p, o, n)
+#define IATOMIC_FENCE()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__i386__) || defined(__x86_64__)
+#define IATOMIC_PAUSE()        __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define IATOMIC_PAUSE()        __asm__ __volatile__("yield" ::: "memory")
+#else
+#define IATOMIC_PAUSE()        __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+#elif defined(_MSC_VER) && (defined(_WIN32) || defined(_WIN64))
+#ifndef WIN32_LEAN_AND_MEAN  
+#define WIN32_LEAN_AND_MEAN  
+#endif
+#include <windows.h>
+/* aligned volatile access has acquire/release semantics in msvc */
+#define IATOMIC_LOAD(p)        (*(p))
+#define IATOMIC_STORE(p, v)    ((*(p)) = (v))
+#define IATOMIC_CAS(p, o, n)   (InterlockedCompareExchangePointer( \
+		(PVOID volatile*)(p), (PVOID)(n), (PVOID)(o)) == (PVOID)(o))
+#define IATOMIC_FENCE()        MemoryBarrier()
+#define IATOMIC_PAUSE()        YieldProcessor()
+#if defined(_WIN64)
+#define IATOMIC_ADD(p, v)      (InterlockedExchangeAdd64( \
+		(LONG64 volatile*)(p), (v)) + (v))
+#else
+#define IATOMIC_ADD(p, v)      (InterlockedExchangeAdd( \
+		(LONG volatile*)(p), (v)) + (v))
+#endif
+
+#else
+/* no atomic support: single thread only */
+#define IATOMIC_LOAD(p)        (*(p))
+#define IATOMIC_STORE(p, v)    ((*(p)) = (v))
+#define IATOMIC_ADD(p, v)      ((*(p)) += (v))
+#define IATOMIC_CAS(p, o, n)   (((*(p)) == (o))? ((*(p)) = (n), 1) : 0)
+#define IATOMIC_FENCE()        ((void)0)
+#endif
+
+#endif
+
+/* cpu relax hint for spin loops */
+#ifndef IATOMIC_PAUSE
+#define IATOMIC_PAUSE()        ((void)0)
+#endif
+
+
+/*====================================================================*/
+/* IB_PREFETCH - hint to load the cache line of an address for read   */
+/*====================================================================*/
+#ifndef IB_PREFETCH
+
+#if defined(__GNUC__)
+#define IB_PREFETCH(p)         __builtin_prefetch((const void*)(p), 0, 3)
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#define IB_PREFETCH(p)         _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define IB_PREFETCH(p)         ((void)(p))
+#endif
+
+#endif
+
+
 
 /*====================================================================*/
 /* IVECTOR / IMEMNODE MANAGEMENT                                      */
@@ -488,8 +623,19 @@ struct ib_node
 struct ib_root
 {
 	struct ib_node *node;		/* root node */
+#ifdef IB_TREE_STATS
+	size_t rotations;           /* rotations done in this tree */
+#endif
 };
 
+/* define IB_TREE_STATS to collect per-tree counters, costs nothing
+ * when it is undefined */
+#ifdef IB_TREE_STATS
+#define IB_ROOT_STATS_INIT(r) do { (r)->rotations = 0; } while (0)
+#else
+#define IB_ROOT_STATS_INIT(r) do { } while (0)
+#endif
+
 
 /*--------------------------------------------------------------------*/
 /* NODE MACROS                                                        */
@@ -537,6 +683,72 @@ void ib_node_erase(struct ib_node *node, struct ib_root *root);
 struct ib_node* ib_node_tear(struct ib_root *root, struct ib_node **next);
 
 
+/*--------------------------------------------------------------------*/
+/* avl - augmented tree                                               */
+/*--------------------------------------------------------------------*/
+
+/* update() recalculates the augmented data of a node from the node
+ * itself and its children, it will be invoked bottom-up during insert,
+ * erase and rotation, so children are always up to date when called */
+struct ib_augment
+{
+	void (*update)(struct ib_node *node);
+};
+
+void ib_node_post_insert_augmented(struct ib_node *node,
+		struct ib_root *root, const struct ib_augment *aug);
+
+void ib_node_erase_augmented(struct ib_node *node, struct ib_root *root,
+		const struct ib_augment *aug);
+
+/* update augmented data from node up to the root */
+void ib_node_augment_propagate(struct ib_node *node,
+		const struct ib_augment *aug);
+
+
+/*--------------------------------------------------------------------*/
+/* avl - order statistic (augmented with subtree size)                */
+/*--------------------------------------------------------------------*/
+struct ib_snode
+{
+	struct ib_node node;       /* must be the first member */
+	size_t size;               /* number of nodes in this subtree */
+};
+
+#define IB_SNODE(n)         IB_ENTRY(n, struct ib_snode, node)
+#define IB_SNODE_SIZE(n)    ((n)? IB_SNODE(n)->size : 0)
+
+extern const struct ib_augment ib_snode_augment;
+
+/* returns the k-th (starts from 0) node in order, NULL for overflow */
+struct ib_node *ib_snode_select(struct ib_root *root, size_t k);
+
+/* returns the number of nodes before the given node */
+size_t ib_snode_rank(const struct ib_node *node);
+
+
+/*--------------------------------------------------------------------*/
+/* avl - join and split in O(log n), aug can be NULL for plain avl    */
+/*--------------------------------------------------------------------*/
+
+/* join two trees with a pivot, keys in left < pivot < keys in right,
+ * root can be the same as left or right, both of them will be empty */
+void ib_node_join(struct ib_root *root, struct ib_root *left,
+		struct ib_node *pivot, struct ib_root *right, 
+		const struct ib_augment *aug);
+
+/* concatenate two trees without pivot, keys in left < keys in right */
+void ib_node_concat(struct ib_root *root, struct ib_root *left,
+		struct ib_root *right, const struct ib_augment *aug);
+
+/* split root before node: nodes less than node go to left, node itself
+ * and greater ones go to right, root will be empty unless it is the
+ * same as left or right, node can be NULL to move everything left */
+void ib_node_split(struct ib_root *root, struct ib_node *node,
+		struct ib_root *left, struct ib_root *right,
+		const struct ib_augment *aug);
+
+
 /*--------------------------------------------------------------------*/
 /* avl - node templates                                               */
 /*--------------------------------------------------------------------*/
@@ -552,6 +764,48 @@ struct ib_node* ib_node_tear(struct ib_root *root, struct ib_node **next);
 	}   while (0)
 
 
+/* interleaved search of n keys: IB_NODE_LANES lookups advance one level
+ * per round, and the next node of each lane is prefetched before it is
+ * touched in the following round, res_nodes[i] is NULL if not found */
+#define IB_NODE_LANES    8
+
+#define ib_node_find_batch(root, whats, n, compare_fn, res_nodes) do { \
+		struct ib_node *__lane[IB_NODE_LANES]; \
+		size_t __query[IB_NODE_LANES]; \
+		size_t __next = 0, __active = 0; \
+		int __i, __lanes = 0; \
+		for (; __lanes < IB_NODE_LANES && __next < (size_t)(n); __lanes++) { \
+			__lane[__lanes] = (root)->node; \
+			__query[__lanes] = __next++; \
+			__active++; \
+		} \
+		while (__active > 0) { \
+			for (__i = 0; __i < __lanes; __i++) { \
+				struct ib_node *__n = __lane[__i]; \
+				int __hr = -1; \
+				if (__n == NULL && __query[__i] == (size_t)-1) continue; \
+				if (__n != NULL) { \
+					__hr = (compare_fn)((whats)[__query[__i]], __n); \
+					if (__hr != 0) __n = (__hr < 0)? __n->left : __n->right;\
+				} \
+				if (__hr == 0 || __n == NULL) { \
+					(res_nodes)[__query[__i]] = (__hr == 0)? __n : NULL; \
+					if (__next < (size_t)(n)) { \
+						__query[__i] = __next++; \
+						__n = (root)->node; \
+					}	else { \
+						__query[__i] = (size_t)-1; \
+						__n = NULL; \
+						__active--; \
+					} \
+				} \
+				if (__n) IB_PREFETCH(__n); \
+				__lane[__i] = __n; \
+			} \
+		} \
+	}   while (0)
+
+
 #define ib_node_add(root, newnode, compare_fn, duplicate_node) do { \
 		struct ib_node **__link = &((root)->node); \
 		struct ib_node *__parent = NULL; \
@@ -575,6 +829,29 @@ struct ib_node* ib_node_tear(struct ib_root *root, struct ib_node **next);
 /*--------------------------------------------------------------------*/
 /* avltree - friendly interface                                       */
 /*--------------------------------------------------------------------*/
+#ifndef IB_TREE_STATS_DEPTH
+#define IB_TREE_STATS_DEPTH    32
+#endif
+
+/* operation counters, only maintained when IB_TREE_STATS is defined */
+struct ib_tree_stats
+{
+	size_t compares;            /* compare() calls in searches */
+	size_t searches;            /* find/nearest/bound/add probes */
+	size_t inserts;
+	size_t erases;
+	size_t rotations;
+	size_t depth[IB_TREE_STATS_DEPTH];  /* probe depth histogram */
+};
+
+/* shape report: average depth is depth_sum / count */
+struct ib_tree_shape
+{
+	size_t count;
+	size_t depth_sum;           /* sum of node depths, root is 1 */
+	int height;
+};
+
 struct ib_tree
 {
 	struct ib_root root;		/* avl root */
@@ -583,6 +860,10 @@ struct ib_tree
 	size_t count;				/* node count */
 	/* returns 0 for equal, -1 for n1 < n2, 1 for n1 > n2 */
 	int (*compare)(const void *n1, const void *n2);
+	const struct ib_augment *augment;	/* NULL for plain avl */
+#ifdef IB_TREE_STATS
+	struct ib_tree_stats stats;
+#endif
 };
 
 
@@ -610,8 +891,282 @@ void *ib_tree_add(struct ib_tree *tree, void *data);
 void ib_tree_remove(struct ib_tree *tree, void *data);
 void ib_tree_replace(struct ib_tree *tree, void *victim, void *newdata);
 
+/* finger search: start from finger (data in the tree near the key, eg.
+ * the last result) and climb only as far as needed before descending.
+ * keys next to a finger near the leaves and sorted appends from the 
+ * last data take O(1) comparisons, but the climb and the descent are
+ * O(log n) in the worst case (eg. finger at the max of the left 
+ * subtree of the root, key just above the root), not O(log d). NULL
+ * finger starts from the root */
+void *ib_tree_find_from(struct ib_tree *tree, void *finger, const void *data);
+void *ib_tree_add_from(struct ib_tree *tree, void *finger, void *data);
+
+/* batched find: datas[i] are temporary structures with the keys, the
+ * lookups are interleaved like ib_node_find_batch to overlap cache 
+ * misses, out[i] is NULL if not found, returns the number found */
+size_t ib_tree_find_batch(struct ib_tree *tree, void **datas, size_t n,
+		void **out);
+
 void ib_tree_clear(struct ib_tree *tree, void (*destroy)(void *data));
 
+/* walk the tree and report height, node count and depth sum in O(n) */
+void ib_tree_shape(const struct ib_tree *tree, struct ib_tree_shape *shape);
+
+#ifdef IB_TREE_STATS
+/* copy the counters (rotations are taken from the root) */
+void ib_tree_stats(const struct ib_tree *tree, struct ib_tree_stats *stats);
+void ib_tree_stats_reset(struct ib_tree *tree);
+#endif
+
+
+/* initialize augmented avltree, user structure must embed the node
+ * type required by the augment, eg: struct ib_snode for order statistic
+ *     ib_tree_init_augment(&mytree, mystruct_compare,
+ *          sizeof(struct mystruct_t),
+ *          IB_OFFSET(struct mystruct_t, snode),
+ *          &ib_snode_augment);
+ */
+void ib_tree_init_augment(struct ib_tree *tree,
+		int (*compare)(const void*, const void*), size_t size, size_t offset,
+		const struct ib_augment *augment);
+
+/* order statistic, require tree to be initialized with ib_snode_augment,
+ * select returns the k-th (starts from 0) data or NULL for overflow */
+void *ib_tree_select(struct ib_tree *tree, size_t k);
+
+/* returns the number of nodes before the data (must be in the tree) */
+size_t ib_tree_rank(struct ib_tree *tree, const void *data);
+
+/* count nodes in [lo, hi], lo and hi are temporary structures with keys */
+size_t ib_tree_count_range(struct ib_tree *tree,
+		const void *lo, const void *hi);
+
+/* range aggregate over [lo, hi] (NULL for unbounded) in O(log n) for 
+ * trees with an augment keeping sum/min/max etc. in user structure:
+ * fold() will be called with disjoint pieces in order, whole is 0 for 
+ * a single data and 1 for a whole subtree (use its augmented value) */
+void ib_tree_aggregate(struct ib_tree *tree, const void *lo, const void *hi,
+		void (*fold)(void *ctx, void *data, int whole), void *ctx);
+
+
+/* returns the first data >= key (lower) or > key (upper), NULL for none */
+void *ib_tree_lower_bound(struct ib_tree *tree, const void *data);
+void *ib_tree_upper_bound(struct ib_tree *tree, const void *data);
+
+/* range cursor */
+struct ib_tree_range
+{
+	struct ib_tree *tree;
+	struct ib_node *node;       /* next node to return */
+	struct ib_node *endup;      /* first node after the range */
+};
+
+/* iterate [lo, hi] (NULL for unbounded), returns the first data, eg:
+ *     for (p = ib_tree_range_first(&range, &mytree, &lo, &hi); p;
+ *          p = ib_tree_range_next(&range)) { ... }
+ * the tree must not be modified during the iteration */
+void *ib_tree_range_first(struct ib_tree_range *range, 
+		struct ib_tree *tree, const void *lo, const void *hi);
+
+/* returns next data in range, NULL for the end */
+void *ib_tree_range_next(struct ib_tree_range *range);
+
+/* remove [lo, hi] (NULL for unbounded) with split/join in O(log n + k),
+ * destroy can be NULL, returns the number of removed nodes */
+size_t ib_tree_erase_range(struct ib_tree *tree, const void *lo,
+		const void *hi, void (*destroy)(void *data));
+
+/* move nodes >= key into tree right (it will be initialized with the
+ * same parameters). O(log n) only with ib_snode_augment: otherwise the
+ * nodes of one part are walked to keep count, which is O(n) (cheap if 
+ * the key is near either end), use ib_node_split for a plain O(log n)
+ * split without counts */
+void ib_tree_split(struct ib_tree *tree, const void *data, 
+		struct ib_tree *right);
+
+/* move all nodes of right into tree in O(log n), keys in tree must be
+ * less than keys in right, returns 0 for success, -1 for overlapping */
+int ib_tree_join(struct ib_tree *tree, struct ib_tree *right);
+
+
+/*--------------------------------------------------------------------*/
+/* splay tree - self-adjusting tree on the ib_node layout             */
+/*--------------------------------------------------------------------*/
+struct ib_splay
+{
+	struct ib_root root;
+	size_t offset;              /* node offset in user data structure */
+	size_t size;                /* size of user data structure */
+	size_t count;
+	int (*compare)(const void *n1, const void *n2);
+	int semi;                   /* semi-splay: half the rotations */
+	unsigned int period;        /* splay on every period-th access */
+	unsigned int ticks;
+};
+
+/* same as ib_tree_init, full splaying on every access by default */
+void ib_splay_init(struct ib_splay *tree,
+		int (*compare)(const void*, const void*), size_t size, size_t offset);
+
+/* semi != 0 enables semi-splaying (only the grandparent is rotated in
+ * the zig-zig case), period > 1 splays every period-th access only to
+ * limit write traffic of lookups */
+void ib_splay_config(struct ib_splay *tree, int semi, unsigned int period);
+
+/* ordered walk, won't change the shape */
+void *ib_splay_first(struct ib_splay *tree);
+void *ib_splay_last(struct ib_splay *tree);
+void *ib_splay_next(struct ib_splay *tree, void *data);
+void *ib_splay_prev(struct ib_splay *tree, void *data);
+
+/* searches move the accessed node towards the root */
+void *ib_splay_find(struct ib_splay *tree, const void *data);
+void *ib_splay_nearest(struct ib_splay *tree, const void *data);
+
+/* returns NULL for success, otherwise returns conflict node with same key */
+void *ib_splay_add(struct ib_splay *tree, void *data);
+
+void ib_splay_remove(struct ib_splay *tree, void *data);
+void ib_splay_replace(struct ib_splay *tree, void *victim, void *newdata);
+
+void ib_splay_clear(struct ib_splay *tree, void (*destroy)(void *data));
+
+
+/*--------------------------------------------------------------------*/
+/* frozen tree - read-only records in implicit level-order layout     */
+/*--------------------------------------------------------------------*/
+struct ib_frozen
+{
+	char *base;                 /* record k (from 1) at base + (k-1)*size */
+	size_t count;
+	size_t size;                /* record size */
+	int (*compare)(const void *n1, const void *n2);
+	void *buffer;               /* owned memory, NULL if attached */
+};
+
+/* image: header followed by records, can be written to a file and 
+ * mapped back with ib_frozen_attach (same endian and record layout) */
+#define IB_FROZEN_MAGIC     0x5a464249      /* "IBFZ" */
+#define IB_FROZEN_VERSION   1
+
+struct ib_frozen_header
+{
+	IUINT32 magic;
+	IUINT32 version;
+	IUINT32 size;               /* record size */
+	IUINT32 count;
+	IUINT32 endian;             /* 0x01020304 in native order */
+	IUINT32 reserved[3];
+};
+
+/* copy the whole tree into a pointer-free eytzinger array. copy(record,
+ * data) extracts a payload of size bytes from each data, records must
+ * keep the tree order under compare. if copy is NULL, size and compare
+ * are taken from the tree and each record is the whole data with the
+ * embedded ib_node zeroed. returns 0 for success, -1 for out of memory
+ * or if count or size exceeds 0xffffffff (the image header limit) */
+int ib_frozen_freeze(struct ib_frozen *fz, struct ib_tree *tree,
+		size_t size, void (*copy)(void *record, const void *data),
+		int (*compare)(const void*, const void*));
+
+/* same as freeze, but from an array of count records sorted by compare,
+ * returns -1 for out of memory or if count or size exceeds 0xffffffff */
+int ib_frozen_build(struct ib_frozen *fz, const void *records, 
+		size_t count, size_t size, int (*compare)(const void*, const void*));
+
+void ib_frozen_destroy(struct ib_frozen *fz);
+
+/* lookups take a temporary record which contains the key */
+void *ib_frozen_find(const struct ib_frozen *fz, const void *data);
+
+/* first record >= data / > data, NULL if none */
+void *ib_frozen_lower_bound(const struct ib_frozen *fz, const void *data);
+void *ib_frozen_upper_bound(const struct ib_frozen *fz, const void *data);
+
+#define ib_frozen_nearest(fz, data) ib_frozen_lower_bound(fz, data)
+
+/* in-order iteration, range [lo, hi] can be visited by:
+ *     endup = ib_frozen_upper_bound(fz, &hi);
+ *     for (p = ib_frozen_lower_bound(fz, &lo); p != endup; 
+ *          p = ib_frozen_next(fz, p)) { ... }
+ */
+void *ib_frozen_first(const struct ib_frozen *fz);
+void *ib_frozen_last(const struct ib_frozen *fz);
+void *ib_frozen_next(const struct ib_frozen *fz, const void *record);
+void *ib_frozen_prev(const struct ib_frozen *fz, const void *record);
+
+/* bytes required by ib_frozen_export */
+size_t ib_frozen_image_size(const struct ib_frozen *fz);
+
+/* write header and records into image, returns bytes written */
+size_t ib_frozen_export(const struct ib_frozen *fz, void *image);
+
+/* use an image in place without copying (eg. from mmap), the image must
+ * stay valid until destroy, returns 0 for success, -1 for bad image */
+int ib_frozen_attach(struct ib_frozen *fz, const void *image, size_t length,
+		int (*compare)(const void*, const void*));
+
+
+/*--------------------------------------------------------------------*/
+/* compact avl - no parent pointer, balance packed in the left link   */
+/*--------------------------------------------------------------------*/
+struct ib_cnode
+{
+	struct ib_cnode *child[2];   /* low 2 bits of child[0]: balance */
+};
+
+/* nodes must be aligned to 4 bytes at least */
+#define IB_CNODE_LEFT(n)  \
+	((struct ib_cnode*)((size_t)((n)->child[0]) & ~((size_t)3)))
+#define IB_CNODE_RIGHT(n) ((n)->child[1])
+
+#define IB_CNODE2DATA(n, o)   ((void *)((size_t)(n) - (o)))
+#define IB_DATA2CNODE(d, o)   ((struct ib_cnode*)((size_t)(d) + (o)))
+
+#ifndef IB_CNODE_DEPTH
+#define IB_CNODE_DEPTH    96
+#endif
+
+struct ib_ctree
+{
+	struct ib_cnode *root;
+	size_t offset;              /* node offset in user data structure */
+	size_t size;                /* size of user data structure */
+	size_t count;
+	int (*compare)(const void *n1, const void *n2);
+};
+
+/* path from root to the current node, invalid after modification */
+struct ib_ctree_iter
+{
+	struct ib_cnode *stack[IB_CNODE_DEPTH];
+	int top;
+};
+
+/* same as ib_tree_init, use IB_OFFSET(type, member) for "offset" */
+void ib_ctree_init(struct ib_ctree *tree,
+	int (*compare)(const void*, const void*), size_t size, size_t offset);
+
+void *ib_ctree_find(struct ib_ctree *tree, const void *data);
+
+/* returns NULL for success, otherwise returns conflict data */
+void *ib_ctree_add(struct ib_ctree *tree, void *data);
+
+/* remove the node with the same key, returns it or NULL if not found */
+void *ib_ctree_remove(struct ib_ctree *tree, const void *data);
+
+void ib_ctree_clear(struct ib_ctree *tree, void (*destroy)(void *data));
+
+/* iteration with an explicit cursor stack, returns NULL at the end */
+void *ib_ctree_first(struct ib_ctree *tree, struct ib_ctree_iter *it);
+void *ib_ctree_last(struct ib_ctree *tree, struct ib_ctree_iter *it);
+void *ib_ctree_next(struct ib_ctree *tree, struct ib_ctree_iter *it);
+void *ib_ctree_prev(struct ib_ctree *tree, struct ib_ctree_iter *it);
+
+/* position the iterator to the first data >= key */
+void *ib_ctree_lower_bound(struct ib_ctree *tree, struct ib_ctree_iter *it,
+		const void *data);
+
 
 /*--------------------------------------------------------------------*/
 /* fastbin - fixed size object allocator                              */
@@ -637,6 +1192,297 @@ void* ib_fastbin_new(struct ib_fastbin *fb);
 void ib_fastbin_del(struct ib_fastbin *fb, void *ptr);
 
 
+/*--------------------------------------------------------------------*/
+/* B+tree - ordered map with wide nodes and contiguous integer keys   */
+/*--------------------------------------------------------------------*/
+#ifndef IB_BTREE_KEY
+#define IB_BTREE_KEY        ilong
+#endif
+
+/* keys per node, default makes a key array of four 64-byte lines */
+#ifndef IB_BTREE_KEYS
+#define IB_BTREE_KEYS       (256 / sizeof(IB_BTREE_KEY))
+#endif
+
+typedef IB_BTREE_KEY ib_btree_key;
+
+struct ib_btree_leaf
+{
+	ib_btree_key keys[IB_BTREE_KEYS];    /* sorted keys */
+	void *data[IB_BTREE_KEYS];           /* user data of each key */
+	struct ib_btree_leaf *prev;          /* leaf chaining */
+	struct ib_btree_leaf *next;
+	int count;
+};
+
+struct ib_btree_inner
+{
+	ib_btree_key keys[IB_BTREE_KEYS];    /* child[i + 1] >= keys[i] */
+	void *child[IB_BTREE_KEYS + 1];
+	int count;                           /* number of keys */
+};
+
+struct ib_btree
+{
+	void *root;                  /* leaf if depth is 0 */
+	int depth;                   /* number of inner levels */
+	size_t count;                /* number of keys */
+	struct ib_btree_leaf *head;  /* first leaf */
+	struct ib_btree_leaf *tail;  /* last leaf */
+	struct ib_fastbin leaves;
+	struct ib_fastbin inners;
+};
+
+struct ib_btree_iter
+{
+	struct ib_btree_leaf *leaf;
+	int pos;
+};
+
+#define ib_btree_iter_key(it)   ((it)->leaf->keys[(it)->pos])
+#define ib_btree_iter_data(it)  ((it)->leaf->data[(it)->pos])
+
+void ib_btree_init(struct ib_btree *bt);
+void ib_btree_destroy(struct ib_btree *bt);
+
+/* iteration, returns data at the new position, NULL for end */
+void *ib_btree_first(struct ib_btree *bt, struct ib_btree_iter *it);
+void *ib_btree_last(struct ib_btree *bt, struct ib_btree_iter *it);
+void *ib_btree_next(struct ib_btree *bt, struct ib_btree_iter *it);
+void *ib_btree_prev(struct ib_btree *bt, struct ib_btree_iter *it);
+
+/* it can be NULL, nearest returns the first data with key >= key */
+void *ib_btree_find(struct ib_btree *bt, ib_btree_key key,
+		struct ib_btree_iter *it);
+void *ib_btree_nearest(struct ib_btree *bt, ib_btree_key key,
+		struct ib_btree_iter *it);
+
+/* data must not be NULL, returns NULL for success, otherwise returns
+ * the conflict data with the same key */
+void *ib_btree_add(struct ib_btree *bt, ib_btree_key key, void *data);
+
+/* returns the removed data, NULL for key mismatch */
+void *ib_btree_remove(struct ib_btree *bt, ib_btree_key key);
+
+void ib_btree_clear(struct ib_btree *bt, void (*destroy)(void *data));
+
+
+/*--------------------------------------------------------------------*/
+/* epoch - epoch based memory reclamation for lock-free readers       */
+/*--------------------------------------------------------------------*/
+struct ib_epoch_reader
+{
+	volatile ilong active;              /* entered epoch, 0 for idle */
+	struct ib_epoch_reader *next;
+};
+
+struct ib_epoch_limbo;
+
+struct ib_epoch
+{
+	volatile ilong epoch;               /* global epoch, starts from 1 */
+	struct ib_epoch_reader *readers;    /* registered readers */
+	struct ib_epoch_limbo *head;        /* collected by the lock holder */
+	struct ib_epoch_limbo *tail;
+	struct ib_epoch_limbo * volatile incoming;   /* lock-free retired */
+	struct ib_epoch_limbo * volatile spare;      /* free limbo records */
+	volatile ilong retired;             /* number of retired objects */
+	void (*reclaim)(void *ptr, void *user);
+	void *user;
+	struct ib_fastbin fb;
+	IMUTEX_TYPE lock;
+};
+
+void ib_epoch_init(struct ib_epoch *ep, 
+		void (*reclaim)(void *ptr, void *user), void *user);
+
+/* reclaim everything, all readers must have left */
+void ib_epoch_destroy(struct ib_epoch *ep);
+
+/* each reader thread needs its own registered ib_epoch_reader */
+void ib_epoch_register(struct ib_epoch *ep, struct ib_epoch_reader *r);
+void ib_epoch_unregister(struct ib_epoch *ep, struct ib_epoch_reader *r);
+
+/* objects unlinked before enter may be freed, others will be kept 
+ * until leave, enter/leave can't be nested */
+void ib_epoch_enter(struct ib_epoch *ep, struct ib_epoch_reader *r);
+void ib_epoch_leave(struct ib_epoch *ep, struct ib_epoch_reader *r);
+
+/* ptr must be unreachable for new readers before retire, returns the
+ * number of objects waiting for reclamation. retire is lock-free, and
+ * callers running concurrently must be inside enter/leave (a limbo 
+ * record can't be recycled while they are in) */
+size_t ib_epoch_retire(struct ib_epoch *ep, void *ptr);
+
+/* advance epoch and reclaim objects no reader can hold, returns the
+ * number of reclaimed objects, reclaim() is called without the lock */
+size_t ib_epoch_collect(struct ib_epoch *ep);
+
+
+/*--------------------------------------------------------------------*/
+/* persistent avl - path copying snapshots for lock-free readers      */
+/*--------------------------------------------------------------------*/
+struct ib_pnode
+{
+	struct ib_pnode *left;
+	struct ib_pnode *right;
+	void *data;
+	int height;                /* negative if data has been removed */
+	size_t stamp;              /* write operation which created it */
+};
+
+struct ib_ptree
+{
+	struct ib_pnode * volatile root;    /* current published version */
+	size_t count;
+	size_t stamp;
+	int (*compare)(const void *d1, const void *d2);
+	void (*destroy)(void *data);        /* called for removed data */
+	struct ib_pnode *removed;
+	struct IVECTOR pending;             /* nodes replaced by a writer */
+	struct ib_fastbin pool;
+	struct ib_epoch epoch;
+	IMUTEX_TYPE lock;                   /* serializes writers */
+};
+
+#ifndef IB_PNODE_DEPTH
+#define IB_PNODE_DEPTH    96
+#endif
+
+struct ib_ptree_iter
+{
+	const struct ib_pnode *stack[IB_PNODE_DEPTH];
+	int top;
+};
+
+/* destroy can be NULL, it will be called once the removed data can
+ * no longer be reached by any reader */
+void ib_ptree_init(struct ib_ptree *pt,
+		int (*compare)(const void*, const void*), 
+		void (*destroy)(void *data));
+
+/* no reader can be active, data in the tree will be destroyed too */
+void ib_ptree_destroy(struct ib_ptree *pt);
+
+/* writers (serialized by internal lock): copy the path, publish the new
+ * root atomically and retire replaced nodes, returns NULL for success,
+ * otherwise returns the conflict data with the same key */
+void *ib_ptree_add(struct ib_ptree *pt, void *data);
+
+/* returns 0 for success, -1 for key mismatch */
+int ib_ptree_remove(struct ib_ptree *pt, const void *data);
+
+/* readers: acquire an immutable snapshot, no lock is required */
+#define ib_ptree_register(pt, r)    ib_epoch_register(&(pt)->epoch, r)
+#define ib_ptree_unregister(pt, r)  ib_epoch_unregister(&(pt)->epoch, r)
+
+const struct ib_pnode *ib_ptree_acquire(struct ib_ptree *pt, 
+		struct ib_epoch_reader *reader);
+
+void ib_ptree_release(struct ib_ptree *pt, struct ib_epoch_reader *reader);
+
+/* snapshot queries, data is a temporary structure contains the key */
+void *ib_ptree_find(const struct ib_ptree *pt, 
+		const struct ib_pnode *snapshot, const void *data);
+
+/* in-order iteration with an explicit stack, seek to the first >= key */
+void *ib_ptree_first(const struct ib_pnode *snapshot, 
+		struct ib_ptree_iter *it);
+void *ib_ptree_seek(const struct ib_ptree *pt, 
+		const struct ib_pnode *snapshot, struct ib_ptree_iter *it,
+		const void *data);
+void *ib_ptree_next(struct ib_ptree_iter *it);
+
+
+/*--------------------------------------------------------------------*/
+/* skiplist - concurrent ordered set with the ib_tree interface       */
+/*--------------------------------------------------------------------*/
+#ifndef IB_SKIPLIST_LEVEL
+#define IB_SKIPLIST_LEVEL    16
+#endif
+
+#ifndef IB_SKIPLIST_COLLECT
+#define IB_SKIPLIST_COLLECT  64
+#endif
+
+#ifndef IB_SKIPLIST_BATCH
+#define IB_SKIPLIST_BATCH    32
+#endif
+
+struct ib_slnode;
+
+struct ib_skiplist
+{
+	struct ib_slnode *head;
+	volatile ilong count;
+	volatile ilong seed;
+	int (*compare)(const void *d1, const void *d2);
+	void (*destroy)(void *data);        /* called for removed data */
+	struct ib_slnode * volatile cache[IB_SKIPLIST_LEVEL];  /* free nodes */
+	struct ib_fastbin pools[IB_SKIPLIST_LEVEL];   /* one per height */
+	struct ib_epoch epoch;
+	IMUTEX_TYPE lock;                   /* protects pools */
+};
+
+/* cursor for ordered scans, valid between one enter and leave */
+struct ib_skiplist_iter
+{
+	struct ib_skiplist *sl;
+	struct ib_slnode *node;
+};
+
+/* writers lock the predecessors of a node (lazy skiplist), readers
+ * never lock. Every thread registers an ib_epoch_reader, and all the 
+ * operations below except init/destroy/clear must be called between
+ * ib_skiplist_enter and ib_skiplist_leave. Data returned stays valid 
+ * until leave, destroy (can be NULL) is called for removed data once
+ * no thread can reach it. */
+void ib_skiplist_init(struct ib_skiplist *sl,
+		int (*compare)(const void*, const void*),
+		void (*destroy)(void *data));
+
+/* no thread can be inside, data in the list will be destroyed too */
+void ib_skiplist_destroy(struct ib_skiplist *sl);
+
+#define ib_skiplist_register(sl, r)    ib_epoch_register(&(sl)->epoch, r)
+#define ib_skiplist_unregister(sl, r)  ib_epoch_unregister(&(sl)->epoch, r)
+#define ib_skiplist_enter(sl, r)       ib_epoch_enter(&(sl)->epoch, r)
+#define ib_skiplist_leave(sl, r)       ib_epoch_leave(&(sl)->epoch, r)
+
+void *ib_skiplist_first(struct ib_skiplist *sl);
+void *ib_skiplist_last(struct ib_skiplist *sl);
+
+/* data can be a temporary structure contains the key, it doesn't
+ * need to be in the list, every call searches from the head in 
+ * O(log n), use ib_skiplist_iter for scans */
+void *ib_skiplist_next(struct ib_skiplist *sl, const void *data);
+void *ib_skiplist_prev(struct ib_skiplist *sl, const void *data);
+
+/* position the cursor at the first data >= key (NULL for the first
+ * data), iter_next follows the bottom link in O(1) while the current
+ * node is still in the list, and searches from its key otherwise */
+void *ib_skiplist_iter_seek(struct ib_skiplist_iter *it,
+		struct ib_skiplist *sl, const void *data);
+void *ib_skiplist_iter_next(struct ib_skiplist_iter *it);
+
+void *ib_skiplist_find(struct ib_skiplist *sl, const void *data);
+
+/* first element >= data / > data, NULL if none */
+void *ib_skiplist_lower_bound(struct ib_skiplist *sl, const void *data);
+void *ib_skiplist_upper_bound(struct ib_skiplist *sl, const void *data);
+
+#define ib_skiplist_nearest(sl, data) ib_skiplist_lower_bound(sl, data)
+
+/* returns NULL for success, otherwise returns conflict data */
+void *ib_skiplist_add(struct ib_skiplist *sl, void *data);
+
+/* returns 0 for success, -1 for key mismatch */
+int ib_skiplist_remove(struct ib_skiplist *sl, const void *data);
+
+/* remove everything, no thread can be inside */
+void ib_skiplist_clear(struct ib_skiplist *sl);
+
+
 /*--------------------------------------------------------------------*/
 /* string                                                             */
 /*--------------------------------------------------------------------*/
@@ -715,9 +1561,21 @@ struct ib_hash_table
 	int (*compare)(const void *key1, const void *key2);
 	struct ILISTHEAD head;
 	struct ib_hash_index *index;
+	struct ib_hash_index *old_index;    /* non-NULL while migrating */
+	size_t old_mask;
+	size_t migrate;                     /* old buckets below are moved */
 	struct ib_hash_index init[IB_HASH_INIT_SIZE];
 };
 
+/* bucket of the given hash, looks into the old index for the buckets 
+ * which have not been migrated yet */
+#define ib_hash_locate(ht, hash) \
+	(((ht)->old_index != NULL && ((hash) & (ht)->old_mask) >= (ht)->migrate)? \
+	&((ht)->old_index[(hash) & (ht)->old_mask]) : \
+	&((ht)->index[(hash) & (ht)->index_mask]))
+
+#define ib_hash_migrating(ht) ((ht)->old_index != NULL)
+
 
 void ib_hash_init(struct ib_hash_table *ht, 
 		size_t (*hash)(const void *key),
@@ -758,6 +1616,15 @@ void ib_hash_clear(struct ib_hash_table *ht,
 /* re-index nbytes must be: sizeof(struct ib_hash_index) * n */
 void* ib_hash_swap(struct ib_hash_table *ht, void *index, size_t nbytes);
 
+/* incremental re-index: install the new index (same rule as swap) and 
+ * keep the old one until ib_hash_migrate has moved all of its buckets.
+ * returns 0 for success, -1 if a previous migration is still running */
+int ib_hash_rehash(struct ib_hash_table *ht, void *index, size_t nbytes);
+
+/* move at most n old buckets, returns the old index to free when the 
+ * migration is finished (NULL if running or the old one is builtin) */
+void* ib_hash_migrate(struct ib_hash_table *ht, size_t n);
+
 
 /*--------------------------------------------------------------------*/
 /* fast inline search, compare function will be expanded inline here  */
@@ -765,8 +1632,7 @@ void* ib_hash_swap(struct ib_hash_table *ht, void *index, size_t nbytes);
 #define ib_hash_search(ht, srcnode, result, compare) do { \
 		size_t __hash = (srcnode)->hash; \
 		const void *__key = (srcnode)->key; \
-		struct ib_hash_index *__index = \
-			&((ht)->index[__hash & ((ht)->index_mask)]); \
+		struct ib_hash_index *__index = ib_hash_locate(ht, __hash); \
 		struct ib_node *__anode = __index->avlroot.node; \
 		(result) = NULL; \
 		while (__anode) { \
@@ -784,6 +1650,69 @@ void* ib_hash_swap(struct ib_hash_table *ht, void *index, size_t nbytes);
 	} while (0)
 
 
+/*--------------------------------------------------------------------*/
+/* compact chained hash table (single linked, treeify long chains)    */
+/*--------------------------------------------------------------------*/
+
+/* 3 words per node and 1 word per bucket, instead of 6 and 3 (or more)
+ * in ib_hash_table. a chain longer than IB_CHAIN_TREEIFY turns into an 
+ * avl bucket (tagged with bit 0 of the bucket pointer) to resist hash
+ * flooding, and goes back to a chain at IB_CHAIN_UNTREEIFY entries. */
+#define IB_CHAIN_TREEIFY      8
+#define IB_CHAIN_UNTREEIFY    4
+
+struct ib_chain_node
+{
+	struct ib_chain_node *next;
+	void *key;
+	size_t hash;
+};
+
+struct ib_chain_table
+{
+	size_t count;
+	size_t index_size;
+	size_t index_mask;
+	size_t (*hash)(const void *key);
+	int (*compare)(const void *key1, const void *key2);
+	struct ib_chain_node **index;
+	struct ib_chain_node *init[IB_HASH_INIT_SIZE];
+};
+
+
+void ib_chain_init(struct ib_chain_table *ht,
+		size_t (*hash)(const void *key),
+		int (*compare)(const void *key1, const void *key2));
+
+static inline void ib_chain_node_key(struct ib_chain_table *ht,
+		struct ib_chain_node *node, void *key) {
+	node->key = key;
+	node->hash = ht->hash(key);
+}
+
+/* iteration follows bucket order */
+struct ib_chain_node* ib_chain_node_first(struct ib_chain_table *ht);
+
+struct ib_chain_node* ib_chain_node_next(struct ib_chain_table *ht,
+		struct ib_chain_node *node);
+
+struct ib_chain_node* ib_chain_find(struct ib_chain_table *ht,
+		const struct ib_chain_node *node);
+
+/* returns NULL for success, otherwise returns the conflict node */
+struct ib_chain_node* ib_chain_add(struct ib_chain_table *ht,
+		struct ib_chain_node *node);
+
+void ib_chain_erase(struct ib_chain_table *ht, struct ib_chain_node *node);
+
+void ib_chain_clear(struct ib_chain_table *ht,
+		void (*destroy)(struct ib_chain_node *node));
+
+/* re-index nbytes must be: sizeof(struct ib_chain_node*) * n, returns 
+ * the old index to free (NULL for the builtin one) */
+void* ib_chain_swap(struct ib_chain_table *ht, void *index, size_t nbytes);
+
+
 /*--------------------------------------------------------------------*/
 /* hash map, wrapper of ib_hash_table to support direct key/value     */
 /*--------------------------------------------------------------------*/
@@ -799,6 +1728,10 @@ struct ib_hash_map
 	int insert;
 	int fixed;
 	int builtin;
+	int inline_keys;            /* IB_MAP_INLINE_* */
+	size_t incremental;         /* buckets moved per update, 0 for all */
+	size_t grow;                /* grow when buckets < count * grow / 100 */
+	size_t shrink;              /* shrink if buckets > count * shrink / 100 */
 	void* (*key_copy)(void *key);
 	void (*key_destroy)(void *key);
 	void* (*value_copy)(void *value);
@@ -811,6 +1744,22 @@ struct ib_hash_map
 #define ib_hash_key(entry)     ((entry)->node.key)
 #define ib_hash_value(entry)   ((entry)->value)
 
+/* short keys can be stored inside the entry instead of key_copy: c 
+ * strings shorter than IB_MAP_INLINE, or ib_string keys which fit in
+ * IB_STRING_SSO, key_copy/key_destroy are only used for longer keys */
+#ifndef IB_MAP_INLINE
+#define IB_MAP_INLINE          24
+#endif
+
+#define IB_MAP_INLINE_NONE     0
+#define IB_MAP_INLINE_CSTR     1
+#define IB_MAP_INLINE_STR      2
+
+/* default load policy, shrink should be at least twice of grow, or the
+ * index may be resized back and forth, set shrink to 0 to never shrink */
+#define IB_MAP_GROW            150
+#define IB_MAP_SHRINK          600
+
 void ib_map_init(struct ib_hash_map *hm, size_t (*hash)(const void*),
 		int (*compare)(const void *, const void *));
 
@@ -839,11 +1788,27 @@ void* ib_map_get(struct ib_hash_map *hm, const void *key);
 void ib_map_erase(struct ib_hash_map *hm, struct ib_hash_entry *entry);
 
 
-/* returns 0 for success, -1 for key mismatch */
+/* returns 0 for success, -1 for key mismatch, may shrink the index,
+ * while ib_map_erase never resizes, so it is safe during iteration */
 int ib_map_remove(struct ib_hash_map *hm, const void *key);
 
 void ib_map_clear(struct ib_hash_map *hm);
 
+/* grow the index to hold capacity entries without rehash */
+void ib_map_reserve(struct ib_hash_map *hm, size_t capacity);
+
+/* enable inline keys with IB_MAP_INLINE_CSTR or IB_MAP_INLINE_STR, 
+ * must be called on an empty map, returns 0 for success, -1 if not */
+int ib_map_inline_keys(struct ib_hash_map *hm, int mode);
+
+/* resize the index to fit current entries (ignore 'shrink' threshold) */
+void ib_map_shrink_to_fit(struct ib_hash_map *hm);
+
+/* look up n keys with staged prefetch, out[i] is NULL if keys[i] 
+ * is not found, returns the number of keys found */
+size_t ib_map_find_batch(struct ib_hash_map *hm, void **keys, size_t n,
+		struct ib_hash_entry **out);
+
 
 /*--------------------------------------------------------------------*/
 /* fast inline search template                                        */
@@ -851,8 +1816,7 @@ void ib_map_clear(struct ib_hash_map *hm);
 
 #define ib_map_search(hm, srckey, hash_func, cmp_func, result) do { \
 		size_t __hash = (hash_func)(srckey); \
-		struct ib_hash_index *__index = \
-			&((hm)->ht.index[__hash & ((hm)->ht.index_mask)]); \
+		struct ib_hash_index *__index = ib_hash_locate(&(hm)->ht, __hash); \
 		struct ib_node *__anode = __index->avlroot.node; \
 		(result) = NULL; \
 		while (__anode) { \
@@ -874,6 +1838,60 @@ void ib_map_clear(struct ib_hash_map *hm);
 	}	while (0)
 
 
+/* batched search, keys are processed in groups of IB_MAP_BATCH: hash 
+ * all and prefetch the buckets, load the roots and prefetch them, then
+ * walk the trees, so the cache misses of a group overlap each other */
+#define IB_MAP_BATCH    16
+
+#define ib_map_search_batch(hm, keys, n, hash_func, cmp_func, out) do { \
+		size_t __hashes[IB_MAP_BATCH]; \
+		void *__slots[IB_MAP_BATCH]; \
+		size_t __pos, __i, __m; \
+		for (__pos = 0; __pos < (size_t)(n); __pos += __m) { \
+			__m = (size_t)(n) - __pos; \
+			if (__m > IB_MAP_BATCH) __m = IB_MAP_BATCH; \
+			for (__i = 0; __i < __m; __i++) { \
+				size_t __hash = (hash_func)((keys)[__pos + __i]); \
+				struct ib_hash_index *__index = \
+					ib_hash_locate(&(hm)->ht, __hash); \
+				IB_PREFETCH(__index); \
+				__hashes[__i] = __hash; \
+				__slots[__i] = __index; \
+			} \
+			for (__i = 0; __i < __m; __i++) { \
+				struct ib_hash_index *__index = \
+					(struct ib_hash_index*)__slots[__i]; \
+				struct ib_node *__anode = __index->avlroot.node; \
+				if (__anode) IB_PREFETCH(__anode); \
+				__slots[__i] = __anode; \
+			} \
+			for (__i = 0; __i < __m; __i++) { \
+				struct ib_node *__anode = (struct ib_node*)__slots[__i]; \
+				size_t __hash = __hashes[__i]; \
+				(out)[__pos + __i] = NULL; \
+				while (__anode) { \
+					struct ib_hash_node *__snode = \
+						IB_ENTRY(__anode, struct ib_hash_node, avlnode); \
+					size_t __shash = __snode->hash; \
+					if (__hash == __shash) { \
+						int __hc = (cmp_func)((keys)[__pos + __i], \
+								__snode->key); \
+						if (__hc == 0) { \
+							(out)[__pos + __i] = IB_ENTRY(__snode, \
+									struct ib_hash_entry, node); \
+							break; \
+						} \
+						__anode = (__hc < 0)? __anode->left:__anode->right; \
+					}	else { \
+						__anode = (__hash < __shash)? \
+							__anode->left : __anode->right; \
+					} \
+				} \
+			} \
+		} \
+	}	while (0)
+
+
 /*--------------------------------------------------------------------*/
 /* common type hash                                                   */
 /*--------------------------------------------------------------------*/
@@ -896,6 +1914,297 @@ struct ib_hash_entry *ib_map_find_str(struct ib_hash_map *hm, const ib_string *k
 struct ib_hash_entry *ib_map_find_cstr(struct ib_hash_map *hm, const char *key);
 
 
+/*--------------------------------------------------------------------*/
+/* flat map - open addressing with control byte groups                */
+/*--------------------------------------------------------------------*/
+
+/* every slot has a control byte: 0x80 for empty, 0xfe for deleted, or 
+ * the low 7 bits of the hash for a used slot. lookup probes groups of 
+ * 16 control bytes at once (sse2 / neon / scalar fallback), keys and 
+ * values are stored inline, so add/set/reserve can move entries and 
+ * invalidate every entry pointer obtained before. the functions mirror
+ * ib_map_* under the ib_flat_ prefix, but it is not a drop-in for the
+ * hash map by typedef: entries are struct ib_flat_entry, accessed with
+ * ib_flat_key/ib_flat_value instead of ib_hash_key/ib_hash_value. */
+#define IB_FLAT_GROUP     16
+
+struct ib_flat_entry
+{
+	void *key;
+	void *value;
+};
+
+struct ib_flat_map
+{
+	size_t count;
+	size_t capacity;            /* number of slots, 0 or power of 2 */
+	size_t deleted;             /* number of tombstones */
+	size_t growth;              /* empty slots left before rehash */
+	int insert;
+	IUINT8 *ctrl;
+	struct ib_flat_entry *slots;
+	size_t (*hash)(const void *key);
+	int (*compare)(const void *key1, const void *key2);
+	void* (*key_copy)(void *key);
+	void (*key_destroy)(void *key);
+	void* (*value_copy)(void *value);
+	void (*value_destroy)(void *value);
+};
+
+
+#define ib_flat_key(entry)     ((entry)->key)
+#define ib_flat_value(entry)   ((entry)->value)
+
+void ib_flat_init(struct ib_flat_map *fm, size_t (*hash)(const void*),
+		int (*compare)(const void *, const void *));
+
+void ib_flat_destroy(struct ib_flat_map *fm);
+
+/* iteration follows slot order, erase during iteration is allowed */
+struct ib_flat_entry* ib_flat_first(struct ib_flat_map *fm);
+struct ib_flat_entry* ib_flat_last(struct ib_flat_map *fm);
+
+struct ib_flat_entry* ib_flat_next(struct ib_flat_map *fm,
+		struct ib_flat_entry *n);
+struct ib_flat_entry* ib_flat_prev(struct ib_flat_map *fm,
+		struct ib_flat_entry *n);
+
+struct ib_flat_entry* ib_flat_find(struct ib_flat_map *fm, const void *key);
+void* ib_flat_lookup(struct ib_flat_map *fm, const void *key, void *defval);
+
+struct ib_flat_entry* ib_flat_add(struct ib_flat_map *fm,
+		void *key, void *value, int *success);
+
+struct ib_flat_entry* ib_flat_set(struct ib_flat_map *fm,
+		void *key, void *value);
+
+void* ib_flat_get(struct ib_flat_map *fm, const void *key);
+
+void ib_flat_erase(struct ib_flat_map *fm, struct ib_flat_entry *entry);
+
+/* returns 0 for success, -1 for key mismatch */
+int ib_flat_remove(struct ib_flat_map *fm, const void *key);
+
+void ib_flat_clear(struct ib_flat_map *fm);
+
+/* make room for capacity entries without further rehash */
+void ib_flat_reserve(struct ib_flat_map *fm, size_t capacity);
+
+
+/*--------------------------------------------------------------------*/
+/* shard map - concurrent hash map with a rwlock per ib_hash_map      */
+/*--------------------------------------------------------------------*/
+
+/* keys are partitioned into shards by the high bits of the (mixed) 
+ * hash, every shard has its own lock, fastbin and index, so a resize
+ * only blocks one shard. entries never leave the lock: values are 
+ * returned by copy, through value_copy if it has been set. */
+#define IB_SHARD_DEFAULT    16
+#define IB_SHARD_MAX        4096
+
+struct ib_shard
+{
+	IRWLOCK_TYPE lock;
+	struct ib_hash_map map;
+};
+
+struct ib_shard_map
+{
+	size_t nshards;             /* power of 2 */
+	size_t (*hash)(const void *key);
+	void* (*value_copy)(void *value);
+	struct ib_shard *shards;
+};
+
+/* nshards will be rounded up to power of 2, 0 for IB_SHARD_DEFAULT,
+ * returns 0 for success, -1 for out of memory */
+int ib_shard_init(struct ib_shard_map *sm, size_t nshards,
+		size_t (*hash)(const void*), 
+		int (*compare)(const void *, const void *));
+
+void ib_shard_destroy(struct ib_shard_map *sm);
+
+/* set copy/destroy functions of every shard, call it before use */
+void ib_shard_config(struct ib_shard_map *sm, 
+		void* (*key_copy)(void *key), void (*key_destroy)(void *key),
+		void* (*value_copy)(void *value), void (*value_destroy)(void *value));
+
+/* returns 0 and copies the value out if found, -1 for not found */
+int ib_shard_get(struct ib_shard_map *sm, const void *key, void **value);
+
+/* returns 1 if inserted, 0 if an existing value has been updated */
+int ib_shard_set(struct ib_shard_map *sm, void *key, void *value);
+
+/* returns 1 if inserted, 0 if key exists (value left unchanged) */
+int ib_shard_add(struct ib_shard_map *sm, void *key, void *value);
+
+/* returns 0 for success, -1 for key mismatch */
+int ib_shard_remove(struct ib_shard_map *sm, const void *key);
+
+/* compute if absent: create(key, user) is called under the shard write 
+ * lock only if key is missing, and must not access the shard map. 
+ * the created value is stored as is (without value_copy), then the 
+ * value (existing or created) is copied out like ib_shard_get.
+ * returns 1 if created, 0 if existing, -1 if create returned NULL */
+int ib_shard_compute(struct ib_shard_map *sm, void *key,
+		void* (*create)(const void *key, void *user), void *user,
+		void **value);
+
+/* number of entries, shards are counted one by one (not a snapshot) */
+size_t ib_shard_count(struct ib_shard_map *sm);
+
+/* visit every entry under shard read locks, visit must not modify */
+void ib_shard_foreach(struct ib_shard_map *sm, 
+		void (*visit)(void *key, void *value, void *user), void *user);
+
+void ib_shard_clear(struct ib_shard_map *sm);
+
+
+/*--------------------------------------------------------------------*/
+/* dense map - insertion ordered entry array with a compact index     */
+/*--------------------------------------------------------------------*/
+
+/* entries are appended to a dense array in insertion order, the open
+ * addressing index only stores entry positions in 1/2/4/8 bytes each
+ * depending on the size. erased entries leave holes which are removed
+ * by compaction, add/set/remove/reserve/compact may move entries and
+ * invalidate entry pointers, ib_dense_erase never moves anything. */
+struct ib_dense_entry
+{
+	void *key;
+	void *value;
+	size_t hash;
+};
+
+struct ib_dense_map
+{
+	size_t count;               /* live entries */
+	size_t used;                /* entries appended, including holes */
+	size_t capacity;            /* entry array size */
+	size_t index_size;          /* index slots, power of 2 */
+	int width;                  /* bytes per index slot */
+	int insert;
+	struct ib_dense_entry *entries;
+	void *index;
+	size_t (*hash)(const void *key);
+	int (*compare)(const void *key1, const void *key2);
+	void* (*key_copy)(void *key);
+	void (*key_destroy)(void *key);
+	void* (*value_copy)(void *value);
+	void (*value_destroy)(void *value);
+};
+
+
+#define ib_dense_key(entry)     ((entry)->key)
+#define ib_dense_value(entry)   ((entry)->value)
+
+void ib_dense_init(struct ib_dense_map *dm, size_t (*hash)(const void*),
+		int (*compare)(const void *, const void *));
+
+void ib_dense_destroy(struct ib_dense_map *dm);
+
+/* iteration in insertion order, a linear scan of the entry array */
+struct ib_dense_entry* ib_dense_first(struct ib_dense_map *dm);
+struct ib_dense_entry* ib_dense_last(struct ib_dense_map *dm);
+
+struct ib_dense_entry* ib_dense_next(struct ib_dense_map *dm,
+		struct ib_dense_entry *n);
+struct ib_dense_entry* ib_dense_prev(struct ib_dense_map *dm,
+		struct ib_dense_entry *n);
+
+struct ib_dense_entry* ib_dense_find(struct ib_dense_map *dm, 
+		const void *key);
+void* ib_dense_lookup(struct ib_dense_map *dm, const void *key, 
+		void *defval);
+
+struct ib_dense_entry* ib_dense_add(struct ib_dense_map *dm,
+		void *key, void *value, int *success);
+
+struct ib_dense_entry* ib_dense_set(struct ib_dense_map *dm,
+		void *key, void *value);
+
+void* ib_dense_get(struct ib_dense_map *dm, const void *key);
+
+void ib_dense_erase(struct ib_dense_map *dm, struct ib_dense_entry *entry);
+
+/* returns 0 for success, -1 for key mismatch, compacts the array when 
+ * holes outnumber live entries */
+int ib_dense_remove(struct ib_dense_map *dm, const void *key);
+
+void ib_dense_clear(struct ib_dense_map *dm);
+
+/* make room for capacity entries without further resize */
+void ib_dense_reserve(struct ib_dense_map *dm, size_t capacity);
+
+/* remove holes and fit the arrays to the live entries */
+void ib_dense_compact(struct ib_dense_map *dm);
+
+
+/*--------------------------------------------------------------------*/
+/* int map - integer keys, linear probing, no function pointers       */
+/*--------------------------------------------------------------------*/
+
+/* 32/64 bit keys and pointer sized values are stored unboxed in two
+ * parallel arrays. slots holding the reserved 'empty' key are free, 
+ * the empty key itself can still be stored in a side slot. erasing 
+ * uses backward shift (no tombstones), so insert/remove/reserve can 
+ * move values and invalidate positions and value pointers. */
+struct ib_int_map
+{
+	size_t count;               /* including the side slot */
+	size_t capacity;            /* number of slots, 0 or power of 2 */
+	IUINT64 empty;              /* reserved key for free slots */
+	int has_empty;              /* side slot in use */
+	void *empty_value;          /* value of the side slot */
+	IUINT64 *keys;
+	void **values;
+};
+
+/* iteration positions: 0 ~ capacity - 1 for slots, capacity for the
+ * side slot, ib_int_end(im) for the end, eg:
+ *     for (pos = ib_int_first(im); pos != ib_int_end(im); 
+ *          pos = ib_int_next(im, pos)) { ib_int_key(im, pos) ... }
+ */
+#define ib_int_end(im)          ((im)->capacity + 1)
+#define ib_int_key(im, pos) \
+	(((pos) < (im)->capacity)? (im)->keys[pos] : (im)->empty)
+#define ib_int_value(im, pos) \
+	(((pos) < (im)->capacity)? (im)->values[pos] : (im)->empty_value)
+
+/* empty is the reserved key, eg. 0 or ~((IUINT64)0) */
+void ib_int_init(struct ib_int_map *im, IUINT64 empty);
+
+void ib_int_destroy(struct ib_int_map *im);
+
+size_t ib_int_first(const struct ib_int_map *im);
+size_t ib_int_next(const struct ib_int_map *im, size_t pos);
+
+/* returns the address of the value, NULL for not found */
+void** ib_int_find(const struct ib_int_map *im, IUINT64 key);
+
+void* ib_int_lookup(const struct ib_int_map *im, IUINT64 key, void *defval);
+
+/* returns 1 if inserted, 0 if an existing value has been updated */
+int ib_int_set(struct ib_int_map *im, IUINT64 key, void *value);
+
+/* returns 1 if inserted, 0 if key exists (value left unchanged) */
+int ib_int_add(struct ib_int_map *im, IUINT64 key, void *value);
+
+/* set n keys at once (values can be NULL for all NULL), the table is 
+ * sized once up front, returns the number of new keys */
+size_t ib_int_set_bulk(struct ib_int_map *im, const IUINT64 *keys, 
+		void *const *values, size_t n);
+
+/* returns 0 for success, -1 for not found */
+int ib_int_remove(struct ib_int_map *im, IUINT64 key);
+
+void ib_int_clear(struct ib_int_map *im);
+
+/* make room for capacity keys without further rehash */
+void ib_int_reserve(struct ib_int_map *im, size_t capacity);
+
+
+
 
 #ifdef __cplusplus
 }
@@ -19,7 +19,7 @@ static inline struct rb_node *_rb_node_walk(struct rb_node *node, int LEFT)
 	else {
 		while (1) {
 			struct rb_node *last = node;
-			node = node->parent;
+			node = rb_parent(node);
 			if (node == NULL) break;
 			if (node->child[RIGHT] == last) break;
 		}
@@ -68,27 +68,28 @@ _ib_child_replace(struct rb_node *oldnode, struct rb_node *newnode,
 		root->node = newnode;
 }
 
-#if 1
-int rb_node_rotate_times = 0;
-#endif
-
 static inline struct rb_node *
-_rb_node_rotate(struct rb_node *node, struct ib_root *root, int LEFT)
+_rb_node_rotate(struct rb_node *node, struct ib_root *root, int LEFT,
+		const struct rb_augment *aug)
 {
 	int RIGHT = 1 - LEFT;
 	struct rb_node *right = node->child[RIGHT];
-	struct rb_node *parent = node->parent;
+	struct rb_node *parent = rb_parent(node);
 	node->child[RIGHT] = right->child[LEFT];
-#if 0
-	rb_node_rotate_times++;
+#ifdef RB_TREE_STATS
+	root->rotations++;
 #endif
 	ASSERTION(node && right);
 	if (right->child[LEFT]) 
-		right->child[LEFT]->parent = node;
+		rb_set_parent(right->child[LEFT], node);
 	right->child[LEFT] = node;
-	right->parent = parent;
+	rb_set_parent(right, parent);
 	_ib_child_replace(node, right, parent, root);
-	node->parent = right;
+	rb_set_parent(node, right);
+	if (aug) {
+		aug->update(node);
+		aug->update(right);
+	}
 	return right;
 }
 
@@ -96,14 +97,14 @@ _rb_node_rotate(struct rb_node *node, struct ib_root *root, int LEFT)
 void rb_node_replace(struct rb_node *victim, struct rb_node *newnode,
 		struct ib_root *root)
 {
-	struct rb_node *parent = victim->parent;
+	struct rb_node *parent = rb_parent(victim);
 	_ib_child_replace(victim, newnode, parent, root);
-	if (victim->child[0]) victim->child[0]->parent = newnode;
-	if (victim->child[1]) victim->child[1]->parent = newnode;
+	if (victim->child[0]) rb_set_parent(victim->child[0], newnode);
+	if (victim->child[1]) rb_set_parent(victim->child[1], newnode);
 	newnode->child[0] = victim->child[0];
 	newnode->child[1] = victim->child[1];
-	newnode->parent = victim->parent;
-	newnode->color = victim->color;
+	rb_set_parent(newnode, rb_parent(victim));
+	rb_set_color(newnode, rb_color(victim));
 }
 
 
@@ -114,106 +115,119 @@ void rb_node_replace(struct rb_node *victim, struct rb_node *newnode,
 static inline struct rb_node*
 _rb_node_insert_update(struct ib_root *root,
 		struct rb_node *node, struct rb_node *parent, 
-		struct rb_node *gparent, int LEFT)
+		struct rb_node *gparent, int LEFT, const struct rb_augment *aug)
 {
 	int RIGHT = 1 - LEFT;
 	struct rb_node *uncle = gparent->child[RIGHT];
 	if (uncle) {
-		if (uncle->color == IB_RED) {
-			uncle->color = IB_BLACK;
-			parent->color = IB_BLACK;
-			gparent->color = IB_RED;
+		if (rb_color(uncle) == IB_RED) {
+			rb_set_color(uncle, IB_BLACK);
+			rb_set_color(parent, IB_BLACK);
+			rb_set_color(gparent, IB_RED);
 			return gparent;
 		}
 	}
 	if (parent->child[RIGHT] == node) {
 		struct rb_node *tmp;
-		_rb_node_rotate(parent, root, LEFT);
+		_rb_node_rotate(parent, root, LEFT, aug);
 		tmp = parent;
 		parent = node;
 		node = tmp;
 	}
-	parent->color = IB_BLACK;
-	gparent->color = IB_RED;
-	_rb_node_rotate(gparent, root, RIGHT);
+	rb_set_color(parent, IB_BLACK);
+	rb_set_color(gparent, IB_RED);
+	_rb_node_rotate(gparent, root, RIGHT, aug);
 	return node;
 }
 
-void rb_node_post_insert(struct rb_node *node, struct ib_root *root)
+/* augmented data must be propagated before rebalancing, so every 
+ * rotation works on a consistent tree and keeps it consistent */
+static inline void
+_rb_node_post_insert(struct rb_node *node, struct ib_root *root,
+		const struct rb_augment *aug)
 {
-	node->color = IB_RED;
+	rb_set_color(node, IB_RED);
+	if (aug) {
+		rb_node_augment_propagate(node, aug);
+	}
 	while (1) {
 		struct rb_node *parent, *gparent;
-		parent = node->parent;
+		parent = rb_parent(node);
 		if (parent == NULL) break;
-		if (parent->color != IB_RED) break;
-		gparent = parent->parent;
+		if (rb_color(parent) != IB_RED) break;
+		gparent = rb_parent(parent);
 		if (parent == gparent->child[0]) {
-			node = _rb_node_insert_update(root, node, parent, gparent, 0);
+			node = _rb_node_insert_update(root, node, parent, gparent, 
+					0, aug);
 		}
 		else {
-			node = _rb_node_insert_update(root, node, parent, gparent, 1);
+			node = _rb_node_insert_update(root, node, parent, gparent, 
+					1, aug);
 		}
 	}
-	root->node->color = IB_BLACK;
+	rb_set_color(root->node, IB_BLACK);
 }
 
 static inline struct rb_node*
 _rb_node_erase_update(struct rb_node **child, struct rb_node *parent, 
-		struct ib_root *root, int LEFT)
+		struct ib_root *root, int LEFT, const struct rb_augment *aug)
 {
 	int RIGHT = 1 - LEFT;
 	struct rb_node *node = child[0];
 	struct rb_node *sibling = parent->child[RIGHT];
 	ASSERTION(sibling);
-	if (sibling->color == IB_RED) {
-		sibling->color = IB_BLACK;
-		parent->color = IB_RED;
-		_rb_node_rotate(parent, root, LEFT);
+	if (rb_color(sibling) == IB_RED) {
+		rb_set_color(sibling, IB_BLACK);
+		rb_set_color(parent, IB_RED);
+		_rb_node_rotate(parent, root, LEFT, aug);
 		sibling = parent->child[RIGHT];
 	}
-	if (((!sibling->child[0]) || sibling->child[0]->color == IB_BLACK) &&
-		((!sibling->child[1]) || sibling->child[1]->color == IB_BLACK)) {
-		sibling->color = IB_RED;
+	if (((!sibling->child[0]) || rb_color(sibling->child[0]) == IB_BLACK) &&
+		((!sibling->child[1]) || rb_color(sibling->child[1]) == IB_BLACK)) {
+		rb_set_color(sibling, IB_RED);
 		node = parent;
 		child[0] = node;
-		return node->parent;
+		return rb_parent(node);
 	}
-	if ((!sibling->child[RIGHT]) || sibling->child[RIGHT]->color != IB_RED) {
+	if ((!sibling->child[RIGHT]) || 
+		rb_color(sibling->child[RIGHT]) != IB_RED) {
 		struct rb_node *sl = sibling->child[LEFT];
-		if (sl) sl->color = IB_BLACK;
-		sibling->color = IB_RED;
-		_rb_node_rotate(sibling, root, RIGHT);
+		if (sl) rb_set_color(sl, IB_BLACK);
+		rb_set_color(sibling, IB_RED);
+		_rb_node_rotate(sibling, root, RIGHT, aug);
 		sibling = parent->child[RIGHT];
 	}
-	sibling->color = parent->color;
-	parent->color = IB_BLACK;
+	rb_set_color(sibling, rb_color(parent));
+	rb_set_color(parent, IB_BLACK);
 	if (sibling->child[RIGHT])
-		sibling->child[RIGHT]->color = IB_BLACK;
-	_rb_node_rotate(parent, root, LEFT);
+		rb_set_color(sibling->child[RIGHT], IB_BLACK);
+	_rb_node_rotate(parent, root, LEFT, aug);
 	child[0] = node;
 	return NULL;
 }
 
 static inline void 
-_rb_node_rebalance(struct rb_node *parent, struct ib_root *root)
+_rb_node_rebalance(struct rb_node *parent, struct ib_root *root,
+		const struct rb_augment *aug)
 {
 	struct rb_node *node = NULL;
 	while (parent) {
-		if (node != NULL && node->color == IB_RED) break;
+		if (node != NULL && rb_color(node) == IB_RED) break;
 		if (parent->child[0] == node) {
-			parent = _rb_node_erase_update(&node, parent, root, 0);
+			parent = _rb_node_erase_update(&node, parent, root, 0, aug);
 		}
 		else {
-			parent = _rb_node_erase_update(&node, parent, root, 1);
+			parent = _rb_node_erase_update(&node, parent, root, 1, aug);
 		}
 	}
 	if (node) {
-		node->color = IB_BLACK;
+		rb_set_color(node, IB_BLACK);
 	}
 }
 
-void rb_node_erase(struct rb_node *node, struct ib_root *root)
+static inline void
+_rb_node_erase(struct rb_node *node, struct ib_root *root,
+		const struct rb_augment *aug)
 {
 	struct rb_node *child, *parent;
 	unsigned int color;
@@ -225,45 +239,613 @@ void rb_node_erase(struct rb_node *node, struct ib_root *root)
 		while ((left = node->child[IB_LEFT]) != NULL)
 			node = left;
 		child = node->child[IB_RIGHT];
-		parent = node->parent;
-		color = node->color;
+		parent = rb_parent(node);
+		color = rb_color(node);
 		if (child) {
-			child->parent = parent;
+			rb_set_parent(child, parent);
 		}
 		_ib_child_replace(node, child, parent, root);
-		if (node->parent == old)
+		if (rb_parent(node) == old)
 			parent = node;
 		node->child[0] = old->child[0];
 		node->child[1] = old->child[1];
-		node->parent = old->parent;
-		node->color = old->color;
-		_ib_child_replace(old, node, old->parent, root);
-		old->child[IB_LEFT]->parent = node;
+		rb_set_parent(node, rb_parent(old));
+		rb_set_color(node, rb_color(old));
+		_ib_child_replace(old, node, rb_parent(old), root);
+		rb_set_parent(old->child[IB_LEFT], node);
 		if (old->child[IB_RIGHT]) {
-			old->child[IB_RIGHT]->parent = node;
+			rb_set_parent(old->child[IB_RIGHT], node);
 		}
 	}
 	else {
 		child = node->child[(node->child[0] == NULL)? 1 : 0];
-		parent = node->parent;
-		color = node->color;
+		parent = rb_parent(node);
+		color = rb_color(node);
 		/* printf("delete %d child=%d\n", ib_value(node), child? 1:0); */
 		_ib_child_replace(node, child, parent, root);
 		if (child) {
-			child->parent = parent;
+			rb_set_parent(child, parent);
 		}
 	}
 	/* if node has only one child, it must be red, and this node must 
 	 * be black, therefore just replace the node with its child.
 	 */
+	if (aug && parent) {
+		rb_node_augment_propagate(parent, aug);
+	}
 	if (child) {
-		ASSERTION(child->color == IB_RED);
-		child->color = IB_BLACK;
+		ASSERTION(rb_color(child) == IB_RED);
+		rb_set_color(child, IB_BLACK);
 	}
 	else if (color == IB_BLACK && parent) {
-		_rb_node_rebalance(parent, root);
+		_rb_node_rebalance(parent, root, aug);
+	}
+}
+
+void rb_node_post_insert(struct rb_node *node, struct ib_root *root)
+{
+	_rb_node_post_insert(node, root, NULL);
+}
+
+void rb_node_erase(struct rb_node *node, struct ib_root *root)
+{
+	_rb_node_erase(node, root, NULL);
+}
+
+/* rbtree nodes destroy: fast tear down the whole tree */
+struct rb_node *rb_node_tear(struct ib_root *root, struct rb_node **next)
+{
+	struct rb_node *node = *next;
+	struct rb_node *parent;
+	if (node == NULL) {
+		if (root->node == NULL) 
+			return NULL;
+		node = root->node;
+	}
+	/* sink down to the leaf */
+	while (1) {
+		if (node->child[0]) node = node->child[0];
+		else if (node->child[1]) node = node->child[1];
+		else break;
+	}
+	/* tear down one leaf */
+	parent = rb_parent(node);
+	if (parent == NULL) {
+		*next = NULL;
+		root->node = NULL;
+		return node;
+	}
+	parent->child[(parent->child[0] == node)? 0 : 1] = NULL;
+	*next = parent;
+	return node;
+}
+
+
+/*--------------------------------------------------------------------*/
+/* rbtree - augmented tree                                            */
+/*--------------------------------------------------------------------*/
+
+void rb_node_post_insert_augmented(struct rb_node *node, 
+		struct ib_root *root, const struct rb_augment *aug)
+{
+	_rb_node_post_insert(node, root, aug);
+}
+
+void rb_node_erase_augmented(struct rb_node *node, struct ib_root *root,
+		const struct rb_augment *aug)
+{
+	_rb_node_erase(node, root, aug);
+}
+
+/* update augmented data from node up to the root */
+void rb_node_augment_propagate(struct rb_node *node,
+		const struct rb_augment *aug)
+{
+	for (; node; node = rb_parent(node)) {
+		aug->update(node);
+	}
+}
+
+#ifndef RB_NODE_MAX_DEPTH
+#define RB_NODE_MAX_DEPTH	128
+#endif
+
+/* range aggregate: calls fold() with O(log n) disjoint pieces in order */
+void rb_node_aggregate(struct ib_root *root, const void *lo, const void *hi,
+		int (*compare)(const void *key, const struct rb_node *node),
+		void (*fold)(void *ctx, struct rb_node *node, int whole),
+		void *ctx)
+{
+	struct rb_node *stack[RB_NODE_MAX_DEPTH];
+	struct rb_node *split = root->node;
+	struct rb_node *node;
+	int top = 0;
+	/* find the topmost node inside the range */
+	while (split) {
+		if (lo && compare(lo, split) > 0) split = split->child[1];
+		else if (hi && compare(hi, split) < 0) split = split->child[0];
+		else break;
+	}
+	if (split == NULL) return;
+	/* left boundary: pieces are found top-down but must fold bottom-up */
+	for (node = split->child[0]; node; ) {
+		if (lo == NULL || compare(lo, node) <= 0) {
+			ASSERTION(top < RB_NODE_MAX_DEPTH);
+			stack[top++] = node;
+			node = node->child[0];
+		}	else {
+			node = node->child[1];
+		}
 	}
+	while (top > 0) {
+		node = stack[--top];
+		fold(ctx, node, 0);
+		if (node->child[1]) fold(ctx, node->child[1], 1);
+	}
+	fold(ctx, split, 0);
+	/* right boundary */
+	for (node = split->child[1]; node; ) {
+		if (hi == NULL || compare(hi, node) >= 0) {
+			if (node->child[0]) fold(ctx, node->child[0], 1);
+			fold(ctx, node, 0);
+			node = node->child[1];
+		}	else {
+			node = node->child[0];
+		}
+	}
+}
+
+
+/*--------------------------------------------------------------------*/
+/* rbtree - friendly interface                                        */
+/*--------------------------------------------------------------------*/
+#ifdef RB_TREE_STATS
+static void _rb_tree_probe(struct rb_tree *tree, size_t depth)
+{
+	tree->stats.searches++;
+	tree->stats.compares += depth;
+	if (depth >= RB_TREE_STATS_DEPTH) depth = RB_TREE_STATS_DEPTH - 1;
+	tree->stats.depth[depth]++;
+}
+#define RB_TREE_PROBE(tree, depth)  _rb_tree_probe(tree, depth)
+#define RB_TREE_COUNT(tree, field, n)  ((tree)->stats.field += (n))
+#else
+#define RB_TREE_PROBE(tree, depth)  ((void)(depth))
+#define RB_TREE_COUNT(tree, field, n)  ((void)0)
+#endif
+
+void rb_tree_init(struct rb_tree *tree,
+	int (*compare)(const void*, const void*), size_t size, size_t offset)
+{
+	tree->root.node = NULL;
+	tree->offset = offset;
+	tree->size = size;
+	tree->count = 0;
+	tree->compare = compare;
+	tree->augment = NULL;
+	RB_ROOT_STATS_INIT(&tree->root);
+#ifdef RB_TREE_STATS
+	rb_tree_stats_reset(tree);
+#endif
+}
+
+void rb_tree_init_augment(struct rb_tree *tree,
+		int (*compare)(const void*, const void*), size_t size, size_t offset,
+		const struct rb_augment *augment)
+{
+	rb_tree_init(tree, compare, size, offset);
+	tree->augment = augment;
+}
+
+void *rb_tree_first(struct rb_tree *tree)
+{
+	struct rb_node *node = rb_node_first(&tree->root);
+	if (!node) return NULL;
+	return rb_node2DATA(node, tree->offset);
+}
+
+void *rb_tree_last(struct rb_tree *tree)
+{
+	struct rb_node *node = rb_node_last(&tree->root);
+	if (!node) return NULL;
+	return rb_node2DATA(node, tree->offset);
 }
 
+void *rb_tree_next(struct rb_tree *tree, void *data)
+{
+	struct rb_node *nn;
+	if (!data) return NULL;
+	nn = IB_DATA2NODE(data, tree->offset);
+	nn = rb_node_next(nn);
+	if (!nn) return NULL;
+	return rb_node2DATA(nn, tree->offset);
+}
+
+void *rb_tree_prev(struct rb_tree *tree, void *data)
+{
+	struct rb_node *nn;
+	if (!data) return NULL;
+	nn = IB_DATA2NODE(data, tree->offset);
+	nn = rb_node_prev(nn);
+	if (!nn) return NULL;
+	return rb_node2DATA(nn, tree->offset);
+}
+
+/* require a temporary user structure (data) which contains the key */
+void *rb_tree_find(struct rb_tree *tree, const void *data)
+{
+	struct rb_node *n = tree->root.node;
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	size_t depth = 0;
+	while (n) {
+		void *nd = rb_node2DATA(n, offset);
+		int hr = compare(data, nd);
+		depth++;
+		if (hr == 0) {
+			RB_TREE_PROBE(tree, depth);
+			return nd;
+		}
+		n = n->child[(hr < 0)? 0 : 1];
+	}
+	RB_TREE_PROBE(tree, depth);
+	return NULL;
+}
+
+/* returns the matched data or the last node visited in the search */
+void *rb_tree_nearest(struct rb_tree *tree, const void *data)
+{
+	struct rb_node *n = tree->root.node;
+	struct rb_node *p = NULL;
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	size_t depth = 0;
+	while (n) {
+		void *nd = rb_node2DATA(n, offset);
+		int hr = compare(data, nd);
+		depth++;
+		p = n;
+		if (hr == 0) break;
+		n = n->child[(hr < 0)? 0 : 1];
+	}
+	RB_TREE_PROBE(tree, depth);
+	return (p)? rb_node2DATA(p, offset) : NULL;
+}
+
+/* returns NULL for success, otherwise returns conflict node with same key */
+void *rb_tree_add(struct rb_tree *tree, void *data)
+{
+	struct rb_node **link = &tree->root.node;
+	struct rb_node *parent = NULL;
+	struct rb_node *node = IB_DATA2NODE(data, tree->offset);
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	size_t depth = 0;
+	while (link[0]) {
+		void *pd;
+		int hr;
+		parent = link[0];
+		pd = rb_node2DATA(parent, offset);
+		hr = compare(data, pd);
+		depth++;
+		if (hr == 0) {
+			RB_TREE_PROBE(tree, depth);
+			return pd;
+		}
+		link = &(parent->child[(hr < 0)? 0 : 1]);
+	}
+	rb_node_link(node, parent, link);
+	if (tree->augment == NULL) {
+		rb_node_post_insert(node, &tree->root);
+	}	else {
+		rb_node_post_insert_augmented(node, &tree->root, tree->augment);
+	}
+	RB_TREE_PROBE(tree, depth);
+	RB_TREE_COUNT(tree, inserts, 1);
+	tree->count++;
+	return NULL;
+}
 
+void rb_tree_remove(struct rb_tree *tree, void *data)
+{
+	struct rb_node *node = IB_DATA2NODE(data, tree->offset);
+	if (!rb_node_empty(node)) {
+		if (tree->augment == NULL) {
+			rb_node_erase(node, &tree->root);
+		}	else {
+			rb_node_erase_augmented(node, &tree->root, tree->augment);
+		}
+		rb_node_init(node);
+		RB_TREE_COUNT(tree, erases, 1);
+		tree->count--;
+	}
+}
+
+void rb_tree_replace(struct rb_tree *tree, void *victim, void *newdata)
+{
+	struct rb_node *vicnode = IB_DATA2NODE(victim, tree->offset);
+	struct rb_node *newnode = IB_DATA2NODE(newdata, tree->offset);
+	rb_node_replace(vicnode, newnode, &tree->root);
+	rb_node_init(vicnode);
+	if (tree->augment) {
+		/* newdata may carry a different value: fix every ancestor */
+		rb_node_augment_propagate(newnode, tree->augment);
+	}
+}
+
+/* locate data from the finger: returns the matched data, or NULL with
+ * the empty link where data should be inserted and its parent */
+static void *_rb_tree_finger(struct rb_tree *tree, void *finger, 
+		const void *data, struct rb_node **parent, struct rb_node ***link)
+{
+	int (*compare)(const void*, const void*) = tree->compare;
+	size_t offset = tree->offset;
+	struct rb_node *n = tree->root.node;
+	struct rb_node *p;
+	size_t depth = 0;
+	int hr;
+	parent[0] = NULL;
+	link[0] = &tree->root.node;
+	if (finger && n) {
+		int dir;
+		n = IB_DATA2NODE(finger, offset);
+		dir = compare(data, finger);
+		depth++;
+		if (dir == 0) {
+			RB_TREE_PROBE(tree, depth);
+			return finger;
+		}
+		/* the subtree of n covers data unless the nearest ancestor on
+		 * the side of data is not beyond it, then move to that one */
+		while (1) {
+			struct rb_node *c;
+			void *pd;
+			for (c = n, p = rb_parent(n); p; c = p, p = rb_parent(p)) {
+				if (p->child[(dir > 0)? 0 : 1] == c) break;
+			}
+			if (p == NULL) break;
+			pd = rb_node2DATA(p, offset);
+			hr = compare(data, pd);
+			depth++;
+			if (hr == 0) {
+				RB_TREE_PROBE(tree, depth);
+				return pd;
+			}
+			if ((hr > 0) != (dir > 0)) break;
+			n = p;
+		}
+		/* data is on the side dir of n */
+		parent[0] = n;
+		link[0] = &(n->child[(dir < 0)? 0 : 1]);
+	}
+	while (link[0][0]) {
+		void *nd;
+		n = link[0][0];
+		nd = rb_node2DATA(n, offset);
+		hr = compare(data, nd);
+		depth++;
+		if (hr == 0) {
+			RB_TREE_PROBE(tree, depth);
+			return nd;
+		}
+		parent[0] = n;
+		link[0] = &(n->child[(hr < 0)? 0 : 1]);
+	}
+	RB_TREE_PROBE(tree, depth);
+	return NULL;
+}
+
+void *rb_tree_find_from(struct rb_tree *tree, void *finger, const void *data)
+{
+	struct rb_node *parent, **link;
+	return _rb_tree_finger(tree, finger, data, &parent, &link);
+}
+
+/* returns NULL for success, otherwise returns conflict node with same key */
+void *rb_tree_add_from(struct rb_tree *tree, void *finger, void *data)
+{
+	struct rb_node *node = IB_DATA2NODE(data, tree->offset);
+	struct rb_node *parent, **link;
+	void *conflict = _rb_tree_finger(tree, finger, data, &parent, &link);
+	if (conflict) {
+		return conflict;
+	}
+	rb_node_link(node, parent, link);
+	if (tree->augment == NULL) {
+		rb_node_post_insert(node, &tree->root);
+	}	else {
+		rb_node_post_insert_augmented(node, &tree->root, tree->augment);
+	}
+	RB_TREE_COUNT(tree, inserts, 1);
+	tree->count++;
+	return NULL;
+}
+
+void rb_tree_clear(struct rb_tree *tree, void (*destroy)(void *data))
+{
+	struct rb_node *next = NULL;
+	while (1) {
+		struct rb_node *node = rb_node_tear(&tree->root, &next);
+		if (node == NULL) break;
+		rb_node_init(node);
+		if (destroy) destroy(rb_node2DATA(node, tree->offset));
+	}
+	tree->count = 0;
+}
+
+/* iterative walk with parent pointers, no stack required */
+void rb_tree_shape(const struct rb_tree *tree, struct rb_tree_shape *shape)
+{
+	struct rb_node *node = tree->root.node;
+	struct rb_node *from = NULL;
+	int depth = 1;
+	shape->count = 0;
+	shape->depth_sum = 0;
+	shape->height = 0;
+	while (node) {
+		struct rb_node *next;
+		if (from == rb_parent(node)) {
+			shape->count++;
+			shape->depth_sum += depth;
+			if (depth > shape->height) shape->height = depth;
+			next = (node->child[0])? node->child[0] : node->child[1];
+		}
+		else if (from == node->child[0]) {
+			next = node->child[1];
+		}
+		else {
+			next = NULL;
+		}
+		from = node;
+		if (next) {
+			node = next;
+			depth++;
+		}	else {
+			node = rb_parent(node);
+			depth--;
+		}
+	}
+}
+
+#ifdef RB_TREE_STATS
+void rb_tree_stats(const struct rb_tree *tree, struct rb_tree_stats *stats)
+{
+	stats[0] = tree->stats;
+	stats->rotations = tree->root.rotations;
+}
+
+void rb_tree_stats_reset(struct rb_tree *tree)
+{
+	size_t i;
+	tree->stats.compares = 0;
+	tree->stats.searches = 0;
+	tree->stats.inserts = 0;
+	tree->stats.erases = 0;
+	tree->stats.rotations = 0;
+	for (i = 0; i < RB_TREE_STATS_DEPTH; i++) {
+		tree->stats.depth[i] = 0;
+	}
+	tree->root.rotations = 0;
+}
+#endif
+
+
+/*--------------------------------------------------------------------*/
+/* interval tree - closed intervals ordered by (lo, hi, address)      */
+/*--------------------------------------------------------------------*/
+
+static void _rb_interval_update(struct rb_node *node)
+{
+	struct rb_interval *iv = RB_INTERVAL(node);
+	RB_INTERVAL_TYPE max = iv->hi;
+	if (node->child[0] && RB_INTERVAL(node->child[0])->max > max) 
+		max = RB_INTERVAL(node->child[0])->max;
+	if (node->child[1] && RB_INTERVAL(node->child[1])->max > max) 
+		max = RB_INTERVAL(node->child[1])->max;
+	iv->max = max;
+}
+
+const struct rb_augment rb_interval_augment = { _rb_interval_update };
+
+static inline int 
+_rb_interval_compare(const struct rb_interval *a, const struct rb_interval *b)
+{
+	if (a->lo != b->lo) return (a->lo < b->lo)? -1 : 1;
+	if (a->hi != b->hi) return (a->hi < b->hi)? -1 : 1;
+	if (a == b) return 0;
+	return ((size_t)a < (size_t)b)? -1 : 1;
+}
+
+void rb_itree_init(struct rb_itree *tree)
+{
+	tree->root.node = NULL;
+	RB_ROOT_STATS_INIT(&tree->root);
+	tree->count = 0;
+}
+
+void rb_itree_add(struct rb_itree *tree, struct rb_interval *iv)
+{
+	struct rb_node **link = &tree->root.node;
+	struct rb_node *parent = NULL;
+	ASSERTION(iv->lo <= iv->hi);
+	while (link[0]) {
+		parent = link[0];
+		if (_rb_interval_compare(iv, RB_INTERVAL(parent)) < 0) {
+			link = &(parent->child[0]);
+		}	else {
+			link = &(parent->child[1]);
+		}
+	}
+	rb_node_link(&iv->node, parent, link);
+	iv->max = iv->hi;
+	rb_node_post_insert_augmented(&iv->node, &tree->root, 
+			&rb_interval_augment);
+	tree->count++;
+}
+
+void rb_itree_remove(struct rb_itree *tree, struct rb_interval *iv)
+{
+	if (!rb_node_empty(&iv->node)) {
+		rb_node_erase_augmented(&iv->node, &tree->root, 
+				&rb_interval_augment);
+		rb_node_init(&iv->node);
+		tree->count--;
+	}
+}
+
+/* leftmost interval overlapping [lo, hi] inside the subtree */
+static struct rb_interval *
+_rb_itree_leftmost(struct rb_node *node, 
+		RB_INTERVAL_TYPE lo, RB_INTERVAL_TYPE hi)
+{
+	while (node) {
+		struct rb_interval *iv = RB_INTERVAL(node);
+		struct rb_node *left = node->child[0];
+		if (iv->max < lo) break;
+		/* if node->lo <= hi, the left subtree holds the answer when its
+		 * max reaches lo, otherwise only the left subtree can */
+		if (left && RB_INTERVAL(left)->max >= lo) {
+			node = left;
+			continue;
+		}
+		if (iv->lo > hi) break;
+		if (iv->hi >= lo) return iv;
+		node = node->child[1];
+	}
+	return NULL;
+}
+
+struct rb_interval *rb_itree_overlap_first(struct rb_itree *tree,
+		RB_INTERVAL_TYPE lo, RB_INTERVAL_TYPE hi)
+{
+	return _rb_itree_leftmost(tree->root.node, lo, hi);
+}
+
+/* one step climbs at most once to the root and descends at most once,
+ * O(log n): a right subtree is only entered when its max reaches lo,
+ * then the leftmost interval reaching lo is inside it, and if that one
+ * starts after hi, so does everything after it, the query is over */
+struct rb_interval *rb_itree_overlap_next(struct rb_interval *iv,
+		RB_INTERVAL_TYPE lo, RB_INTERVAL_TYPE hi)
+{
+	struct rb_node *node = &iv->node;
+	struct rb_node *right, *last;
+	if (iv->lo > hi) return NULL;
+	while (1) {
+		right = node->child[1];
+		if (right && RB_INTERVAL(right)->max >= lo) {
+			return _rb_itree_leftmost(right, lo, hi);
+		}
+		/* ascending from the left: node and its right subtree follow */
+		do {
+			last = node;
+			node = rb_parent(node);
+		}	while (node && node->child[1] == last);
+		if (node == NULL) break;
+		iv = RB_INTERVAL(node);
+		if (iv->lo > hi) break;
+		if (iv->hi >= lo) return iv;
+	}
+	return NULL;
+}
 
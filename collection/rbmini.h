@@ -52,19 +52,39 @@
 /* rb_node - binary search tree (can be used in rbtree & avl)         */
 /* use array for left/right child pointers to reduce cpu branches     */
 /* color won't be packed into pointers (can work without alignment)   */
+/* unless RB_NODE_PACKED is defined: nodes must be 2-byte aligned     */
 /*====================================================================*/
+#ifndef RB_NODE_PACKED
 struct rb_node
 {
 	struct rb_node *child[2];   /* 0 for left, 1 for right, reduce branch */
 	struct rb_node *parent;     /* pointing to node itself for empty node */
 	unsigned int color;         /* can also be used as balance / height */
 };
+#else
+struct rb_node
+{
+	struct rb_node *child[2];   /* 0 for left, 1 for right, reduce branch */
+	size_t parent_color;        /* parent pointer with color in bit 0 */
+};
+#endif
 
 struct ib_root
 {
 	struct rb_node *node;		/* root node */
+#ifdef RB_TREE_STATS
+	size_t rotations;           /* rotations done in this tree */
+#endif
 };
 
+/* define RB_TREE_STATS to collect per-tree counters, costs nothing
+ * when it is undefined */
+#ifdef RB_TREE_STATS
+#define RB_ROOT_STATS_INIT(r) do { (r)->rotations = 0; } while (0)
+#else
+#define RB_ROOT_STATS_INIT(r) do { } while (0)
+#endif
+
 
 /*--------------------------------------------------------------------*/
 /* NODE MACROS                                                        */
@@ -83,8 +103,32 @@ struct ib_root
 #define IB_ENTRY(ptr, type, member) \
 	rb_node2DATA(ptr, IB_OFFSET(type, member))
 
-#define rb_node_init(node) do { ((node)->parent) = (node); } while (0)
-#define rb_node_empty(node) ((node)->parent == (node))
+
+/*--------------------------------------------------------------------*/
+/* parent and color accessors, arguments may be evaluated twice       */
+/*--------------------------------------------------------------------*/
+#ifndef RB_NODE_PACKED
+#define rb_parent(n)         ((n)->parent)
+#define rb_color(n)          ((n)->color)
+#define rb_set_parent(n, p)  do { (n)->parent = (p); } while (0)
+#define rb_set_color(n, c)   do { (n)->color = (c); } while (0)
+#define rb_set_parent_color(n, p, c) do { \
+		(n)->parent = (p); (n)->color = (c); } while (0)
+#else
+#define rb_parent(n)  \
+	((struct rb_node*)((n)->parent_color & (~((size_t)1))))
+#define rb_color(n)   ((unsigned int)((n)->parent_color & 1))
+#define rb_set_parent(n, p)  do { (n)->parent_color = \
+		((n)->parent_color & 1) | ((size_t)(p)); } while (0)
+#define rb_set_color(n, c)   do { (n)->parent_color = \
+		((n)->parent_color & (~((size_t)1))) | ((size_t)(c)); } while (0)
+#define rb_set_parent_color(n, p, c) do { \
+		(n)->parent_color = ((size_t)(p)) | ((size_t)(c)); } while (0)
+#endif
+
+/* single store, never reads the old (maybe uninitialized) fields */
+#define rb_node_init(node) rb_set_parent_color(node, node, IB_RED)
+#define rb_node_empty(node) (rb_parent(node) == (node))
 
 
 #ifdef __cplusplus
@@ -104,8 +148,7 @@ void rb_node_replace(struct rb_node *victim, struct rb_node *newnode,
 
 static inline void rb_node_link(struct rb_node *node, struct rb_node *parent,
 		struct rb_node **ib_link) {
-	node->parent = parent;
-	node->color = IB_RED;
+	rb_set_parent_color(node, parent, IB_RED);
 	node->child[0] = node->child[1] = NULL;
 	ib_link[0] = node;
 }
@@ -114,6 +157,41 @@ static inline void rb_node_link(struct rb_node *node, struct rb_node *parent,
 void rb_node_post_insert(struct rb_node *node, struct ib_root *root);
 void rb_node_erase(struct rb_node *node, struct ib_root *root);
 
+/* tear down one leaf each time without rebalancing, next must be NULL
+ * at the beginning, returns NULL when the tree is empty */
+struct rb_node *rb_node_tear(struct ib_root *root, struct rb_node **next);
+
+
+/*--------------------------------------------------------------------*/
+/* rbtree - augmented tree                                            */
+/*--------------------------------------------------------------------*/
+
+/* update() recalculates the augmented data (eg. sum/min/max of the 
+ * subtree) from the node itself and its children, it will be invoked 
+ * bottom-up during insert, erase and rotation */
+struct rb_augment
+{
+	void (*update)(struct rb_node *node);
+};
+
+void rb_node_post_insert_augmented(struct rb_node *node, 
+		struct ib_root *root, const struct rb_augment *aug);
+
+void rb_node_erase_augmented(struct rb_node *node, struct ib_root *root,
+		const struct rb_augment *aug);
+
+/* update augmented data from node up to the root */
+void rb_node_augment_propagate(struct rb_node *node,
+		const struct rb_augment *aug);
+
+/* range aggregate over [lo, hi] (NULL for unbounded) in O(log n):
+ * fold() will be called with disjoint pieces in order, whole is 0 for 
+ * a single node and 1 for a whole subtree (use its augmented data) */
+void rb_node_aggregate(struct ib_root *root, const void *lo, const void *hi,
+		int (*compare)(const void *key, const struct rb_node *node),
+		void (*fold)(void *ctx, struct rb_node *node, int whole),
+		void *ctx);
+
 
 /*--------------------------------------------------------------------*/
 /* rbtree - node templates                                            */
@@ -151,6 +229,146 @@ void rb_node_erase(struct rb_node *node, struct ib_root *root);
 	}   while (0)
 
 
+/*--------------------------------------------------------------------*/
+/* rbtree - friendly interface                                        */
+/*--------------------------------------------------------------------*/
+#ifndef RB_TREE_STATS_DEPTH
+#define RB_TREE_STATS_DEPTH    32
+#endif
+
+/* operation counters, only maintained when RB_TREE_STATS is defined */
+struct rb_tree_stats
+{
+	size_t compares;            /* compare() calls in searches */
+	size_t searches;            /* find/nearest/add probes */
+	size_t inserts;
+	size_t erases;
+	size_t rotations;
+	size_t depth[RB_TREE_STATS_DEPTH];  /* probe depth histogram */
+};
+
+/* shape report: average depth is depth_sum / count */
+struct rb_tree_shape
+{
+	size_t count;
+	size_t depth_sum;           /* sum of node depths, root is 1 */
+	int height;
+};
+
+struct rb_tree
+{
+	struct ib_root root;        /* rbtree root */
+	size_t offset;              /* node offset in user data structure */
+	size_t size;                /* size of user data structure */
+	size_t count;               /* node count */
+	/* returns 0 for equal, -1 for n1 < n2, 1 for n1 > n2 */
+	int (*compare)(const void *n1, const void *n2);
+	const struct rb_augment *augment;   /* NULL for plain rbtree */
+#ifdef RB_TREE_STATS
+	struct rb_tree_stats stats;
+#endif
+};
+
+
+/* initialize rbtree, use IB_OFFSET(type, member) for "offset"
+ * eg:
+ *     rb_tree_init(&mytree, mystruct_compare,
+ *          sizeof(struct mystruct_t), 
+ *          IB_OFFSET(struct mystruct_t, node));
+ */
+void rb_tree_init(struct rb_tree *tree,
+		int (*compare)(const void*, const void*), size_t size, size_t offset);
+
+void rb_tree_init_augment(struct rb_tree *tree,
+		int (*compare)(const void*, const void*), size_t size, size_t offset,
+		const struct rb_augment *augment);
+
+void *rb_tree_first(struct rb_tree *tree);
+void *rb_tree_last(struct rb_tree *tree);
+void *rb_tree_next(struct rb_tree *tree, void *data);
+void *rb_tree_prev(struct rb_tree *tree, void *data);
+
+/* require a temporary user structure (data) which contains the key */
+void *rb_tree_find(struct rb_tree *tree, const void *data);
+void *rb_tree_nearest(struct rb_tree *tree, const void *data);
+
+/* returns NULL for success, otherwise returns conflict node with same key */
+void *rb_tree_add(struct rb_tree *tree, void *data);
+
+void rb_tree_remove(struct rb_tree *tree, void *data);
+void rb_tree_replace(struct rb_tree *tree, void *victim, void *newdata);
+
+/* finger search: start from finger (data in the tree near the key, eg.
+ * the last result) and climb only as far as needed before descending.
+ * keys next to a finger near the leaves and sorted appends from the 
+ * last data take O(1) comparisons, but the climb and the descent are
+ * O(log n) in the worst case (eg. finger at the max of the left 
+ * subtree of the root, key just above the root), not O(log d). NULL
+ * finger starts from the root */
+void *rb_tree_find_from(struct rb_tree *tree, void *finger, const void *data);
+void *rb_tree_add_from(struct rb_tree *tree, void *finger, void *data);
+
+/* tear down the whole tree in O(n) without rebalancing */
+void rb_tree_clear(struct rb_tree *tree, void (*destroy)(void *data));
+
+/* walk the tree and report height, node count and depth sum in O(n) */
+void rb_tree_shape(const struct rb_tree *tree, struct rb_tree_shape *shape);
+
+#ifdef RB_TREE_STATS
+/* copy the counters (rotations are taken from the root) */
+void rb_tree_stats(const struct rb_tree *tree, struct rb_tree_stats *stats);
+void rb_tree_stats_reset(struct rb_tree *tree);
+#endif
+
+
+/*--------------------------------------------------------------------*/
+/* interval tree - closed intervals ordered by (lo, hi, address)      */
+/*--------------------------------------------------------------------*/
+#ifndef RB_INTERVAL_TYPE
+#define RB_INTERVAL_TYPE ptrdiff_t
+#endif
+
+struct rb_interval
+{
+	struct rb_node node;
+	RB_INTERVAL_TYPE lo;        /* [lo, hi], set before adding */
+	RB_INTERVAL_TYPE hi;
+	RB_INTERVAL_TYPE max;       /* max hi in this subtree */
+};
+
+struct rb_itree
+{
+	struct ib_root root;
+	size_t count;
+};
+
+#define RB_INTERVAL(n) ((struct rb_interval*) \
+		rb_node2DATA(n, IB_OFFSET(struct rb_interval, node)))
+
+/* maintains the max endpoint, for rb_node_*_augmented */
+extern const struct rb_augment rb_interval_augment;
+
+void rb_itree_init(struct rb_itree *tree);
+
+/* same interval can be added more than once (different nodes) */
+void rb_itree_add(struct rb_itree *tree, struct rb_interval *iv);
+void rb_itree_remove(struct rb_itree *tree, struct rb_interval *iv);
+
+/* intervals overlapping [lo, hi] in ascending order, each step skips
+ * subtrees whose max endpoint is below lo, NULL for the end. every
+ * step is O(log n), so reporting k intervals costs O((k + 1) log n) */
+struct rb_interval *rb_itree_overlap_first(struct rb_itree *tree,
+		RB_INTERVAL_TYPE lo, RB_INTERVAL_TYPE hi);
+struct rb_interval *rb_itree_overlap_next(struct rb_interval *iv,
+		RB_INTERVAL_TYPE lo, RB_INTERVAL_TYPE hi);
+
+/* stabbing query: intervals containing point */
+#define rb_itree_stab_first(tree, point) \
+		rb_itree_overlap_first(tree, point, point)
+#define rb_itree_stab_next(iv, point) \
+		rb_itree_overlap_next(iv, point, point)
+
+
 #ifdef __cplusplus
 }
 #endif